@@ -0,0 +1,96 @@
+// This file contains a bump-pointer arena allocator.
+//
+// The compiler creates lots of small objects (types, variables, interned
+// strings) that all live until the end of a compilation, so there is
+// no point in freeing them one by one. An arena hands out memory by
+// bumping a pointer inside a large chunk and releases every chunk at
+// once in arena_reset(). Objects don't carry any per-object header.
+//
+// Each compilation phase has its own arena so that objects created by
+// the same phase sit next to each other in memory.
+
+#include "chibicc.h"
+
+// Default size of a chunk. An allocation larger than this gets a
+// chunk of its own.
+#define CHUNK_SIZE (1 << 20)
+
+// Every object is aligned to this boundary.
+#define ARENA_ALIGN 8
+
+struct ArenaChunk {
+  ArenaChunk *next;
+  size_t size;
+  char data[];
+};
+
+// Each thread compiles its own translation unit, so it has its own
+// arenas.
+_Thread_local Arena parse_arena;
+_Thread_local Arena type_arena;
+
+// Allocations made by the current thread since it started
+_Thread_local MemStat mem_stats[NUM_MEM_KINDS];
+
+static size_t align_up(size_t n, size_t align) {
+  return (n + align - 1) & ~(align - 1);
+}
+
+// Allocates a new chunk that can hold at least `size` bytes and makes
+// it the current chunk of `arena`.
+static void new_chunk(Arena *arena, size_t size) {
+  if (size < CHUNK_SIZE)
+    size = CHUNK_SIZE;
+
+  // calloc returns zero-filled memory, so objects handed out from a
+  // fresh chunk are already zero-initialized just like they were when
+  // each object was calloc'ed on its own.
+  ArenaChunk *chunk = calloc(1, sizeof(ArenaChunk) + size);
+  if (!chunk)
+    error("out of memory");
+  chunk->size = size;
+  arena->reserved += size;
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  arena->cur = chunk->data;
+  arena->end = chunk->data + size;
+}
+
+// Returns `size` bytes of zero-initialized memory from `arena`. `kind`
+// says what the memory is used for and is only used for statistics.
+void *arena_alloc(Arena *arena, MemKind kind, size_t size) {
+  size = align_up(size, ARENA_ALIGN);
+  mem_stats[kind].count++;
+  mem_stats[kind].bytes += size;
+
+  if (arena->end - arena->cur < size)
+    new_chunk(arena, size);
+
+  void *p = arena->cur;
+  arena->cur += size;
+  arena->used += size;
+  if (arena->peak < arena->used)
+    arena->peak = arena->used;
+  return p;
+}
+
+// Frees all objects allocated from `arena` at once. The peak usage is
+// retained so that it can be reported after the arena is recycled.
+void arena_reset(Arena *arena) {
+  ArenaChunk *chunk = arena->chunks;
+  while (chunk) {
+    ArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  arena->chunks = NULL;
+  arena->cur = arena->end = NULL;
+  arena->used = 0;
+  arena->reserved = 0;
+}
+
+// Returns the largest number of bytes that were live in `arena` at
+// any point in time.
+size_t arena_peak(Arena *arena) {
+  return arena->peak;
+}
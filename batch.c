@@ -0,0 +1,180 @@
+// This file implements batch mode, which compiles and runs many small
+// programs in one process and checks what their main() returns.
+//
+// The input is a manifest with one program per line, preceded by the
+// expected return value:
+//
+//   42 int main() { return 42; }
+//
+// Empty lines and lines starting with '#' are ignored.
+//
+// Each program is a translation unit of its own. A unit is compiled
+// from start to end on one thread, using the same code paths as
+// --run, and all per-unit state of the compiler (arenas, interned
+// strings, the scope table, the output buffers, ...) is thread-local.
+// Units are handed out to the threads with parallel_for(), and
+// everything a unit leaves behind is freed before the thread picks up
+// the next one.
+//
+// A compile error only fails the unit it occurs in: error() jumps back
+// here instead of exiting. A program that crashes or doesn't terminate
+// still takes the whole batch down with it, since it runs in our
+// address space.
+
+#include "chibicc.h"
+#include <time.h>
+
+typedef struct {
+  char *name;  // "manifest line N", for error messages
+  char *input; // Program text followed by INPUT_PADDING zero bytes
+  int len;
+  int expected;
+
+  ObjCode obj; // Machine code, freed by run_job() even after an error
+
+  bool compiled;
+  int actual;
+  double msec;
+} Unit;
+
+static double now_msec(void) {
+  // int clock_gettime(clockid_t clockid, struct timespec *tp);
+  // CLOCK_MONOTONIC: A nonsettable system-wide clock that represents monotonic time since some
+  // unspecified point in the past.
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Compiles and runs a unit. Returns only if it compiled.
+static void run_unit(Unit *u) {
+  Token *tok = tokenize_string(u->name, u->input);
+  Function *prog = parse(tok);
+
+  open_output("-", true, true);
+  codegen(prog, 1);
+
+  assemble_output(&u->obj);
+  u->actual = jit_run(&u->obj);
+  u->compiled = true;
+}
+
+// Releases everything a unit allocated, whether it compiled or not.
+// The compile server does the same after each request.
+void reset_unit(void) {
+  arena_reset(&parse_arena);
+  arena_reset(&type_arena);
+  type_reset();
+  intern_reset();
+  parse_reset();
+  reset_nodes();
+}
+
+static void run_job(void *arg, int i) {
+  Unit *u = (Unit *)arg + i;
+  double start = now_msec();
+
+  // int setjmp(jmp_buf env);
+  // The setjmp() function saves various information about the calling environment (typically,
+  // the stack pointer, the instruction pointer, possibly the values of other registers and the
+  // signal mask) in the buffer env for later use by longjmp(). In this case, setjmp() returns 0.
+  // When longjmp() is called, setjmp() returns again, this time with the value passed to
+  // longjmp().
+  jmp_buf env;
+  if (setjmp(env) == 0) {
+    error_jmp = &env;
+    run_unit(u);
+  }
+  error_jmp = NULL;
+
+  obj_free(&u->obj);
+  reset_unit();
+  u->msec = now_msec() - start;
+}
+
+// Splits the manifest into units.
+static Unit *read_manifest(char *path, int *nunits) {
+  char *p = read_file(path);
+  Unit *units = NULL;
+  int n = 0, cap = 0;
+
+  for (int line = 1; *p; line++) {
+    char *end = strchr(p, '\n');
+    if (!end)
+      end = p + strlen(p);
+
+    char *q = p;
+    while (q < end && isspace((unsigned char)*q))
+      q++;
+
+    if (q < end && *q != '#') {
+      char *prog;
+      long expected = strtol(q, &prog, 10);
+      if (prog == q)
+        error("%s:%d: expected a number", path, line);
+      while (prog < end && isspace((unsigned char)*prog))
+        prog++;
+
+      if (n == cap) {
+        cap = cap ? cap * 2 : 64;
+        units = realloc(units, cap * sizeof(Unit));
+      }
+
+      Unit *u = &units[n++];
+      *u = (Unit){.expected = expected, .len = end - prog};
+      u->input = calloc(1, u->len + 1 + INPUT_PADDING);
+      memcpy(u->input, prog, u->len);
+
+      // int snprintf(char *str, size_t size, const char *format, ...);
+      // If the output was truncated due to this limit, then the return value is the number of
+      // characters which would have been written to the final string if enough space had been
+      // available.
+      int namelen = snprintf(NULL, 0, "%s line %d", path, line);
+      u->name = malloc(namelen + 1);
+      snprintf(u->name, namelen + 1, "%s line %d", path, line);
+    }
+
+    p = *end ? end + 1 : end;
+  }
+
+  *nunits = n;
+  return units;
+}
+
+// Runs all units of a manifest on `nthreads` threads and prints a
+// line for each of them, in manifest order, followed by a summary.
+// Returns the exit status for the process.
+int run_batch(char *path, int nthreads) {
+  int n;
+  Unit *units = read_manifest(path, &n);
+
+  double start = now_msec();
+  parallel_for(n, nthreads, run_job, units);
+  double elapsed = now_msec() - start;
+
+  int passed = 0;
+  double cpu = 0;
+
+  for (int i = 0; i < n; i++) {
+    Unit *u = &units[i];
+    cpu += u->msec;
+
+    if (!u->compiled) {
+      printf("FAIL %8.3fms  %.*s => compile error\n", u->msec, u->len, u->input);
+    } else if (u->actual != u->expected) {
+      printf("FAIL %8.3fms  %.*s => %d expected, but got %d\n", u->msec, u->len, u->input,
+             u->expected, u->actual);
+    } else {
+      printf("PASS %8.3fms  %.*s => %d\n", u->msec, u->len, u->input, u->actual);
+      passed++;
+    }
+
+    free(u->input);
+    free(u->name);
+  }
+  free(units);
+
+  printf("%d passed, %d failed; %.3fms elapsed, %.3fms in units, %d threads\n", passed,
+         n - passed, elapsed, cpu, nthreads);
+  return passed == n ? 0 : 1;
+}
@@ -0,0 +1,236 @@
+// Compile-throughput benchmark.
+//
+// It generates synthetic programs in the subset of C that chibicc
+// accepts, each stressing one dimension of the compiler, at several
+// sizes, and compiles them phase by phase with the compiler's own
+// functions. For each phase it reports lines and tokens per second.
+// A rate that drops as the size grows points at a phase that is worse
+// than linear in that dimension.
+//
+// The workloads are:
+//
+//   funcs   many small functions calling each other
+//   expr    one expression nested N parentheses deep
+//   loops   for and while loops nested N deep
+//   chain   an else-if chain N links long, with an expression in each
+//   locals  one function with N local variables
+//   arrays  many 2-D arrays indexed in nested loops
+//
+// Usage: bench/compile                    run all workloads
+//        bench/compile <workload>...      run the given workloads
+//        bench/compile -g <workload> <n>  print a generated program
+
+#include "../chibicc.h"
+#include <time.h>
+
+typedef struct {
+  char *name;
+  void (*gen)(Buffer *buf, int n);
+  int sizes[4];
+} Workload;
+
+static void out(Buffer *buf, char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+
+  char *tmp = malloc(len + 1);
+  va_start(ap, fmt);
+  vsnprintf(tmp, len + 1, fmt, ap);
+  va_end(ap);
+  buf_append(buf, tmp, len);
+  free(tmp);
+}
+
+static void gen_funcs(Buffer *buf, int n) {
+  out(buf, "int f0(int a, int b) {\n  return a + b;\n}\n");
+  for (int i = 1; i < n; i++) {
+    out(buf, "int f%d(int a, int b) {\n", i);
+    out(buf, "  int x;\n");
+    out(buf, "  x = a * %d + b;\n", i % 97);
+    out(buf, "  if (x > %d)\n", i);
+    out(buf, "    return x - b;\n");
+    out(buf, "  return f%d(x, a);\n", i - 1);
+    out(buf, "}\n");
+  }
+  out(buf, "int main() {\n  return f%d(1, 2);\n}\n", n - 1);
+}
+
+static void gen_expr(Buffer *buf, int n) {
+  out(buf, "int main() {\n  int a;\n  a = 3;\n  return\n");
+  for (int i = 0; i < n; i++)
+    out(buf, "    (a %c %d %c\n", "+-*/"[i % 4], i % 10 + 1, "+-*<"[i % 4]);
+  out(buf, "    a");
+  for (int i = 0; i < n; i++)
+    out(buf, ")");
+  out(buf, ";\n}\n");
+}
+
+static void gen_loops(Buffer *buf, int n) {
+  out(buf, "int main() {\n  int s;\n  s = 0;\n");
+  for (int i = 0; i < n; i++) {
+    if (i % 2)
+      out(buf, "%*sint i%d; i%d = 0; while (i%d < 2) { i%d = i%d + 1;\n", i + 2, "", i, i, i,
+          i, i);
+    else
+      out(buf, "%*sint i%d; for (i%d = 0; i%d < 2; i%d = i%d + 1) {\n", i + 2, "", i, i, i, i,
+          i);
+  }
+  out(buf, "%*ss = s + 1;\n", n + 2, "");
+  for (int i = n - 1; i >= 0; i--)
+    out(buf, "%*s}\n", i + 2, "");
+  out(buf, "  return s;\n}\n");
+}
+
+static void gen_chain(Buffer *buf, int n) {
+  out(buf, "int main() {\n  int x; int y;\n  x = 7; y = 0;\n");
+  for (int i = 0; i < n; i++)
+    out(buf, "  %sif (x == %d) y = y + x * %d - (x - %d);\n", i ? "else " : "", i, i % 10,
+        i % 7);
+  out(buf, "  return y;\n}\n");
+}
+
+static void gen_locals(Buffer *buf, int n) {
+  out(buf, "int main() {\n  int v0;\n  v0 = 1;\n");
+  for (int i = 1; i < n; i++)
+    out(buf, "  int v%d; v%d = v%d + %d;\n", i, i, i / 2, i % 10);
+  out(buf, "  return v%d;\n}\n", n - 1);
+}
+
+static void gen_arrays(Buffer *buf, int n) {
+  for (int i = 0; i < n; i++) {
+    out(buf, "int g%d() {\n", i);
+    out(buf, "  int a[8][8];\n");
+    out(buf, "  int b[8][8];\n");
+    out(buf, "  int i; int j; int s;\n");
+    out(buf, "  s = 0;\n");
+    out(buf, "  for (i = 0; i < 8; i = i + 1)\n");
+    out(buf, "    for (j = 0; j < 8; j = j + 1) {\n");
+    out(buf, "      a[i][j] = i * j + %d;\n", i % 10);
+    out(buf, "      b[j][i] = a[i][j] - i;\n");
+    out(buf, "      s = s + a[i][j] * b[j][i];\n");
+    out(buf, "    }\n");
+    out(buf, "  return s;\n");
+    out(buf, "}\n");
+  }
+  out(buf, "int main() {\n  return 0;\n}\n");
+}
+
+static Workload workloads[] = {
+  {"funcs", gen_funcs, {1000, 2000, 4000, 8000}},
+  {"expr", gen_expr, {250, 500, 1000, 2000}},
+  {"loops", gen_loops, {250, 500, 1000, 2000}},
+  {"chain", gen_chain, {250, 500, 1000, 2000}},
+  {"locals", gen_locals, {1000, 2000, 4000, 8000}},
+  {"arrays", gen_arrays, {250, 500, 1000, 2000}},
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(*workloads))
+
+static Workload *find_workload(char *name) {
+  for (int i = 0; i < NUM_WORKLOADS; i++)
+    if (!strcmp(workloads[i].name, name))
+      return &workloads[i];
+  fprintf(stderr, "unknown workload: %s\n", name);
+  exit(1);
+}
+
+// Returns a generated program followed by the zero padding that
+// tokenize() expects.
+static char *generate(Workload *w, int n) {
+  Buffer buf = {};
+  w->gen(&buf, n);
+  char zero[INPUT_PADDING + 1] = {};
+  buf_append(&buf, zero, sizeof(zero));
+  return buf.data;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+enum { TOKENIZE, PARSE, CODEGEN, ASSEMBLE, NUM_PHASES };
+
+static char *phase_names[] = {"tokenize", "parse", "codegen", "assemble"};
+
+// Compiles `src` once and adds the time spent in each phase to `t`.
+static void compile(char *src, double *t, long *ntokens) {
+  double start = now();
+  Token *tok = tokenize_string("bench", src);
+  double t1 = now();
+  Function *prog = parse(tok);
+  double t2 = now();
+
+  open_output("-", true, true);
+  codegen(prog, 1);
+  double t3 = now();
+
+  ObjCode obj = {};
+  assemble_output(&obj);
+  double t4 = now();
+
+  t[TOKENIZE] += t1 - start;
+  t[PARSE] += t2 - t1;
+  t[CODEGEN] += t3 - t2;
+  t[ASSEMBLE] += t4 - t3;
+
+  *ntokens = tokens.len - 1; // Not counting EOF
+
+  obj_free(&obj);
+  arena_reset(&parse_arena);
+  arena_reset(&type_arena);
+  type_reset();
+  intern_reset();
+  parse_reset();
+  reset_nodes();
+}
+
+// Runs a workload at all of its sizes. Each size is compiled a few
+// times and the fastest time of each phase is reported.
+static void run(Workload *w) {
+  for (int i = 0; i < 4; i++) {
+    int n = w->sizes[i];
+    char *src = generate(w, n);
+
+    long lines = 0;
+    for (char *p = src; *p; p++)
+      lines += (*p == '\n');
+
+    double best[NUM_PHASES];
+    long ntokens;
+    for (int rep = 0; rep < 3; rep++) {
+      double t[NUM_PHASES] = {};
+      compile(src, t, &ntokens);
+      for (int j = 0; j < NUM_PHASES; j++)
+        if (rep == 0 || t[j] < best[j])
+          best[j] = t[j];
+    }
+
+    printf("%-7s n=%-5d %7ld lines %8ld tokens\n", w->name, n, lines, ntokens);
+    for (int j = 0; j < NUM_PHASES; j++)
+      printf("  %-9s %9.3f ms %10.2f Mlines/s %10.2f Mtokens/s\n", phase_names[j],
+             best[j] * 1e3, lines / best[j] / 1e6, ntokens / best[j] / 1e6);
+    free(src);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc == 4 && !strcmp(argv[1], "-g")) {
+    char *src = generate(find_workload(argv[2]), atoi(argv[3]));
+    fputs(src, stdout);
+    return 0;
+  }
+
+  if (argc == 1) {
+    for (int i = 0; i < NUM_WORKLOADS; i++)
+      run(&workloads[i]);
+    return 0;
+  }
+
+  for (int i = 1; i < argc; i++)
+    run(find_workload(argv[i]));
+  return 0;
+}
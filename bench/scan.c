@@ -0,0 +1,116 @@
+// Microbenchmark for the tokenizer's scanning kernels.
+//
+// It generates a buffer that looks like machine-generated source code
+// (deep indentation, long identifiers, numbers and punctuators) and
+// walks it the way tokenize() does, once with the byte-at-a-time
+// <ctype.h> loop the tokenizer used to have and once with each set of
+// kernels in scan.c. The result is reported in bytes per second.
+//
+// Usage: bench/scan [size-in-MiB]
+
+#include "../chibicc.h"
+#include <time.h>
+
+static char *gen_input(size_t size) {
+  // Aligned loads in the kernels may read up to the end of the block
+  // holding the terminator, which is within the allocation anyway.
+  char *buf = malloc(size + INPUT_PADDING + 1);
+  size_t len = 0;
+  unsigned seed = 1;
+
+  while (len + 256 < size) {
+    seed = seed * 1103515245 + 12345;
+    int indent = 4 + (seed >> 16) % 40;
+    memset(buf + len, ' ', indent);
+    len += indent;
+
+    len += sprintf(buf + len, "generated_identifier_%u = other_long_name_%u + %u;\n",
+                   seed % 100000, (seed >> 8) % 100000, (seed >> 4) % 1000000);
+  }
+  memset(buf + len, 0, INPUT_PADDING + 1);
+  return buf;
+}
+
+// The loop tokenize() had before the kernels were introduced.
+static size_t walk_ctype(char *p) {
+  size_t ntoks = 0;
+  while (*p) {
+    if (isspace(*p)) {
+      p++;
+      continue;
+    }
+    if (isdigit(*p)) {
+      while (isdigit(*p))
+        p++;
+    } else if (isalpha(*p) || *p == '_') {
+      do {
+        p++;
+      } while (isalnum(*p) || *p == '_');
+    } else {
+      p++;
+    }
+    ntoks++;
+  }
+  return ntoks;
+}
+
+static size_t walk(Scanner *s, char *p) {
+  size_t ntoks = 0;
+  while (*p) {
+    unsigned char cls = char_class[(unsigned char)*p];
+    if (cls & CC_SPACE) {
+      p = s->skip_space(p);
+      continue;
+    }
+    if (cls & CC_DIGIT)
+      p = s->skip_digits(p);
+    else if (cls & CC_IDENT1)
+      p = s->skip_ident(p + 1);
+    else
+      p++;
+    ntoks++;
+  }
+  return ntoks;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(char *name, size_t size, size_t ntoks, double secs) {
+  printf("%-8s %10.1f MB/s  (%zu tokens)\n", name, size / secs / 1e6, ntoks);
+}
+
+int main(int argc, char **argv) {
+  size_t size = (argc > 1 ? (size_t)atoi(argv[1]) : 64) << 20;
+  char *buf = gen_input(size);
+  size = strlen(buf);
+  init_scanner();
+
+  double t = now();
+  size_t ntoks = walk_ctype(buf);
+  report("ctype", size, ntoks, now() - t);
+
+  Scanner *kernels[] = {
+    &scan_scalar,
+#ifdef __x86_64__
+    &scan_sse2,
+    __builtin_cpu_supports("avx2") ? &scan_avx2 : NULL,
+#endif
+  };
+
+  for (int i = 0; i < sizeof(kernels) / sizeof(*kernels); i++) {
+    if (!kernels[i])
+      continue;
+    t = now();
+    size_t n = walk(kernels[i], buf);
+    report(kernels[i]->name, size, n, now() - t);
+    if (n != ntoks) {
+      fprintf(stderr, "%s: token count mismatch\n", kernels[i]->name);
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,310 @@
+// This file implements the compilation cache (--cache <dir>), which
+// keeps the assembly of every function on disk and reuses it the next
+// time the same function is compiled.
+//
+// A function is looked up by its key: its tokens, spelled out one after
+// another, after a line that identifies the compiler. Whitespace and
+// comments don't end up in the key, and neither does anything outside
+// the function definition. That is enough, since the code of a function
+// depends on nothing else: calls are compiled from their arguments
+// alone, with no prototypes to consult. The compiler is identified by
+// the size and modification time of its executable, so rebuilding it
+// empties the cache in effect.
+//
+// Each entry is a file named after the 64-bit FNV hash of the key. The
+// file holds the key itself, so that a hash collision is a miss rather
+// than wrong code, followed by the assembly text:
+//
+//   <key length>\n<key><assembly>
+//
+// Labels are numbered per translation unit (see codegen()), so the same
+// function gets different label numbers depending on what comes before
+// it. Entries are stored with the numbers rebased to start at 0 and are
+// rebased to the function's own range when they are used, which makes a
+// hit byte-identical to a fresh compilation.
+//
+// Entries are written to a temporary file and renamed into place, so a
+// concurrent compiler never sees half an entry. A hit bumps the
+// modification time of its entry, and when the cache grows beyond its
+// size limit, the entries used least recently are removed.
+//
+// The cache is only an accelerator: if it cannot be read or written,
+// functions are just compiled as usual.
+
+#include "chibicc.h"
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+
+// Bump this when the format of entries changes.
+#define CACHE_VERSION 1
+
+char *cache_dir;
+size_t cache_max_size = 64 << 20;
+
+static uint64_t fnv_hash(char *s, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < len; i++) {
+    hash *= 0x100000001b3;
+    hash ^= (unsigned char)s[i];
+  }
+  return hash;
+}
+
+// Appends a formatted string to `buf`.
+static void buf_printf(Buffer *buf, char *fmt, ...) {
+  char tmp[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+  va_end(ap);
+  buf_append(buf, tmp, len);
+}
+
+// The first line of every key
+static char header[128];
+
+static void init_header(void) {
+  // int stat(const char *restrict pathname, struct stat *restrict statbuf);
+  // /proc/self/exe: This file is a symbolic link containing the actual pathname of the executed
+  // command.
+  struct stat st = {};
+  stat("/proc/self/exe", &st);
+  snprintf(header, sizeof(header), "chibicc cache %d %lld %lld.%09ld\n", CACHE_VERSION,
+           (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+}
+
+// Appends the key of `fn` to `buf`. The tokens belong to the calling
+// thread, so this must run on the thread that parsed `fn`.
+void cache_key(Function *fn, Buffer *buf) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, init_header);
+  buf_append(buf, header, strlen(header));
+
+  // A token never contains a space, so separating tokens with one
+  // keeps "a b" and "ab" apart.
+  for (Token *tok = fn->tok; tok < fn->tok + fn->ntokens; tok++) {
+    buf_append(buf, token_loc(tok), tok->len);
+    buf_append(buf, " ", 1);
+  }
+}
+
+// Returns the path of the entry for `key`, in a static buffer of the
+// calling thread.
+static char *entry_path(Buffer *key) {
+  static _Thread_local char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%016llx", cache_dir,
+           (unsigned long long)fnv_hash(key->data, key->len));
+  return path;
+}
+
+// Adds `delta` to the number of every numbered local label in
+// `text` and appends the result to `out`. Numbered labels look like
+// ".L.else.3"; ".L.return.main" has no number and is copied as it is.
+static void rebase_labels(char *text, size_t len, int delta, Buffer *out) {
+  char *end = text + len;
+  char *p = text;
+
+  for (;;) {
+    // Labels are the only things in the output starting with ".L.".
+    char *q = p;
+    while ((q = memchr(q, '.', end - q)) && (end - q < 3 || memcmp(q, ".L.", 3)))
+      q++;
+    if (!q)
+      break;
+
+    q += 3;
+    while (q < end && islower((unsigned char)*q))
+      q++;
+    if (q + 1 >= end || *q != '.' || !isdigit((unsigned char)q[1])) {
+      buf_append(out, p, q - p);
+      p = q;
+      continue;
+    }
+
+    q++;
+    buf_append(out, p, q - p);
+    long n = strtol(q, &p, 10);
+    buf_printf(out, "%ld", n + delta);
+  }
+  buf_append(out, p, end - p);
+}
+
+// Reads a whole file into `buf`. Returns false if it can't.
+static bool read_entry(char *path, Buffer *buf) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return false;
+  }
+
+  buf->data = malloc(st.st_size + 1);
+  buf->cap = st.st_size + 1;
+  buf->len = 0;
+
+  while (buf->len < st.st_size) {
+    ssize_t n = read(fd, buf->data + buf->len, st.st_size - buf->len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    buf->len += n;
+  }
+  close(fd);
+  return buf->len == st.st_size;
+}
+
+// Looks up the function whose key is `key`. On a hit, appends its
+// assembly with labels starting at `label_base` to `out` and returns
+// true.
+bool cache_lookup(Buffer *key, int label_base, Buffer *out) {
+  char *path = entry_path(key);
+  Buffer entry = {};
+  bool hit = false;
+
+  if (read_entry(path, &entry)) {
+    char *p = entry.data;
+    char *end = entry.data + entry.len;
+    char *nl = memchr(p, '\n', end - p);
+
+    if (nl) {
+      size_t keylen = strtoul(p, NULL, 10);
+      p = nl + 1;
+      if (keylen == key->len && keylen <= end - p && !memcmp(p, key->data, keylen)) {
+        p += keylen;
+        rebase_labels(p, end - p, label_base, out);
+        hit = true;
+
+        // int utimensat(int dirfd, const char *pathname, const struct timespec times[2],
+        //               int flags);
+        // If times is NULL, then both timestamps are set to the current time.
+        utimensat(AT_FDCWD, path, NULL, 0);
+      }
+    }
+  }
+
+  buf_free(&entry);
+  return hit;
+}
+
+// Stores the assembly `text` of the function whose key is `key`.
+// `label_base` is the first label number the text uses.
+void cache_store(Buffer *key, int label_base, Buffer *text) {
+  // int mkdir(const char *pathname, mode_t mode);
+  // EEXIST: pathname already exists (not necessarily as a directory).
+  if (mkdir(cache_dir, 0777) == -1 && errno != EEXIST)
+    return;
+
+  Buffer entry = {};
+  buf_printf(&entry, "%zu\n", key->len);
+  buf_append(&entry, key->data, key->len);
+  rebase_labels(text->data, text->len, -label_base, &entry);
+
+  // int mkstemp(char *template);
+  // The mkstemp() function generates a unique temporary filename from template, creates and
+  // opens the file, and returns an open file descriptor for the file. The last six characters of
+  // template must be "XXXXXX" and these are replaced with a string that makes the filename
+  // unique.
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s/tmp.XXXXXX", cache_dir);
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    buf_free(&entry);
+    return;
+  }
+
+  bool ok = true;
+  for (char *p = entry.data; ok && p < entry.data + entry.len;) {
+    ssize_t n = write(fd, p, entry.data + entry.len - p);
+    if (n == -1 && errno == EINTR)
+      continue;
+    ok = n > 0;
+    p += ok ? n : 0;
+  }
+  ok = !close(fd) && ok;
+
+  // int rename(const char *oldpath, const char *newpath);
+  // If newpath already exists, it will be atomically replaced, so that there is no point at which
+  // another process attempting to access newpath will find it missing.
+  if (!ok || rename(tmp, entry_path(key)) == -1)
+    unlink(tmp);
+  buf_free(&entry);
+}
+
+typedef struct {
+  char name[32];
+  off_t size;
+  struct timespec mtime;
+} Entry;
+
+static int cmp_mtime(const void *x, const void *y) {
+  const struct timespec *a = &((const Entry *)x)->mtime;
+  const struct timespec *b = &((const Entry *)y)->mtime;
+  if (a->tv_sec != b->tv_sec)
+    return a->tv_sec < b->tv_sec ? -1 : 1;
+  if (a->tv_nsec != b->tv_nsec)
+    return a->tv_nsec < b->tv_nsec ? -1 : 1;
+  return 0;
+}
+
+// Removes the entries used least recently until the cache fits in
+// cache_max_size. Returns the number of entries removed.
+int cache_trim(void) {
+  // DIR *opendir(const char *name);
+  // struct dirent *readdir(DIR *dirp);
+  // The readdir() function returns a pointer to a dirent structure representing the next
+  // directory entry in the directory stream pointed to by dirp. It returns NULL on reaching the
+  // end of the directory stream.
+  DIR *dir = opendir(cache_dir);
+  if (!dir)
+    return 0;
+
+  Entry *entries = NULL;
+  int n = 0, cap = 0;
+  size_t total = 0;
+
+  for (struct dirent *de; (de = readdir(dir));) {
+    // Entries are named by 16 hex digits. Leave anything else alone.
+    if (strlen(de->d_name) != 16 || strspn(de->d_name, "0123456789abcdef") != 16)
+      continue;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+    struct stat st;
+    if (stat(path, &st) == -1)
+      continue;
+
+    if (n == cap) {
+      cap = cap ? cap * 2 : 64;
+      entries = realloc(entries, cap * sizeof(Entry));
+    }
+    Entry *e = &entries[n++];
+    strcpy(e->name, de->d_name);
+    // st_blocks: This field indicates the number of blocks allocated to the file, in 512-byte
+    // units.
+    e->size = st.st_blocks * 512;
+    e->mtime = st.st_mtim;
+    total += e->size;
+  }
+  closedir(dir);
+
+  int removed = 0;
+  if (total > cache_max_size) {
+    qsort(entries, n, sizeof(Entry), cmp_mtime);
+    for (int i = 0; i < n && total > cache_max_size; i++) {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s/%s", cache_dir, entries[i].name);
+      if (unlink(path) == 0) {
+        total -= entries[i].size;
+        removed++;
+      }
+    }
+  }
+
+  free(entries);
+  return removed;
+}
@@ -1,15 +1,124 @@
 // https://www.gnu.org/software/libc/manual/html_node/Feature-Test-Macros.html
 #define _POSIX_C_SOURCE 200809L
+// _DEFAULT_SOURCE exposes BSD/SVID extensions such as MAP_ANONYMOUS.
+#define _DEFAULT_SOURCE
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdnoreturn.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 typedef struct Type Type;
 typedef struct Node Node;
+typedef struct ObjCode ObjCode;
+
+#define unreachable() \
+  error("internal error at %s:%d", __FILE__, __LINE__)
+
+//
+// arena.c
+//
+
+typedef struct ArenaChunk ArenaChunk;
+
+// Bump-pointer allocator
+typedef struct {
+  ArenaChunk *chunks; // Chunks allocated so far, newest first
+  char *cur;          // Next free byte in the newest chunk
+  char *end;          // End of the newest chunk
+  size_t used;        // Bytes handed out since the last reset
+  size_t peak;        // Largest value `used` has ever reached
+  size_t reserved;    // Bytes in chunks
+} Arena;
+
+// What an allocation is for, for -fmem-report
+typedef enum {
+  MEM_TOKEN,
+  MEM_NODE,
+  MEM_TYPE,
+  MEM_OBJ,
+  MEM_FUNCTION,
+  MEM_STRING,
+  NUM_MEM_KINDS,
+} MemKind;
+
+typedef struct {
+  long count;   // Number of allocations
+  size_t bytes; // Bytes allocated, including alignment padding
+} MemStat;
+
+extern _Thread_local MemStat mem_stats[NUM_MEM_KINDS];
+
+// One arena per compilation phase. Tokens are kept in an array of
+// their own (see tokenize.c).
+extern _Thread_local Arena parse_arena;
+extern _Thread_local Arena type_arena;
+
+void *arena_alloc(Arena *arena, MemKind kind, size_t size);
+void arena_reset(Arena *arena);
+size_t arena_peak(Arena *arena);
+
+//
+// hashmap.c
+//
+
+typedef struct {
+  char *key;
+  int keylen;
+  void *val;
+} HashEntry;
+
+typedef struct {
+  HashEntry *buckets;
+  int capacity;
+  int used;
+} HashMap;
+
+void *hashmap_get2(HashMap *map, char *key, int keylen);
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val);
+void hashmap_clear(HashMap *map);
+char *intern(char *s, int len);
+void intern_reset(void);
+
+//
+// scan.c
+//
+
+// Character classes
+#define CC_SPACE  1 // " \t\n\v\f\r"
+#define CC_DIGIT  2 // [0-9]
+#define CC_IDENT1 4 // [a-zA-Z_]
+#define CC_IDENT2 8 // [a-zA-Z_0-9]
+
+extern unsigned char char_class[256];
+
+// A set of scanning kernels. Each function returns a pointer to the
+// first character at or after its argument that is not in the class.
+typedef struct {
+  char *name;
+  char *(*skip_space)(char *p);
+  char *(*skip_ident)(char *p);
+  char *(*skip_digits)(char *p);
+} Scanner;
+
+extern Scanner scan_scalar;
+#ifdef __x86_64__
+extern Scanner scan_sse2;
+extern Scanner scan_avx2;
+#endif
+extern Scanner *scanner;
+
+void init_scanner(void);
 
 //
 // tokenize.c
@@ -24,23 +133,115 @@ typedef enum {
   TK_EOF,     // End-of-file markers
 } TokenKind;
 
+// Punctuator and keyword IDs. The tokenizer stores one in every
+// punctuator and keyword token so that the parser can dispatch on an
+// integer instead of comparing strings.
+typedef enum {
+  ID_NONE,      // Identifiers, numeric literals and EOF
+
+  // Punctuators
+  P_EQ,         // ==
+  P_NE,         // !=
+  P_LE,         // <=
+  P_GE,         // >=
+  P_NOT,        // !
+  P_DQUOTE,     // "
+  P_HASH,       // #
+  P_DOLLAR,     // $
+  P_MOD,        // %
+  P_AMP,        // &
+  P_SQUOTE,     // '
+  P_LPAREN,     // (
+  P_RPAREN,     // )
+  P_STAR,       // *
+  P_PLUS,       // +
+  P_COMMA,      // ,
+  P_MINUS,      // -
+  P_DOT,        // .
+  P_SLASH,      // /
+  P_COLON,      // :
+  P_SEMI,       // ;
+  P_LT,         // <
+  P_ASSIGN,     // =
+  P_GT,         // >
+  P_QUESTION,   // ?
+  P_AT,         // @
+  P_LBRACKET,   // [
+  P_BACKSLASH,  // backslash
+  P_RBRACKET,   // ]
+  P_CARET,      // ^
+  P_BACKQUOTE,  // `
+  P_LBRACE,     // {
+  P_OR,         // |
+  P_RBRACE,     // }
+  P_TILDE,      // ~
+
+  // Keywords
+  KW_RETURN,    // "return"
+  KW_IF,        // "if"
+  KW_ELSE,      // "else"
+  KW_FOR,       // "for"
+  KW_WHILE,     // "while"
+  KW_INT,       // "int"
+
+  NUM_TOKEN_IDS,
+} TokenId;
+
+// Punctuators come before keywords in TokenId.
+#define FIRST_KEYWORD KW_RETURN
+
 // Token type
+//
+// The tokens of a translation unit are stored in source order in one
+// array, so the token after `tok` is simply `tok + 1`. The stream ends
+// with a TK_EOF token, past which the parser never looks. A token is 16
+// bytes and refers to its text by offset, so the array holds no
+// pointers.
 typedef struct Token Token;
 struct Token {
-  TokenKind kind; // Token kind
-  Token *next;    // Next token
-  int val;        // If kind is TK_NUM, its value
-  char *loc;      // Token location
-  int len;        // Token length
+  uint32_t offset; // Token location, as an offset into the input
+  uint32_t len;    // Token length
+  int32_t val;     // If kind is TK_NUM, its value
+  uint8_t kind;    // Token kind (TokenKind)
+  uint8_t id;      // If kind is TK_PUNCT or TK_KEYWORD, its ID (TokenId)
 };
 
-void error(char *fmt, ...);
-void error_at(char *loc, char *fmt, ...);
-void error_tok(Token *tok, char *fmt, ...);
+// Growable array of tokens
+typedef struct {
+  Token *data;
+  int len;
+  int cap;
+} TokenArray;
+
+// The tokens of the current translation unit, the input they were
+// read from and its name
+extern _Thread_local TokenArray tokens;
+extern _Thread_local char *current_input;
+extern _Thread_local char *current_filename;
+
+// Returns the location of a token in the input.
+static inline char *token_loc(Token *tok) {
+  return current_input + tok->offset;
+}
+
+noreturn void error(char *fmt, ...);
+noreturn void error_at(char *loc, char *fmt, ...);
+noreturn void error_tok(Token *tok, char *fmt, ...);
 bool equal(Token *tok, char *op);
-Token *skip(Token *tok, char *op);
-bool consume(Token **rest, Token *tok, char *str);
+Token *skip(Token *tok, TokenId id);
+bool consume(Token **rest, Token *tok, TokenId id);
 Token *tokenize(char *input);
+Token *tokenize_string(char *name, char *input);
+Token *tokenize_file(char *path);
+char *read_file(char *path);
+void free_file(char *buf);
+
+extern _Thread_local jmp_buf *error_jmp;
+extern _Thread_local FILE *error_file;
+
+// Number of zero bytes guaranteed to follow the input returned by
+// read_file, in addition to the terminating NUL.
+#define INPUT_PADDING 64
 
 //
 // parse.c
@@ -50,9 +251,14 @@ Token *tokenize(char *input);
 typedef struct Obj Obj;
 struct Obj {
   Obj *next;
-  char *name; // Variable name
+  char *name; // Variable name (interned)
   Type *ty;   // Type
-  int offset; // Offset from RBP
+  int offset; // Offset from RBP, if the variable lives in memory
+  int vreg;   // Virtual register holding the variable, or 0
+
+  // True if the program takes the address of the variable, which then
+  // has to live in memory.
+  bool addr_taken;
 };
 
 // Function
@@ -62,6 +268,9 @@ struct Function {
   char *name;
   Obj *params;
 
+  Token *tok;  // First token of the definition
+  int ntokens; // Number of tokens in the definition
+
   Node *body;
   Obj *locals;
   int stack_size;
@@ -91,35 +300,103 @@ typedef enum {
   ND_NUM,       // Integer
 } NodeKind;
 
+// Nodes live in a per-thread pool and refer to each other by index
+// into the pool rather than by pointer. Index 0 is never used, so it
+// plays the role of NULL.
+typedef uint32_t NodeId;
+
 // AST node type
+//
+// Only the fields of the union member that matches `kind` are valid.
+// Walkers should use the node_lhs() etc. accessors below, which turn
+// indices back into pointers.
 struct Node {
   NodeKind kind; // Node kind
-  Node *next;    // Next node
+  NodeId next;   // Next statement in a block or argument in a call
   Type *ty;      // Type, e.g. int or pointer to int
   Token *tok;    // Representative token
 
-  Node *lhs;     // Left-hand side
-  Node *rhs;     // Right-hand side
+  union {
+    // Operators, "return" and expression statements. Unary ones use
+    // only `lhs`.
+    struct {
+      NodeId lhs;
+      NodeId rhs;
+    };
 
-  // "if" or "for" statement
-  Node *cond;
-  Node *then;
-  Node *els;
-  Node *init;
-  Node *inc;
+    // "if" uses cond, then and els. "for" and "while" use init, cond,
+    // inc and then.
+    struct {
+      NodeId cond;
+      NodeId then;
+      union {
+        NodeId els;
+        NodeId inc;
+      };
+      NodeId init;
+    };
 
-  // Block
-  Node *body;
+    // Block
+    NodeId body;
 
-  // Function call
-  char *funcname;
-  Node *args;
+    // Function call
+    struct {
+      char *funcname;
+      NodeId args;
+    };
 
-  Obj *var;      // Used if kind == ND_VAR
-  int val;       // Used if kind == ND_NUM
+    Obj *var; // Used if kind == ND_VAR
+    int val;  // Used if kind == ND_NUM
+  };
 };
 
+// The pool is made of slabs of 2^NODE_SLAB_SHIFT node-sized slots.
+// The upper bits of a NodeId select a slab and the lower bits a slot
+// in it. Each slab starts at a multiple of NODE_SLAB_ALIGN, and its
+// first slot holds the slab's index instead of a node, so that a node's
+// id can be found from its address alone.
+#define NODE_SLAB_SHIFT 15
+#define NODE_SLAB_ALIGN ((uintptr_t)2 << 20)
+
+// Slabs of the current thread's pool, indexed by id >> NODE_SLAB_SHIFT
+extern _Thread_local Node **node_slabs;
+
+Node *alloc_node(void);
+void reset_nodes(void);
+size_t nodes_used(void);
+
+static inline Node *get_node(NodeId id) {
+  if (!id)
+    return NULL;
+  return node_slabs[id >> NODE_SLAB_SHIFT] + (id & ((1 << NODE_SLAB_SHIFT) - 1));
+}
+
+static inline NodeId node_id(Node *node) {
+  if (!node)
+    return 0;
+  Node *slab = (Node *)((uintptr_t)node & ~(NODE_SLAB_ALIGN - 1));
+  return (*(NodeId *)slab << NODE_SLAB_SHIFT) | (NodeId)(node - slab);
+}
+
+static inline Node *node_next(Node *node) { return get_node(node->next); }
+static inline Node *node_lhs(Node *node) { return get_node(node->lhs); }
+static inline Node *node_rhs(Node *node) { return get_node(node->rhs); }
+static inline Node *node_cond(Node *node) { return get_node(node->cond); }
+static inline Node *node_then(Node *node) { return get_node(node->then); }
+static inline Node *node_els(Node *node) { return get_node(node->els); }
+static inline Node *node_init(Node *node) { return get_node(node->init); }
+static inline Node *node_inc(Node *node) { return get_node(node->inc); }
+static inline Node *node_body(Node *node) { return get_node(node->body); }
+static inline Node *node_args(Node *node) { return get_node(node->args); }
+
 Function *parse(Token *tok);
+void parse_reset(void);
+
+//
+// optimize.c
+//
+
+void optimize(Function *fn);
 
 //
 // type.c
@@ -146,29 +423,274 @@ struct Type {
   // the C spec.
   Type *base;
 
-  // Declaration
-  Token *name;
-
   // Array
   int array_len;
 
   // Function type
   Type *return_ty;
-  Type *params;
-  Type *next;
+  Type **params;
+  int nparams;
+
+  // The structure of the type, under which it is interned (see type.c)
+  uintptr_t key[];
 };
 
 extern Type *ty_int;
 
 bool is_integer(Type *ty);
-Type *copy_type(Type *ty);
 Type *pointer_to(Type *base);
-Type *func_type(Type *return_ty);
+Type *func_type(Type *return_ty, Type **params, int nparams);
 Type *array_of(Type *base, int size);
 void add_type(Node *node);
+void type_reset(void);
+
+//
+// emit.c
+//
+
+// Growable byte buffer
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} Buffer;
+
+void buf_append(Buffer *buf, char *s, size_t len);
+void buf_free(Buffer *buf);
+void emit_to(Buffer *buf);
+void emit(char *s);
+void emit_num(long val);
+void emit_imm(long val);
+void emit_mem(int offset, char *reg);
+void emit_label(char *prefix, int n);
+void open_output(char *path, bool count_only, bool object);
+void open_output_buffer(Buffer *buf, bool object);
+void write_output(Buffer *buf);
+void assemble_output(ObjCode *obj);
+size_t close_output(void);
+void discard_output(void);
+
+//
+// encode.c
+//
+
+// A global symbol defined or referenced by the code
+typedef struct {
+  char *name;
+  bool defined; // Defined in this unit
+  int offset;   // Offset in the code, if defined
+  int size;     // Size in bytes, if defined
+} ObjSym;
+
+// A 32-bit PC-relative reference to an undefined symbol
+typedef struct {
+  int offset; // Position of the field to be patched
+  int sym;    // Index into ObjCode::syms
+  int addend;
+} ObjReloc;
+
+// Machine code of a translation unit
+struct ObjCode {
+  Buffer code;
+
+  ObjSym *syms;
+  int nsyms;
+  int sym_cap;
+
+  ObjReloc *relocs;
+  int nrelocs;
+  int reloc_cap;
+};
+
+void assemble(char *text, size_t len, ObjCode *obj);
+void obj_free(ObjCode *obj);
+
+//
+// elf.c
+//
+
+void write_elf(ObjCode *obj, Buffer *out);
+
+//
+// jit.c
+//
+
+int jit_run(ObjCode *obj);
+
+//
+// parallel.c
+//
+
+int num_cpus(void);
+void parallel_for(int n, int nthreads, void (*fn)(void *arg, int i), void *arg);
+
+//
+// cache.c
+//
+
+extern char *cache_dir;       // NULL if the cache is off
+extern size_t cache_max_size; // In bytes
+
+void cache_key(Function *fn, Buffer *buf);
+bool cache_lookup(Buffer *key, int label_base, Buffer *out);
+void cache_store(Buffer *key, int label_base, Buffer *text);
+int cache_trim(void);
+
+//
+// regalloc.c
+//
+
+// x86-64 general-purpose registers, numbered as in their encodings
+typedef enum {
+  REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+  REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+} Reg;
+
+// Registers that pass the first six integer arguments
+extern Reg arg_regs[6];
+
+// The code generator lowers each function to a linear list of
+// instructions that operate on an unlimited supply of virtual
+// registers, numbered from 1. Variables that never have their address
+// taken get a virtual register of their own; everything else lives in
+// memory and is reached with IR_ADDR, IR_LOAD and IR_STORE.
+typedef enum {
+  IR_IMM,   // dst = val
+  IR_MOV,   // dst = a
+  IR_NEG,   // dst = -a
+  IR_ADD,   // dst = a + b
+  IR_SUB,   // dst = a - b
+  IR_MUL,   // dst = a * b
+  IR_DIV,   // dst = a / b
+  IR_MULH,  // dst = the high 64 bits of the 128-bit product a * val
+  IR_SHL,   // dst = a << val
+  IR_SAR,   // dst = a >> val, shifting in copies of the sign bit
+  IR_SHR,   // dst = a >> val, shifting in zeros
+  IR_SET,   // dst = (a cc b)
+  IR_ADDR,  // dst = &var + disp
+  IR_LOAD,  // dst = *(a + disp), or from var + disp if `var` is set
+  IR_STORE, // *(a + disp) = b, or to var + disp if `var` is set
+  IR_CALL,  // dst = funcname(args...)
+  IR_LABEL, // label:
+  IR_JMP,   // goto label
+  IR_BR,    // if (a cc b) goto label
+  IR_RET,   // return a
+} IrOp;
+
+// Condition codes. A condition and its negation differ in the lowest
+// bit.
+typedef enum { CC_E, CC_NE, CC_L, CC_GE, CC_LE, CC_G } CondCode;
+
+typedef struct {
+  IrOp op;
+  CondCode cc;
+  int dst, a, b; // Virtual registers, or 0 if not used
+  bool imm;      // If true, the second operand is `val` instead of b
+  long val;
+  int label;     // Label number within the function
+  int disp;      // IR_ADDR, IR_LOAD, IR_STORE: bytes added to the address
+  int args;      // IR_CALL: index of the first argument in IrFunc::args
+  int nargs;
+  union {
+    Obj *var;       // IR_ADDR, IR_LOAD, IR_STORE
+    char *funcname; // IR_CALL
+  };
+} Ir;
+
+// Where a virtual register lives
+typedef enum {
+  LOC_NONE,  // Nowhere; its value is never read
+  LOC_REG,   // In register `reg`
+  LOC_STACK, // In the stack slot at `val`(%rbp)
+  LOC_IMM,   // An immediate operand `val`; not made by the allocator
+} LocKind;
+
+typedef struct {
+  LocKind kind;
+  Reg reg;
+  long val;
+} Loc;
+
+typedef struct {
+  Ir *code;
+  int ncode;
+  int *args;          // Arguments of all calls, as virtual registers
+  int nargs;
+  int nvregs;         // Virtual registers are 1 to nvregs,
+  int nvars;          // of which 1 to nvars hold variables
+  int param_vregs[6]; // Virtual registers of the parameters, or 0
+  int nlabels;
+
+  // Filled in by regalloc()
+  Loc *locs;          // Indexed by virtual register
+  int frame_size;     // Bytes below %rbp, including spill slots
+  uint32_t used_regs; // Bit mask of the registers handed out
+} IrFunc;
+
+void regalloc(IrFunc *fn, int frame_size);
 
 //
 // codegen.c
 //
 
-void codegen(Function *prog);
+void codegen(Function *prog, int nthreads);
+
+//
+// timer.c
+//
+
+typedef enum {
+  T_READ,
+  T_TOKENIZE,
+  T_PARSE,
+  T_OPTIMIZE,
+  T_CODEGEN,
+  T_LVAR_OFFSETS,
+  T_REGALLOC,
+  T_OUTPUT,
+  T_ASSEMBLE,
+  T_RUN,
+  NUM_TIMERS,
+} TimerId;
+
+// Counters reported by -ftime-report
+typedef struct {
+  long tokens;
+  long nodes;
+  long functions;
+  long instructions;
+  long output_bytes;
+  long constants_folded;
+  long exprs_simplified;
+  long branches_folded;
+  long cache_hits;
+  long cache_misses;
+  long cache_evictions;
+} Counters;
+
+extern bool time_report;
+extern _Thread_local Counters counters;
+
+void timer_start(TimerId id);
+void timer_stop(TimerId id);
+void print_time_report(bool json);
+
+//
+// memreport.c
+//
+
+void print_mem_report(Function *prog);
+
+//
+// batch.c
+//
+
+int run_batch(char *path, int nthreads);
+void reset_unit(void);
+
+//
+// serve.c
+//
+
+int run_server(char *path, int nthreads);
+int run_client(char *path, char *input_path, char *output_path, bool object, bool count_bytes);
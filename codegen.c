@@ -1,7 +1,17 @@
 #include "chibicc.h"
 
-static int depth;
+// Each function is compiled in three steps. The AST is lowered to IR,
+// a list of instructions over virtual registers (see chibicc.h);
+// regalloc() decides where each virtual register lives; and the IR is
+// emitted as assembly with those locations filled in.
+//
+// Functions are compiled independently of each other, possibly on
+// different threads, so the code generator's state is per thread: the
+// IR of the function being compiled, the function itself and the next
+// label number.
+//
 // Register    Usage callee                                              saved
+// %rax     temporary register; 1st return register                       No
 // %rbx     callee-saved register                                         Yes
 // %rcx     used to pass 4th integer argument to functions                No
 // %rdx     used to pass 3rd argument to functions; 2nd return register   No
@@ -11,30 +21,63 @@ static int depth;
 // %rdi     used to pass 1st argument to functions                        No
 // %r8      used to pass 5th argument to functions                        No
 // %r9      used to pass 6th argument to functions                        No
-static char *argreg[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
-static Function *current_fn;
+// %r10     temporary register                                            No
+// %r11     temporary register                                            No
+// %r12-r14 callee-saved registers                                        Yes
+// %r15     callee-saved register; optionally used as GOT base pointer    Yes
+static char *reg64[] = {
+  "%rax", "%rcx", "%rdx", "%rbx", "%rsp", "%rbp", "%rsi", "%rdi",
+  "%r8", "%r9", "%r10", "%r11", "%r12", "%r13", "%r14", "%r15",
+};
 
-static void gen_expr(Node *node);
+static char *reg8[] = {
+  "%al", "%cl", "%dl", "%bl", "%spl", "%bpl", "%sil", "%dil",
+  "%r8b", "%r9b", "%r10b", "%r11b", "%r12b", "%r13b", "%r14b", "%r15b",
+};
+
+static char *cc_names[] = {
+  [CC_E] = "e", [CC_NE] = "ne", [CC_L] = "l", [CC_GE] = "ge", [CC_LE] = "le", [CC_G] = "g",
+};
+
+// Labels of a function are numbered in groups of three, one group per
+// "if" or loop, so that they can be looked up in an array.
+enum { L_ELSE, L_END, L_BEGIN };
+
+static char *label_names[] = {".L.else.", ".L.end.", ".L.begin."};
+
+static _Thread_local IrFunc ir;
+static _Thread_local int code_cap, args_cap;
+static _Thread_local Function *current_fn;
+static _Thread_local int label_seq;
+static _Thread_local int label_base;
+
+static int gen_expr(Node *node);
 
 static int count(void) {
-  static int i = 1;
-  return i++;
+  return label_seq++;
 }
 
-static void push(void) {
-  // PUSH—Push Word, Doubleword, or Quadword Onto the Stack
-  // Decrements the stack pointer and then stores the source operand on the top of the stack.
-  printf("  push %%rax\n");
-  depth++;
-}
+// Returns the number of times gen_stmt calls count() for a given
+// statement. We use it to give every function a private range of label
+// numbers, which makes the labels independent of the order in which
+// functions are compiled.
+static int count_labels(Node *node) {
+  if (!node)
+    return 0;
 
-static void pop(char *arg) {
-  // POP—Pop a Value From the Stack
-  // Loads the value from the top of the stack to the location specified with the destination
-  // operand (or explicit opcode) and then increments the stack pointer. The destination operand can
-  // be a general-purpose register, memory location, or segment register.
-  printf("  pop %s\n", arg);
-  depth--;
+  switch (node->kind) {
+  case ND_IF:
+    return 1 + count_labels(node_then(node)) + count_labels(node_els(node));
+  case ND_FOR:
+    return 1 + count_labels(node_init(node)) + count_labels(node_then(node));
+  case ND_BLOCK: {
+    int n = 0;
+    for (Node *n2 = node_body(node); n2; n2 = node_next(n2))
+      n += count_labels(n2);
+    return n;
+  }
+  }
+  return 0;
 }
 
 // Round up `n` to the nearest multiple of `align`. For instance,
@@ -43,190 +86,956 @@ static int align_to(int n, int align) {
   return (n + align - 1) / align * align;
 }
 
-// Compute the absolute address of a given node.
+//
+// Lowering to IR
+//
+
+static int new_vreg(void) {
+  return ++ir.nvregs;
+}
+
+// Appends an instruction. The pointer is only good until the next
+// call, which may move the code.
+static Ir *new_ir(IrOp op) {
+  if (ir.ncode == code_cap) {
+    code_cap = code_cap ? code_cap * 2 : 256;
+    ir.code = realloc(ir.code, code_cap * sizeof(Ir));
+  }
+  Ir *p = &ir.code[ir.ncode++];
+  *p = (Ir){.op = op};
+  return p;
+}
+
+static int label(int kind, int c) {
+  return (c - label_base) * 3 + kind;
+}
+
+static void new_label(int kind, int c) {
+  new_ir(IR_LABEL)->label = label(kind, c);
+}
+
+static void new_jmp(int kind, int c) {
+  new_ir(IR_JMP)->label = label(kind, c);
+}
+
+// A variable is kept in a virtual register unless it has to be in
+// memory.
+static bool is_promotable(Obj *var) {
+  return var->ty->kind != TY_ARRAY && !var->addr_taken;
+}
+
+// Once the address of one variable is taken, pointer arithmetic can
+// step from it to its neighbours, as in *(&x+1). Such a function keeps
+// all of its variables in memory, in their usual layout.
+static bool takes_addresses(Function *fn) {
+  for (Obj *var = fn->locals; var; var = var->next)
+    if (var->addr_taken)
+      return true;
+  return false;
+}
+
+static bool is_compare(Node *node) {
+  return node->kind == ND_EQ || node->kind == ND_NE || node->kind == ND_LT || node->kind == ND_LE;
+}
+
+static CondCode compare_cc(Node *node) {
+  switch (node->kind) {
+  case ND_EQ:
+    return CC_E;
+  case ND_NE:
+    return CC_NE;
+  case ND_LT:
+    return CC_L;
+  case ND_LE:
+    return CC_LE;
+  }
+  unreachable();
+}
+
+// Lowers the operands of a binary operator into a new instruction. The
+// right-hand side is evaluated first. A number on the right becomes an
+// immediate operand; instructions take sign-extended 32-bit immediates,
+// which is what ND_NUM holds.
+static Ir *gen_operands(IrOp op, Node *node) {
+  Node *rhs = node_rhs(node);
+  bool imm = rhs->kind == ND_NUM && op != IR_DIV;
+  int b = imm ? 0 : gen_expr(rhs);
+  int a = gen_expr(node_lhs(node));
+
+  Ir *p = new_ir(op);
+  p->a = a;
+  p->b = b;
+  p->imm = imm;
+  p->val = imm ? rhs->val : 0;
+  return p;
+}
+
+// Emits dst = a op b and returns dst.
+static int gen_binop(IrOp op, int a, int b) {
+  int v = new_vreg();
+  Ir *p = new_ir(op);
+  p->dst = v;
+  p->a = a;
+  p->b = b;
+  return v;
+}
+
+// Emits dst = a op val and returns dst. Operands of ADD, SUB and MUL
+// must fit in a sign-extended 32-bit immediate.
+static int gen_imm_op(IrOp op, int a, long val) {
+  int v = new_vreg();
+  Ir *p = new_ir(op);
+  p->dst = v;
+  p->a = a;
+  p->imm = true;
+  p->val = val;
+  return v;
+}
+
+static int gen_neg(int a) {
+  int v = new_vreg();
+  Ir *p = new_ir(IR_NEG);
+  p->dst = v;
+  p->a = a;
+  return v;
+}
+
+// Multiplies `a` by a constant. imul takes 3 cycles; a shift or a lea
+// takes one. A power of two becomes a shift, and 3, 5 or 9 times a
+// power of two becomes a lea, which is what IR_MUL by 3, 5 or 9 is
+// emitted as, followed by a shift. This covers the element sizes that
+// pointer arithmetic scales by.
+static int gen_mul_const(int a, long c) {
+  if (c == 1)
+    return a;
+  if (c == -1)
+    return gen_neg(a);
+
+  if (c > 0) {
+    int k = __builtin_ctzl(c);
+    long odd = c >> k;
+    if (odd == 1)
+      return gen_imm_op(IR_SHL, a, k);
+    if (odd == 3 || odd == 5 || odd == 9) {
+      int v = gen_imm_op(IR_MUL, a, odd);
+      return k ? gen_imm_op(IR_SHL, v, k) : v;
+    }
+  }
+  return gen_imm_op(IR_MUL, a, c);
+}
+
+// Computes the magic number `m` and the shift `s` with which signed
+// 64-bit division by `d` is a multiplication, for |d| >= 2 and not a
+// power of two: n / d is the high half of m * n, plus n if d > 0 and
+// m < 0 or minus n if d < 0 and m > 0, shifted right by s, plus one if
+// that is negative.
+//
+// This is the algorithm of Henry S. Warren, Jr., Hacker's Delight, 2nd
+// ed., Figure 10-1, for a word size of 64 bits. It finds the smallest
+// p >= 64 for which 2^p / |d| can be rounded up to m without the error
+// reaching any quotient.
+static void div_magic(long d, long *m, int *s) {
+  uint64_t two63 = 1ULL << 63;
+  uint64_t ad = d < 0 ? -(uint64_t)d : d;
+  uint64_t t = two63 + ((uint64_t)d >> 63);
+  uint64_t anc = t - 1 - t % ad; // Absolute value of nc
+  int p = 63;
+  uint64_t q1 = two63 / anc;     // q1 = 2^p / |nc|
+  uint64_t r1 = two63 - q1 * anc;
+  uint64_t q2 = two63 / ad;      // q2 = 2^p / |d|
+  uint64_t r2 = two63 - q2 * ad;
+  uint64_t delta;
+
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  *m = q2 + 1;
+  if (d < 0)
+    *m = -*m;
+  *s = p - 64;
+}
+
+// Divides `a` by a nonzero constant. idiv takes tens of cycles, so it
+// is replaced by shifts and a multiplication.
+//
+// A pointer difference is `exact`: the distance between two elements of
+// an array is a multiple of the element size. Dividing it by 2^k * odd
+// is a shift right by k followed by a multiplication by the inverse of
+// odd modulo 2^64, which exists because odd is odd.
+static int gen_div_const(int a, long d, bool exact) {
+  if (d == 1)
+    return a;
+  if (d == -1)
+    return gen_neg(a);
+
+  if (exact && d > 0) {
+    int k = __builtin_ctzl(d);
+    uint64_t odd = d >> k;
+    int v = k ? gen_imm_op(IR_SAR, a, k) : a;
+    if (odd == 1)
+      return v;
+
+    // Newton's iteration x = x * (2 - odd * x) doubles the number of
+    // correct low bits, and x = odd is right in the lowest three.
+    uint64_t inv = odd;
+    for (int i = 0; i < 5; i++)
+      inv *= 2 - odd * inv;
+    if ((int)inv == (long)inv)
+      return gen_imm_op(IR_MUL, v, (long)inv);
+    int b = new_vreg();
+    Ir *p = new_ir(IR_IMM);
+    p->dst = b;
+    p->val = inv;
+    return gen_binop(IR_MUL, v, b);
+  }
+
+  // A shift right rounds toward negative infinity, but division rounds
+  // toward zero. Adding 2^k-1 to a negative dividend first makes up
+  // for the difference. The addend is made from the sign bit.
+  long ad = d < 0 ? -d : d;
+  if ((ad & (ad - 1)) == 0) {
+    int k = __builtin_ctzl(ad);
+    int t = k == 1 ? a : gen_imm_op(IR_SAR, a, 63);
+    t = gen_imm_op(IR_SHR, t, 64 - k);
+    int q = gen_imm_op(IR_SAR, gen_binop(IR_ADD, a, t), k);
+    return d < 0 ? gen_neg(q) : q;
+  }
+
+  long m;
+  int s;
+  div_magic(d, &m, &s);
+  int q = gen_imm_op(IR_MULH, a, m);
+  if (d > 0 && m < 0)
+    q = gen_binop(IR_ADD, q, a);
+  if (d < 0 && m > 0)
+    q = gen_binop(IR_SUB, q, a);
+  if (s)
+    q = gen_imm_op(IR_SAR, q, s);
+  return gen_binop(IR_ADD, q, gen_imm_op(IR_SHR, q, 63));
+}
+
+// Returns true if `node` subtracts a pointer from another.
+static bool is_ptr_diff(Node *node) {
+  return node->kind == ND_SUB && node_lhs(node)->ty->base && node_rhs(node)->ty->base;
+}
+
+// Returns a virtual register holding the address of a given node.
 // It's an error if a given node does not reside in memory.
-static void gen_addr(Node *node) {
+static int gen_addr(Node *node) {
   switch (node->kind) {
-  case ND_VAR:
-    // LEA—Load Effective Address
-    // Computes the effective address of the second operand (the source operand) and stores it in
-    // the first operand (destination operand). The source operand is a memory address (offset part)
-    // specified with one of the processors addressing modes; the destination operand is a
-    // general-purpose register. The address-size and operand-size attributes affect the action
-    // performed by this instruction, as shown in the following table. The operand-size attribute of
-    // the instruction is determined by the chosen register; the address-size attribute is
-    // determined by the attribute of the code segment.
-    printf("  lea %d(%%rbp), %%rax\n", node->var->offset);
-    return;
+  case ND_VAR: {
+    int v = new_vreg();
+    Ir *p = new_ir(IR_ADDR);
+    p->dst = v;
+    p->var = node->var;
+    return v;
+  }
   case ND_DEREF:
-    gen_expr(node->lhs);
-    return;
+    return gen_expr(node_lhs(node));
   }
 
   error_tok(node->tok, "not an lvalue");
 }
 
-// Load a value from where %rax is pointing to.
-static void load(Type *ty) {
-  if (ty->kind == TY_ARRAY) {
-    // If it is an array, do not attempt to load a value to the
-    // register because in general we can't load an entire array to a
-    // register. As a result, the result of an evaluation of an array
-    // becomes not the array itself but the address of the array.
-    // This is where "array is automatically converted to a pointer to
-    // the first element of the array in C" occurs.
-    return;
+static bool is_local_array(Node *node) {
+  return node->kind == ND_VAR && node->ty->kind == TY_ARRAY;
+}
+
+// Splits the address `node` computes into a base and a displacement
+// for a load or a store. The optimizer leaves a constant offset at the
+// top of a sum, where it becomes the displacement. A local array is
+// addressed through %rbp, in which case `var` is set and no virtual
+// register is needed for the base.
+static int gen_base(Node *node, Obj **var, int *disp) {
+  *var = NULL;
+  *disp = 0;
+  if (node->kind == ND_ADD && node_rhs(node)->kind == ND_NUM) {
+    *disp = node_rhs(node)->val;
+    node = node_lhs(node);
+  }
+  if (is_local_array(node)) {
+    *var = node->var;
+    return 0;
   }
+  return gen_expr(node);
+}
+
+// Loads the value a dereference refers to. If it is an array, do not
+// attempt to load a value to the register because in general we can't
+// load an entire array to a register. As a result, the result of an
+// evaluation of an array becomes not the array itself but the address
+// of the array. This is where "array is automatically converted to a
+// pointer to the first element of the array in C" occurs.
+static int load(Node *node) {
+  if (node->ty->kind == TY_ARRAY)
+    return gen_expr(node_lhs(node));
 
-  printf("  mov (%%rax), %%rax\n");
+  Obj *var;
+  int disp;
+  int addr = gen_base(node_lhs(node), &var, &disp);
+  int v = new_vreg();
+  Ir *p = new_ir(IR_LOAD);
+  p->dst = v;
+  p->a = addr;
+  p->var = var;
+  p->disp = disp;
+  return v;
 }
 
-// Store %rax to an address that the stack top is pointing to.
-static void store(void) {
-  pop("%rdi");
-  printf("  mov %%rax, (%%rdi)\n");
+static int gen_assign(Node *node) {
+  Node *lhs = node_lhs(node);
+  Node *rhs = node_rhs(node);
+
+  // A variable in a register. If the value was just computed into a
+  // temporary, compute it into the variable instead.
+  if (lhs->kind == ND_VAR && lhs->var->vreg) {
+    int dst = lhs->var->vreg;
+    int v = gen_expr(rhs);
+    Ir *last = &ir.code[ir.ncode - 1];
+    if (v > ir.nvars && last->dst == v) {
+      last->dst = dst;
+      return dst;
+    }
+    Ir *p = new_ir(IR_MOV);
+    p->dst = dst;
+    p->a = v;
+    return v;
+  }
+
+  // A variable in memory is stored to directly.
+  int addr = 0, disp = 0;
+  Obj *var = NULL;
+  if (lhs->kind == ND_VAR && lhs->ty->kind != TY_ARRAY)
+    var = lhs->var;
+  else if (lhs->kind == ND_DEREF)
+    addr = gen_base(node_lhs(lhs), &var, &disp);
+  else
+    addr = gen_addr(lhs);
+
+  int v = gen_expr(rhs);
+  Ir *p = new_ir(IR_STORE);
+  p->a = addr;
+  p->b = v;
+  p->var = var;
+  p->disp = disp;
+  return v;
 }
 
-// Generate code for a given node.
-static void gen_expr(Node *node) {
+// Generate code for a given node and return the virtual register that
+// holds its value.
+static int gen_expr(Node *node) {
   switch (node->kind) {
-  case ND_NUM:
-    // T&T immediate operands are preceded by ‘$’; Intel immediate operands are
-    // undelimited (Intel ‘push 4’ is AT&T ‘pushl $4’). AT&T register operands are
-    // preceded by ‘%’; Intel register operands are undelimited.
-    //
-    // AT&T and Intel syntax use the opposite order for source and destination
-    // operands. Intel ‘add eax, 4’ is ‘addl $4, %eax’. The ‘source, dest’
-    // convention is maintained for compatibility with previous Unix assemblers.
-    //
-    // System V AMD64 ABI
-    // %rax: temporary register; with variable arguments passes information about
-    // the number of vector registers used; 1st return register
-
-    // long int strtol (const char* str, char** endptr, int base);
-    // Convert string to long integer
-    // Parses the C-string str interpreting its content as an integral number of the specified base,
-    // which is returned as a long int value. If endptr is not a null pointer, the function also
-    // sets the value of endptr to point to the first character after the number.
-    printf("  mov $%d, %%rax\n", node->val);
-    return;
-  case ND_NEG:
-    gen_expr(node->lhs);
-    // NEG—Two's Complement Negation
-    // Replaces the value of operand (the destination operand) with its two's complement. (This
-    // operation is equivalent to subtracting the operand from 0.) The destination operand is
-    // located in a general-purpose register or a memory location.
-    printf("  neg %%rax\n");
-    return;
-  // The value of the var node is the address of the var.
-  case ND_VAR:
-    gen_addr(node);
-    load(node->ty);
-    return;
+  case ND_NUM: {
+    int v = new_vreg();
+    Ir *p = new_ir(IR_IMM);
+    p->dst = v;
+    p->val = node->val;
+    return v;
+  }
+  case ND_NEG: {
+    int a = gen_expr(node_lhs(node));
+    int v = new_vreg();
+    Ir *p = new_ir(IR_NEG);
+    p->dst = v;
+    p->a = a;
+    return v;
+  }
+  case ND_VAR: {
+    Obj *var = node->var;
+    if (var->vreg)
+      return var->vreg;
+    if (node->ty->kind == TY_ARRAY)
+      return gen_addr(node);
+
+    int v = new_vreg();
+    Ir *p = new_ir(IR_LOAD);
+    p->dst = v;
+    p->var = var;
+    return v;
+  }
   // "deref" "var"
   case ND_DEREF:
-    gen_expr(node->lhs);
-    load(node->ty);
-    return;
+    return load(node);
   // "addr" "var"
   case ND_ADDR:
-    gen_addr(node->lhs);
-    return;
+    return gen_addr(node_lhs(node));
   case ND_ASSIGN:
-    gen_addr(node->lhs);
-    push();
-    gen_expr(node->rhs);
-    store();
-    return;
+    return gen_assign(node);
   case ND_FUNCALL: {
+    int args[6];
     int nargs = 0;
-    for (Node *arg = node->args; arg; arg = arg->next) {
-      gen_expr(arg);
-      push();
-      nargs++;
+    for (Node *arg = node_args(node); arg; arg = node_next(arg))
+      args[nargs++] = gen_expr(arg);
+
+    if (ir.nargs + nargs > args_cap) {
+      args_cap = args_cap ? args_cap * 2 : 64;
+      ir.args = realloc(ir.args, args_cap * sizeof(int));
+    }
+    memcpy(ir.args + ir.nargs, args, nargs * sizeof(int));
+
+    int v = new_vreg();
+    Ir *p = new_ir(IR_CALL);
+    p->dst = v;
+    p->funcname = node->funcname;
+    p->args = ir.nargs;
+    p->nargs = nargs;
+    ir.nargs += nargs;
+    return v;
+  }
+  case ND_ADD:
+    // The address of an element of a local array
+    if (is_local_array(node_lhs(node)) && node_rhs(node)->kind == ND_NUM) {
+      int v = new_vreg();
+      Ir *p = new_ir(IR_ADDR);
+      p->dst = v;
+      p->var = node_lhs(node)->var;
+      p->disp = node_rhs(node)->val;
+      return v;
     }
+    break;
+  }
+
+  Ir *p;
+  switch (node->kind) {
+  case ND_ADD:
+    p = gen_operands(IR_ADD, node);
+    break;
+  case ND_SUB:
+    p = gen_operands(IR_SUB, node);
+    break;
+  case ND_MUL:
+    if (node_rhs(node)->kind == ND_NUM)
+      return gen_mul_const(gen_expr(node_lhs(node)), node_rhs(node)->val);
+    p = gen_operands(IR_MUL, node);
+    break;
+  case ND_DIV:
+    if (node_rhs(node)->kind == ND_NUM && node_rhs(node)->val)
+      return gen_div_const(gen_expr(node_lhs(node)), node_rhs(node)->val,
+                           is_ptr_diff(node_lhs(node)));
+    p = gen_operands(IR_DIV, node);
+    break;
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    p = gen_operands(IR_SET, node);
+    p->cc = compare_cc(node);
+    break;
+  default:
+    error_tok(node->tok, "invalid expression");
+  }
 
-    for (int i = nargs - 1; i >= 0; i--)
-      pop(argreg[i]);
+  int v = new_vreg();
+  p->dst = v;
+  return v;
+}
 
-    printf("  mov $0, %%rax\n");
-    // CALL—Call Procedure
-    // Saves procedure linking information on the stack and branches to the called procedure
-    // specified using the target operand. The target operand specifies the address of the first
-    // instruction in the called procedure. The operand can be an immediate value, a general-purpose
-    // register, or a memory location.
-    printf("  call %s\n", node->funcname);
+// Jumps to a label if `node` evaluates to zero. A comparison jumps on
+// its own result instead of materializing it first.
+static void gen_cond(Node *node, int kind, int c) {
+  Ir *p;
+  if (is_compare(node)) {
+    p = gen_operands(IR_BR, node);
+    p->cc = compare_cc(node) ^ 1;
+  } else {
+    int a = gen_expr(node);
+    p = new_ir(IR_BR);
+    p->cc = CC_E;
+    p->a = a;
+    p->imm = true;
+  }
+  p->label = label(kind, c);
+}
+
+static void gen_stmt(Node *node) {
+  switch (node->kind) {
+  case ND_IF: {
+    int c = count();
+    gen_cond(node_cond(node), L_ELSE, c);
+    gen_stmt(node_then(node));
+    new_jmp(L_END, c);
+    new_label(L_ELSE, c);
+    if (node_els(node))
+      gen_stmt(node_els(node));
+    new_label(L_END, c);
+    return;
+  }
+  case ND_FOR: {
+    int c = count();
+    if (node_init(node))
+      gen_stmt(node_init(node));
+    new_label(L_BEGIN, c);
+    if (node_cond(node))
+      gen_cond(node_cond(node), L_END, c);
+    gen_stmt(node_then(node));
+    if (node_inc(node))
+      gen_expr(node_inc(node));
+    new_jmp(L_BEGIN, c);
+    new_label(L_END, c);
+    return;
+  }
+  case ND_BLOCK:
+    for (Node *n = node_body(node); n; n = node_next(n))
+      gen_stmt(n);
+    return;
+  case ND_RETURN: {
+    int a = gen_expr(node_lhs(node));
+    new_ir(IR_RET)->a = a;
     return;
   }
+  case ND_EXPR_STMT:
+    gen_expr(node_lhs(node));
+    return;
   }
 
-  gen_expr(node->rhs);
-  push();
-  gen_expr(node->lhs);
-  // %rdi: used to pass 1st argument to functions
-  pop("%rdi");
-  // now %rax is lhs value, %rdi is rhs value
+  error_tok(node->tok, "invalid statement");
+}
 
-  switch (node->kind) {
-  case ND_ADD:
-    // ADD—Add
-    // Adds the destination operand (first operand) and the source operand (second operand) and
-    // then stores the result in the destination operand. The destination operand can be a
-    // register or a memory location; the source operand can be an immediate, a register, or a
-    // memory location. (However, two memory operands cannot be used in one instruction.) When an
-    // immediate value is used as an operand, it is sign-extended to the length of the destination
-    // operand format.
-    printf("  add %%rdi, %%rax\n");
+//
+// Emitting IR as assembly
+//
+
+static Loc reg_loc(Reg reg) {
+  return (Loc){LOC_REG, reg};
+}
+
+static Loc stack_loc(int offset) {
+  return (Loc){LOC_STACK, .val = offset};
+}
+
+static Loc loc(int vreg) {
+  return ir.locs[vreg];
+}
+
+// Returns the second operand of a binary instruction.
+static Loc operand_b(Ir *p) {
+  if (p->imm)
+    return (Loc){LOC_IMM, .val = p->val};
+  return loc(p->b);
+}
+
+static bool same_loc(Loc x, Loc y) {
+  if (x.kind != y.kind)
+    return false;
+  return x.kind == LOC_REG ? x.reg == y.reg : x.val == y.val;
+}
+
+// T&T immediate operands are preceded by ‘$’; Intel immediate operands are
+// undelimited (Intel ‘push 4’ is AT&T ‘pushl $4’). AT&T register operands are
+// preceded by ‘%’; Intel register operands are undelimited.
+static void emit_loc(Loc l) {
+  switch (l.kind) {
+  case LOC_REG:
+    emit(reg64[l.reg]);
     return;
-  case ND_SUB:
-    // SUB—Subtract
-    // Subtracts the second operand (source operand) from the first operand (destination operand)
-    // and stores the result in the destination operand. The destination operand can be a register
-    // or a memory location; the source operand can be an immediate, register, or memory location.
-    // (However, two memory operands cannot be used in one instruction.) When an immediate value is
-    // used as an operand, it is sign-extended to the length of the destination operand format.
-    printf("  sub %%rdi, %%rax\n");
+  case LOC_STACK:
+    emit_mem(l.val, "%rbp");
     return;
-  case ND_MUL:
+  case LOC_IMM:
+    emit_imm(l.val);
+    return;
+  }
+  unreachable();
+}
+
+// A memory operand addressed by a register and a displacement, e.g.
+// ‘8(%rcx)’. The displacement is omitted if it is zero.
+static void emit_base(int disp, Reg base) {
+  if (disp)
+    emit_num(disp);
+  emit("(");
+  emit(reg64[base]);
+  emit(")");
+}
+
+// AT&T and Intel syntax use the opposite order for source and destination
+// operands. Intel ‘add eax, 4’ is ‘addl $4, %eax’. The ‘source, dest’
+// convention is maintained for compatibility with previous Unix assemblers.
+//
+// Without a register operand, the size of the operation is not implied,
+// so a ‘q’ suffix makes it 64 bits: ‘movq $1, -8(%rbp)’.
+static void emit_op2(char *mnemonic, Loc src, Loc dst) {
+  emit("  ");
+  emit(mnemonic);
+  if (src.kind != LOC_REG && dst.kind != LOC_REG)
+    emit("q");
+  emit(" ");
+  emit_loc(src);
+  emit(", ");
+  emit_loc(dst);
+  emit("\n");
+}
+
+static void emit_op1(char *mnemonic, Loc l) {
+  emit("  ");
+  emit(mnemonic);
+  if (l.kind != LOC_REG)
+    emit("q");
+  emit(" ");
+  emit_loc(l);
+  emit("\n");
+}
+
+// Copies `src` to `dst`. An instruction has at most one memory
+// operand, so a copy from memory to memory goes through %rax.
+static void move(Loc dst, Loc src) {
+  if (same_loc(dst, src))
+    return;
+  if (dst.kind == LOC_STACK && src.kind == LOC_STACK) {
+    emit_op2("mov", src, reg_loc(REG_RAX));
+    src = reg_loc(REG_RAX);
+  }
+  emit_op2("mov", src, dst);
+}
+
+// Performs the copies dst[i] = src[i] as if all at once, as when
+// arguments are put in their registers. Copies are ordered so that no
+// source is overwritten before it is read. A cycle, such as two
+// registers that trade places, is broken by saving one of them in %r11.
+static void parallel_move(Loc *dst, Loc *src, int n) {
+  bool done[6] = {};
+  int left = n;
+
+  while (left) {
+    bool progress = false;
+    for (int i = 0; i < n; i++) {
+      if (done[i])
+        continue;
+      bool blocked = false;
+      for (int j = 0; j < n; j++)
+        if (j != i && !done[j] && same_loc(src[j], dst[i]))
+          blocked = true;
+      if (blocked)
+        continue;
+      move(dst[i], src[i]);
+      done[i] = true;
+      left--;
+      progress = true;
+    }
+    if (progress)
+      continue;
+
+    for (int i = 0; i < n; i++) {
+      if (done[i])
+        continue;
+      move(reg_loc(REG_R11), dst[i]);
+      for (int j = 0; j < n; j++)
+        if (!done[j] && same_loc(src[j], dst[i]))
+          src[j] = reg_loc(REG_R11);
+      break;
+    }
+  }
+}
+
+// Returns a register holding the value at `l`: its own register or,
+// if it is in memory, %r11.
+static Reg in_reg(Loc l) {
+  if (l.kind == LOC_REG)
+    return l.reg;
+  move(reg_loc(REG_R11), l);
+  return REG_R11;
+}
+
+// dst = a op b for ADD, SUB and MUL
+static void emit_arith(Ir *p) {
+  Loc d = loc(p->dst);
+  Loc a = loc(p->a);
+  Loc b = operand_b(p);
+  Loc rax = reg_loc(REG_RAX);
+
+  if (p->op == IR_MUL) {
     // IMUL—Signed Multiply
     // Performs a signed multiplication of two operands. This instruction has three forms, depending
     // on the number of operands.
-    printf("  imul %%rdi, %%rax\n");
-    return;
-  case ND_DIV:
-    // CWD/CDQ/CQO—Convert Word to Doubleword/Convert Doubleword to Quadword
-    // Doubles the size of the operand in register AX, EAX, or RAX (depending on the operand size)
-    // by means of sign extension and stores the result in registers DX:AX, EDX:EAX, or RDX:RAX,
-    // respectively. The CWD instruction copies the sign (bit 15) of the value in the AX register
-    // into every bit position in the DX register. The CDQ instruction copies the sign (bit 31) of
-    // the value in the EAX register into every bit position in the EDX register. The CQO
-    // instruction (available in 64-bit mode only) copies the sign (bit 63) of the value in the RAX
-    // register into every bit position in the RDX register.
-    printf("  cqo\n");
-    // IDIV—Signed Divide
-    // Divides the (signed) value in the AX, DX:AX, or EDX:EAX (dividend) by the source operand
-    // (divisor) and stores the result in the AX (AH:AL), DX:AX, or EDX:EAX registers. The source
-    // operand can be a general-purpose register or a memory location. The action of this
-    // instruction depends on the operand size (dividend/divisor).
     //
-    // In 64-bit mode, the instruction’s default operation size is 32 bits. Use of the REX.R prefix
-    // permits access to additional registers (R8-R15). Use of the REX.W prefix promotes operation
-    // to 64 bits. In 64-bit mode when REX.W is applied, the instruction divides the signed value in
-    // RDX:RAX by the source operand. RAX contains a 64-bit quotient; RDX contains a 64-bit
-    // remainder.
-    printf("  idiv %%rdi\n");
+    // Three-operand form — This form requires a destination operand (the first operand) and two
+    // source operands (the second and the third operands). Here, the first source operand (which
+    // can be a general-purpose register or a memory location) is multiplied by the second source
+    // operand (an immediate value).
+    Loc r = d.kind == LOC_REG ? d : rax;
+
+    // LEA—Load Effective Address
+    // An address may add an index register scaled by 2, 4 or 8 to a
+    // base register, so x*3, x*5 and x*9 are the address (x,x,2),
+    // (x,x,4) and (x,x,8).
+    if (b.kind == LOC_IMM && (b.val == 3 || b.val == 5 || b.val == 9)) {
+      Reg x = in_reg(a);
+      emit("  lea (");
+      emit(reg64[x]);
+      emit(",");
+      emit(reg64[x]);
+      emit(",");
+      emit_num(b.val - 1);
+      emit("), ");
+      emit_loc(r);
+      emit("\n");
+      move(d, r);
+      return;
+    }
+
+    if (b.kind == LOC_IMM) {
+      emit("  imul ");
+      emit_loc(b);
+      emit(", ");
+      emit_loc(a);
+      emit(", ");
+      emit_loc(r);
+      emit("\n");
+    } else if (same_loc(r, b)) {
+      emit_op2("imul", a, r);
+    } else {
+      move(r, a);
+      emit_op2("imul", b, r);
+    }
+    move(d, r);
     return;
-  case ND_EQ:
-  case ND_NE:
-  case ND_LT:
-  case ND_LE:
-    // CMP—Compare Two operands
-    // Compares the first source operand with the second source operand and sets the status flags
-    // in the EFLAGS register according to the results. The comparison is performed by subtracting
-    // the second operand from the first operand and then setting the status flags in the same
-    // manner as the SUB instruction. When an immediate value is used as an operand, it is
-    // sign-extended to the length of the first operand.
-    printf("  cmp %%rdi, %%rax\n");
+  }
+
+  // ADD—Add
+  // Adds the destination operand (first operand) and the source operand (second operand) and
+  // then stores the result in the destination operand. The destination operand can be a
+  // register or a memory location; the source operand can be an immediate, a register, or a
+  // memory location. (However, two memory operands cannot be used in one instruction.) When an
+  // immediate value is used as an operand, it is sign-extended to the length of the destination
+  // operand format.
+  //
+  // SUB—Subtract
+  // Subtracts the second operand (source operand) from the first operand (destination operand)
+  // and stores the result in the destination operand. The destination operand can be a register
+  // or a memory location; the source operand can be an immediate, register, or memory location.
+  // (However, two memory operands cannot be used in one instruction.) When an immediate value is
+  // used as an operand, it is sign-extended to the length of the destination operand format.
+  char *mn = p->op == IR_ADD ? "add" : "sub";
+
+  if (same_loc(d, a) && !(d.kind == LOC_STACK && b.kind == LOC_STACK)) {
+    emit_op2(mn, b, d);
+    return;
+  }
+  if (d.kind == LOC_REG && !same_loc(d, b)) {
+    move(d, a);
+    emit_op2(mn, b, d);
+    return;
+  }
+  if (d.kind == LOC_REG && p->op == IR_ADD) {
+    emit_op2(mn, a, d);
+    return;
+  }
+  move(rax, a);
+  emit_op2(mn, b, rax);
+  move(d, rax);
+}
+
+static void emit_div(Ir *p) {
+  Loc rax = reg_loc(REG_RAX);
+  move(rax, loc(p->a));
+
+  // CWD/CDQ/CQO—Convert Word to Doubleword/Convert Doubleword to Quadword
+  // Doubles the size of the operand in register AX, EAX, or RAX (depending on the operand size)
+  // by means of sign extension and stores the result in registers DX:AX, EDX:EAX, or RDX:RAX,
+  // respectively. The CWD instruction copies the sign (bit 15) of the value in the AX register
+  // into every bit position in the DX register. The CDQ instruction copies the sign (bit 31) of
+  // the value in the EAX register into every bit position in the EDX register. The CQO
+  // instruction (available in 64-bit mode only) copies the sign (bit 63) of the value in the RAX
+  // register into every bit position in the RDX register.
+  emit("  cqo\n");
+
+  // IDIV—Signed Divide
+  // Divides the (signed) value in the AX, DX:AX, or EDX:EAX (dividend) by the source operand
+  // (divisor) and stores the result in the AX (AH:AL), DX:AX, or EDX:EAX registers. The source
+  // operand can be a general-purpose register or a memory location. The action of this
+  // instruction depends on the operand size (dividend/divisor).
+  //
+  // In 64-bit mode, the instruction’s default operation size is 32 bits. Use of the REX.R prefix
+  // permits access to additional registers (R8-R15). Use of the REX.W prefix promotes operation
+  // to 64 bits. In 64-bit mode when REX.W is applied, the instruction divides the signed value in
+  // RDX:RAX by the source operand. RAX contains a 64-bit quotient; RDX contains a 64-bit
+  // remainder.
+  Loc b = operand_b(p);
+  if (b.kind == LOC_IMM) {
+    move(reg_loc(REG_R11), b);
+    b = reg_loc(REG_R11);
+  }
+  emit_op1("idiv", b);
+  move(loc(p->dst), rax);
+}
+
+// dst = the high half of a * val
+static void emit_mulh(Ir *p) {
+  // IMUL—Signed Multiply
+  // One-operand form — This form is identical to that used by the MUL instruction. Here, the
+  // source operand (in a general-purpose register or memory location) is multiplied by the value
+  // in the AL, AX, EAX, or RAX register (depending on the operand size) and the product (twice the
+  // size of the input operand) is stored in the AX, DX:AX, EDX:EAX, or RDX:RAX registers,
+  // respectively.
+  Loc r11 = reg_loc(REG_R11);
+  move(reg_loc(REG_RAX), loc(p->a));
+  move(r11, (Loc){LOC_IMM, .val = p->val});
+  emit_op1("imul", r11);
+  move(loc(p->dst), reg_loc(REG_RDX));
+}
+
+// dst = a shifted by val bits
+static void emit_shift(Ir *p) {
+  // SAL/SAR/SHL/SHR—Shift
+  // Shifts the bits in the first operand (destination operand) to the left or right by the number
+  // of bits specified in the second operand (count operand). Bits shifted beyond the destination
+  // operand boundary are first shifted into the CF flag, then discarded.
+  //
+  // The shift arithmetic right (SAR) and shift logical right (SHR) instructions shift the bits of
+  // the destination operand to the right (toward less significant bit locations). For each shift
+  // count, the least significant bit of the destination operand is shifted into the CF flag, and
+  // the most significant bit is either set or cleared depending on the instruction type. The SHR
+  // instruction clears the most significant bit; the SAR instruction sets or clears the most
+  // significant bit to correspond to the sign (most significant bit) of the original value in the
+  // destination operand.
+  //
+  // The built-in assembler only shifts registers.
+  static char *mn[] = {[IR_SHL] = "shl", [IR_SAR] = "sar", [IR_SHR] = "shr"};
+  Loc d = loc(p->dst);
+  Loc r = d.kind == LOC_REG ? d : reg_loc(REG_RAX);
+  move(r, loc(p->a));
+  emit_op2(mn[p->op], operand_b(p), r);
+  move(d, r);
+}
+
+// Sets the flags for a comparison of a with b.
+static void emit_cmp(Ir *p) {
+  Loc a = loc(p->a);
+  Loc b = operand_b(p);
+
+  // TEST—Logical Compare
+  // Computes the bit-wise logical AND of first operand (source 1 operand) and the second operand
+  // (source 2 operand) and sets the SF, ZF, and PF status flags according to the result.
+  if (b.kind == LOC_IMM && b.val == 0 && a.kind == LOC_REG) {
+    emit_op2("test", a, a);
+    return;
+  }
+
+  // CMP—Compare Two operands
+  // Compares the first source operand with the second source operand and sets the status flags
+  // in the EFLAGS register according to the results. The comparison is performed by subtracting
+  // the second operand from the first operand and then setting the status flags in the same
+  // manner as the SUB instruction. When an immediate value is used as an operand, it is
+  // sign-extended to the length of the first operand.
+  if (a.kind == LOC_STACK && b.kind == LOC_STACK) {
+    move(reg_loc(REG_RAX), a);
+    a = reg_loc(REG_RAX);
+  }
+  emit_op2("cmp", b, a);
+}
+
+static void emit_ir_label(int id) {
+  emit_label(label_names[id % 3], label_base + id / 3);
+}
+
+// Returns true if a jump from instruction i to `id` would land on the
+// next instruction anyway.
+static bool jumps_to_next(int i, int id) {
+  for (int j = i + 1; j < ir.ncode && ir.code[j].op == IR_LABEL; j++)
+    if (ir.code[j].label == id)
+      return true;
+  return false;
+}
+
+static void emit_return_jump(void) {
+  // JMP—Jump
+  // Transfers program control to a different point in the instruction stream without recording
+  // return information. The destination (target) operand specifies the address of the instruction
+  // being jumped to. This operand can be an immediate value, a general-purpose register, or a
+  // memory location.
+  //
+  // Symbol names begin with a letter or with one of ‘._’. On most machines, you can also use $
+  // in symbol names; exceptions are noted in Machine Dependent Features. That character may be
+  // followed by any string of digits, letters, dollar signs (unless otherwise noted for a
+  // particular target machine), and underscores. These restrictions do not apply when quoting
+  // symbol names by ‘"’, which is permitted for most targets. Escaping characters in quoted
+  // symbol names with ‘\’ generally extends only to ‘\’ itself and ‘"’, at the time of writing.
+  //
+  // Case of letters is significant: foo is a different symbol name than Foo.
+  //
+  // Symbol names do not start with a digit. An exception to this rule is made for Local Labels.
+  // See below.
+  //
+  // Local Symbol Names
+  // A local symbol is any symbol beginning with certain local label prefixes. By default, the
+  // local label prefix is ‘.L’ for ELF systems or ‘L’ for traditional a.out systems, but each
+  // target may have its own set of local label prefixes. On the HPPA local symbols begin with
+  // ‘L$’.
+  //
+  // Local symbols are defined and used within the assembler, but they are normally not saved in
+  // object files. Thus, they are not visible when debugging. You may use the ‘-L’ option (see
+  // Include Local Symbols) to retain the local symbols in the object files.
+  emit("  jmp .L.return.");
+  emit(current_fn->name);
+  emit("\n");
+}
+
+// Emits instruction i of the IR.
+static void emit_ir(int i) {
+  Ir *p = &ir.code[i];
+  Loc rax = reg_loc(REG_RAX);
+
+  // An instruction whose result is never read is dropped, unless it
+  // is a call, which may have side effects.
+  if (p->dst && loc(p->dst).kind == LOC_NONE && p->op != IR_CALL)
+    return;
+
+  switch (p->op) {
+  case IR_IMM:
+    move(loc(p->dst), (Loc){LOC_IMM, .val = p->val});
+    return;
+  case IR_MOV:
+    move(loc(p->dst), loc(p->a));
+    return;
+  case IR_NEG: {
+    // NEG—Two's Complement Negation
+    // Replaces the value of operand (the destination operand) with its two's complement. (This
+    // operation is equivalent to subtracting the operand from 0.) The destination operand is
+    // located in a general-purpose register or a memory location.
+    Loc d = loc(p->dst);
+    Loc a = loc(p->a);
+    if (d.kind == LOC_REG || same_loc(d, a)) {
+      move(d, a);
+      emit_op1("neg", d);
+      return;
+    }
+    move(rax, a);
+    emit_op1("neg", rax);
+    move(d, rax);
+    return;
+  }
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+    emit_arith(p);
+    return;
+  case IR_DIV:
+    emit_div(p);
+    return;
+  case IR_MULH:
+    emit_mulh(p);
+    return;
+  case IR_SHL:
+  case IR_SAR:
+  case IR_SHR:
+    emit_shift(p);
+    return;
+  case IR_SET: {
+    emit_cmp(p);
 
     // SETcc—Set Byte on Condition
     // Sets the destination operand to 0 or 1 depending on the settings of the status flags (CF, SF,
@@ -236,34 +1045,111 @@ static void gen_expr(Node *node) {
     // The terms “above” and “below” are associated with the CF flag and refer to the relationship
     // between two unsigned integer values. The terms “greater” and “less” are associated with the
     // SF and OF flags and refer to the relationship between two signed integer values.
-    if (node->kind == ND_EQ)
-      printf("  sete %%al\n");
-    else if (node->kind == ND_NE)
-      printf("  setne %%al\n");
-    else if (node->kind == ND_LT)
-      printf("  setl %%al\n");
-    else if (node->kind == ND_LE)
-      printf("  setle %%al\n");
+    Loc d = loc(p->dst);
+    Reg r = d.kind == LOC_REG ? d.reg : REG_RAX;
+    emit("  set");
+    emit(cc_names[p->cc]);
+    emit(" ");
+    emit(reg8[r]);
+    emit("\n");
 
     // MOVZX—Move With Zero-Extend
     // Copies the contents of the source operand (register or memory location) to the destination
     // operand (register) and zero extends the value. The size of the converted value depends on the
     // operand-size attribute.
-    //
-    // movzb?
-    printf("  movzx %%al, %%rax\n");
+    emit("  movzx ");
+    emit(reg8[r]);
+    emit(", ");
+    emit(reg64[r]);
+    emit("\n");
+    move(d, reg_loc(r));
     return;
   }
+  case IR_ADDR: {
+    // LEA—Load Effective Address
+    // Computes the effective address of the second operand (the source operand) and stores it in
+    // the first operand (destination operand). The source operand is a memory address (offset part)
+    // specified with one of the processors addressing modes; the destination operand is a
+    // general-purpose register. The address-size and operand-size attributes affect the action
+    // performed by this instruction, as shown in the following table. The operand-size attribute of
+    // the instruction is determined by the chosen register; the address-size attribute is
+    // determined by the attribute of the code segment.
+    Loc d = loc(p->dst);
+    Loc r = d.kind == LOC_REG ? d : rax;
+    emit_op2("lea", stack_loc(p->var->offset + p->disp), r);
+    move(d, r);
+    return;
+  }
+  case IR_LOAD: {
+    Loc d = loc(p->dst);
+    if (p->var) {
+      move(d, stack_loc(p->var->offset + p->disp));
+      return;
+    }
+    Reg a = in_reg(loc(p->a));
+    Reg r = d.kind == LOC_REG ? d.reg : REG_RAX;
+    emit("  mov ");
+    emit_base(p->disp, a);
+    emit(", ");
+    emit(reg64[r]);
+    emit("\n");
+    move(d, reg_loc(r));
+    return;
+  }
+  case IR_STORE: {
+    Loc b = operand_b(p);
+    if (p->var) {
+      move(stack_loc(p->var->offset + p->disp), b);
+      return;
+    }
+    Reg a = in_reg(loc(p->a));
+    if (b.kind == LOC_STACK) {
+      move(rax, b);
+      b = rax;
+    }
+    emit(b.kind == LOC_IMM ? "  movq " : "  mov ");
+    emit_loc(b);
+    emit(", ");
+    emit_base(p->disp, a);
+    emit("\n");
+    return;
+  }
+  case IR_CALL: {
+    Loc dst[6], src[6];
+    for (int j = 0; j < p->nargs; j++) {
+      dst[j] = reg_loc(arg_regs[j]);
+      src[j] = loc(ir.args[p->args + j]);
+    }
+    parallel_move(dst, src, p->nargs);
 
-  error_tok(node->tok, "invalid expression");
-}
-
-static void gen_stmt(Node *node) {
-  switch (node->kind) {
-  case ND_IF: {
-    int c = count();
-    gen_expr(node->cond);
-    printf("  cmp $0, %%rax\n");
+    // %rax: with variable arguments passes information about the
+    // number of vector registers used
+    emit("  mov $0, %rax\n");
+    // CALL—Call Procedure
+    // Saves procedure linking information on the stack and branches to the called procedure
+    // specified using the target operand. The target operand specifies the address of the first
+    // instruction in the called procedure. The operand can be an immediate value, a general-purpose
+    // register, or a memory location.
+    emit("  call ");
+    emit(p->funcname);
+    emit("\n");
+    if (loc(p->dst).kind != LOC_NONE)
+      move(loc(p->dst), rax);
+    return;
+  }
+  case IR_LABEL:
+    emit_ir_label(p->label);
+    emit(":\n");
+    return;
+  case IR_JMP:
+    if (jumps_to_next(i, p->label))
+      return;
+    emit("  jmp ");
+    emit_ir_label(p->label);
+    emit("\n");
+    return;
+  case IR_BR:
+    emit_cmp(p);
     // Jcc—Jump if Condition Is Met
     // Checks the state of one or more of the status flags in the EFLAGS register (CF, OF, PF, SF,
     // and ZF) and, if the flags are in the specified state (condition), performs a jump to the
@@ -271,162 +1157,294 @@ static void gen_stmt(Node *node) {
     // with each instruction to indicate the condition being tested for. If the condition is not
     // satisfied, the jump is not performed and execution continues with the instruction following
     // the Jcc instruction.
-    printf("  je  .L.else.%d\n", c);
-    gen_stmt(node->then);
-    printf("  jmp .L.end.%d\n", c);
-    printf(".L.else.%d:\n", c);
-    if (node->els)
-      gen_stmt(node->els);
-    printf(".L.end.%d:\n", c);
+    emit("  j");
+    emit(cc_names[p->cc]);
+    emit(" ");
+    emit_ir_label(p->label);
+    emit("\n");
     return;
-  }
-  case ND_FOR: {
-    int c = count();
-    if (node->init)
-      gen_stmt(node->init);
-    printf(".L.begin.%d:\n", c);
-    if (node->cond) {
-      gen_expr(node->cond);
-      printf("  cmp $0, %%rax\n");
-      printf("  je  .L.end.%d\n", c);
-    }
-    gen_stmt(node->then);
-    if (node->inc)
-      gen_expr(node->inc);
-    printf("  jmp .L.begin.%d\n", c);
-    printf(".L.end.%d:\n", c);
+  case IR_RET:
+    move(rax, loc(p->a));
+    if (i + 1 < ir.ncode)
+      emit_return_jump();
     return;
   }
-  case ND_BLOCK:
-    for (Node *n = node->body; n; n = n->next)
-      gen_stmt(n);
-    return;
-  case ND_RETURN:
-    gen_expr(node->lhs);
-    // JMP—Jump
-    // Transfers program control to a different point in the instruction stream without recording
-    // return information. The destination (target) operand specifies the address of the instruction
-    // being jumped to. This operand can be an immediate value, a general-purpose register, or a
-    // memory location.
-    //
-    // Symbol names begin with a letter or with one of ‘._’. On most machines, you can also use $
-    // in symbol names; exceptions are noted in Machine Dependent Features. That character may be
-    // followed by any string of digits, letters, dollar signs (unless otherwise noted for a
-    // particular target machine), and underscores. These restrictions do not apply when quoting
-    // symbol names by ‘"’, which is permitted for most targets. Escaping characters in quoted
-    // symbol names with ‘\’ generally extends only to ‘\’ itself and ‘"’, at the time of writing.
-    //
-    // Case of letters is significant: foo is a different symbol name than Foo.
-    //
-    // Symbol names do not start with a digit. An exception to this rule is made for Local Labels.
-    // See below.
-    //
-    // Local Symbol Names
-    // A local symbol is any symbol beginning with certain local label prefixes. By default, the
-    // local label prefix is ‘.L’ for ELF systems or ‘L’ for traditional a.out systems, but each
-    // target may have its own set of local label prefixes. On the HPPA local symbols begin with
-    // ‘L$’.
-    //
-    // Local symbols are defined and used within the assembler, but they are normally not saved in
-    // object files. Thus, they are not visible when debugging. You may use the ‘-L’ option (see
-    // Include Local Symbols) to retain the local symbols in the object files.
-    printf("  jmp .L.return.%s\n", current_fn->name);
-    return;
-  case ND_EXPR_STMT:
-    gen_expr(node->lhs);
-    return;
+  unreachable();
+}
+
+// Assign offsets to the local variables that live in memory. Returns
+// the number of bytes they take.
+static int assign_lvar_offsets(Function *fn) {
+  int offset = 0;
+  for (Obj *var = fn->locals; var; var = var->next) {
+    if (var->vreg)
+      continue;
+    offset += var->ty->size;
+    var->offset = -offset;
   }
+  return offset;
+}
 
-  error_tok(node->tok, "invalid statement");
+// Gives the variables that can live in registers a virtual register
+// each, parameters first.
+static void assign_vregs(Function *fn) {
+  ir.ncode = 0;
+  ir.nargs = 0;
+  ir.nvregs = 0;
+
+  bool in_memory = takes_addresses(fn);
+  int i = 0;
+  for (Obj *var = fn->params; var; var = var->next, i++) {
+    var->vreg = (!in_memory && is_promotable(var)) ? new_vreg() : 0;
+    ir.param_vregs[i] = var->vreg;
+  }
+  for (; i < 6; i++)
+    ir.param_vregs[i] = 0;
+
+  for (Obj *var = fn->locals; var; var = var->next)
+    if (!in_memory && !var->vreg && is_promotable(var))
+      var->vreg = new_vreg();
+  ir.nvars = ir.nvregs;
 }
 
-// Assign offsets to local variables.
-static void assign_lvar_offsets(Function *prog) {
-  for (Function *fn = prog; fn; fn = fn->next) {
-    int offset = 0;
-    for (Obj *var = fn->locals; var; var = var->next) {
-      offset += var->ty->size;
-      var->offset = -offset;
-    }
-    // %rsp: The stack pointer holds the address of the byte with lowest address which is part of
-    // the stack. It is guaranteed to be 16-byte aligned at process entry.
-    fn->stack_size = align_to(offset, 16);
+// A function to be compiled into its own buffer.
+typedef struct {
+  Function *fn;
+  Node **nodes;   // Node pool of the thread that parsed `fn`
+  char *input;    // Input and file name of that thread, for errors
+  char *filename;
+  int label_base; // First label number the function may use
+  Buffer buf;     // Assembly text of the function
+  Buffer key;     // Cache key, if the cache is on
+  bool cached;    // True if `buf` came from the cache
+} Job;
+
+// Jobs of the current thread. The array and the buffers in it are kept
+// from one call of codegen() to the next, so an error that ends a
+// compilation halfway leaves nothing unreachable behind.
+static _Thread_local Job *job_array;
+static _Thread_local int job_cap;
+
+// Returns `n` empty jobs.
+static Job *get_jobs(int n) {
+  if (n > job_cap) {
+    int cap = job_cap * 2 > n ? job_cap * 2 : n;
+    job_array = realloc(job_array, cap * sizeof(Job));
+    if (!job_array)
+      error("out of memory");
+    memset(job_array + job_cap, 0, (cap - job_cap) * sizeof(Job));
+    job_cap = cap;
+  }
+
+  for (int i = 0; i < n; i++) {
+    Job *job = &job_array[i];
+    *job = (Job){.buf = job->buf, .key = job->key};
+    job->buf.len = job->key.len = 0;
   }
+  return job_array;
 }
 
-void codegen(Function *prog) {
-  assign_lvar_offsets(prog);
+// Emit code for one function.
+static void gen_fn(void *arg, int idx) {
+  Job *job = (Job *)arg + idx;
+  Function *fn = job->fn;
+  if (job->cached)
+    return;
+
+  // The nodes of `fn` are in the pool of the thread that parsed it,
+  // which need not be this one. So are the input and file name that
+  // error_tok() reports against.
+  node_slabs = job->nodes;
+  current_input = job->input;
+  current_filename = job->filename;
+  current_fn = fn;
+  label_seq = label_base = job->label_base;
+
+  assign_vregs(fn);
+  timer_start(T_LVAR_OFFSETS);
+  int frame_size = assign_lvar_offsets(fn);
+  timer_stop(T_LVAR_OFFSETS);
+
+  gen_stmt(fn->body);
+  ir.nlabels = (label_seq - label_base) * 3;
+
+  timer_start(T_REGALLOC);
+  regalloc(&ir, frame_size);
+  timer_stop(T_REGALLOC);
+
+  // The callee-saved registers the function uses are saved below the
+  // spill slots.
+  static Reg callee_saved[] = {REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15};
+  int saved_offset[5];
+  frame_size = ir.frame_size;
+  for (int i = 0; i < 5; i++) {
+    if (ir.used_regs & (1u << callee_saved[i])) {
+      frame_size += 8;
+      saved_offset[i] = -frame_size;
+    }
+  }
+  // %rsp: The stack pointer holds the address of the byte with lowest address which is part of
+  // the stack. It is guaranteed to be 16-byte aligned at process entry.
+  fn->stack_size = align_to(frame_size, 16);
+
+  emit_to(&job->buf);
 
   // https://sourceware.org/binutils/docs/as.html
   // https://www.intel.com/content/www/us/en/developer/articles/technical/intel-sdm.html
   // https://gitlab.com/x86-psABIs/x86-64-ABI
 
+  // Symbols are a central concept: the programmer uses symbols to name things,
+  // the linker uses symbols to link, and the debugger uses symbols to debug.
+  // Warning: as does not place symbols in the object file in the same order
+  // they were declared. This may break some debuggers.
+
+  // .global symbol, .globl symbol
+  // .global makes the symbol visible to ld. If you define symbol in your
+  // partial program, its value is made available to other partial programs that
+  // are linked with it. Otherwise, symbol takes its attributes from a symbol of
+  // the same name from another file linked into the same program. Both
+  // spellings (‘.globl’ and ‘.global’) are accepted, for compatibility with
+  // other assemblers.
+  emit("  .globl ");
+  emit(fn->name);
+  emit("\n");
+
+  // A label is written as a symbol immediately followed by a colon ‘:’. The
+  // symbol then represents the current value of the active location counter,
+  // and is, for example, a suitable instruction operand. You are warned if you
+  // use the same symbol to represent two different locations: the first
+  // definition overrides any other definitions.
+  emit(fn->name);
+  emit(":\n");
+
+  // Prologue
+  // PUSH—Push Word, Doubleword, or Quadword Onto the Stack
+  // Decrements the stack pointer and then stores the source operand on the top of the stack.
+  //
+  // %rbp: callee-saved register; optionally used as frame pointer
+  emit("  push %rbp\n");
+  // %rsp: stack pointer
+  emit("  mov %rsp, %rbp\n");
+  if (fn->stack_size) {
+    emit("  sub ");
+    emit_imm(fn->stack_size);
+    emit(", %rsp\n");
+  }
+
+  for (int i = 0; i < 5; i++)
+    if (ir.used_regs & (1u << callee_saved[i]))
+      move(stack_loc(saved_offset[i]), reg_loc(callee_saved[i]));
+
+  // Save passed-by-register arguments that live in memory to the
+  // stack, then move the others to their registers. The stores come
+  // first, since the moves may overwrite argument registers.
+  Loc dst[6], src[6];
+  int nmoves = 0;
+  int i = 0;
+  for (Obj *var = fn->params; var; var = var->next, i++) {
+    if (!var->vreg)
+      move(stack_loc(var->offset), reg_loc(arg_regs[i]));
+    else if (loc(var->vreg).kind != LOC_NONE) {
+      dst[nmoves] = loc(var->vreg);
+      src[nmoves++] = reg_loc(arg_regs[i]);
+    }
+  }
+  parallel_move(dst, src, nmoves);
+
+  // Emit code
+  for (int i = 0; i < ir.ncode; i++)
+    emit_ir(i);
+  free(ir.locs);
+
+  // Epilogue
+  emit(".L.return.");
+  emit(fn->name);
+  emit(":\n");
+  for (int i = 0; i < 5; i++)
+    if (ir.used_regs & (1u << callee_saved[i]))
+      move(reg_loc(callee_saved[i]), stack_loc(saved_offset[i]));
+
+  // restore %rbp and %rsp
+  emit("  mov %rbp, %rsp\n");
+  // POP—Pop a Value From the Stack
+  // Loads the value from the top of the stack to the location specified with the destination
+  // operand (or explicit opcode) and then increments the stack pointer. The destination operand can
+  // be a general-purpose register, memory location, or segment register.
+  emit("  pop %rbp\n");
+
+  //   Position  |            Contents         |  Frame
+  // ------------+-----------------------------+----------
+  // 8n+16(%rbp) | memory argument eightbyte n |
+  //             |             . . .           | Previous
+  //   16(%rbp)  | memory argument eightbyte 0 |
+  // ------------+-----------------------------+----------
+  //   8(%rbp)   |       return address        |
+  //             +-----------------------------+
+  //   0(%rbp)   |     previous %rbp value     |
+  //             +-----------------------------+
+  //  -8(%rbp)   |         unspecified         | Current
+  //             |             . . .           |
+  //   0(%rsp)   |         variable size       |
+  //             +-----------------------------+
+  // -128(%rsp)  |           red zone          |
+
+  // RET—Return From Procedure
+  // Transfers program control to a return address located on the top of the
+  // stack. The address is usually placed on the stack by a CALL instruction,
+  // and the return is made to the instruction that follows the CALL
+  // instruction.
+  emit("  ret\n");
+}
+
+void codegen(Function *prog, int nthreads) {
+  int nfuncs = 0;
+  for (Function *fn = prog; fn; fn = fn->next)
+    nfuncs++;
+
+  // Give each function the label numbers it would get if functions
+  // were compiled one by one in source order, so that the output is
+  // the same no matter how many threads are used.
+  Job *jobs = get_jobs(nfuncs);
+  int label_base = 1;
+  int i = 0;
   for (Function *fn = prog; fn; fn = fn->next) {
-    // Symbols are a central concept: the programmer uses symbols to name things,
-    // the linker uses symbols to link, and the debugger uses symbols to debug.
-    // Warning: as does not place symbols in the object file in the same order
-    // they were declared. This may break some debuggers.
-
-    // .global symbol, .globl symbol
-    // .global makes the symbol visible to ld. If you define symbol in your
-    // partial program, its value is made available to other partial programs that
-    // are linked with it. Otherwise, symbol takes its attributes from a symbol of
-    // the same name from another file linked into the same program. Both
-    // spellings (‘.globl’ and ‘.global’) are accepted, for compatibility with
-    // other assemblers.
-    printf("  .globl %s\n", fn->name);
-
-    // A label is written as a symbol immediately followed by a colon ‘:’. The
-    // symbol then represents the current value of the active location counter,
-    // and is, for example, a suitable instruction operand. You are warned if you
-    // use the same symbol to represent two different locations: the first
-    // definition overrides any other definitions.
-    printf("%s:\n", fn->name);
-    current_fn = fn;
-
-    // Prologue
-    // %rbp: callee-saved register; optionally used as frame pointer
-    printf("  push %%rbp\n");
-    // %rsp: stack pointer
-    printf("  mov %%rsp, %%rbp\n");
-    printf("  sub $%d, %%rsp\n", fn->stack_size);
-
-    // Save passed-by-register arguments to the stack
-    int i = 0;
-    for (Obj *var = fn->params; var; var = var->next)
-      printf("  mov %s, %d(%%rbp)\n", argreg[i++], var->offset);
-
-    // Emit code
-    gen_stmt(fn->body);
-    assert(depth == 0);
-
-    // Epilogue
-    printf(".L.return.%s:\n", fn->name);
-    // restore %rbp and %rsp
-    printf("  mov %%rbp, %%rsp\n");
-    printf("  pop %%rbp\n");
-
-    //   Position  |            Contents         |  Frame
-    // ------------+-----------------------------+----------
-    // 8n+16(%rbp) | memory argument eightbyte n |
-    //             |             . . .           | Previous
-    //   16(%rbp)  | memory argument eightbyte 0 |
-    // ------------+-----------------------------+----------
-    //   8(%rbp)   |       return address        |
-    //             +-----------------------------+
-    //   0(%rbp)   |     previous %rbp value     |
-    //             +-----------------------------+
-    //  -8(%rbp)   |         unspecified         | Current
-    //             |             . . .           |
-    //   0(%rsp)   |         variable size       |
-    //             +-----------------------------+
-    // -128(%rsp)  |           red zone          |
-
-    // RET—Return From Procedure
-    // Transfers program control to a return address located on the top of the
-    // stack. The address is usually placed on the stack by a CALL instruction,
-    // and the return is made to the instruction that follows the CALL
-    // instruction.
-    printf("  ret\n");
+    jobs[i].fn = fn;
+    jobs[i].nodes = node_slabs;
+    jobs[i].input = current_input;
+    jobs[i].filename = current_filename;
+    jobs[i].label_base = label_base;
+    label_base += count_labels(fn->body);
+    i++;
+  }
+
+  // Take what we can from the cache. Keys are made of tokens, which
+  // belong to this thread, so this can't be done by the workers.
+  if (cache_dir) {
+    for (i = 0; i < nfuncs; i++) {
+      Job *job = &jobs[i];
+      cache_key(job->fn, &job->key);
+      job->cached = cache_lookup(&job->key, job->label_base, &job->buf);
+      if (job->cached)
+        counters.cache_hits++;
+      else
+        counters.cache_misses++;
+    }
   }
+
+  parallel_for(nfuncs, nthreads, gen_fn, jobs);
+
+  // Concatenate the buffers in source order, saving the functions that
+  // were compiled in the cache on the way.
+  bool stored = false;
+  for (i = 0; i < nfuncs; i++) {
+    Job *job = &jobs[i];
+    if (cache_dir && !job->cached) {
+      cache_store(&job->key, job->label_base, &job->buf);
+      stored = true;
+    }
+    write_output(&job->buf);
+  }
+
+  if (stored)
+    counters.cache_evictions += cache_trim();
 }
@@ -0,0 +1,158 @@
+// This file writes the machine code produced by the built-in assembler
+// as an ELF64 relocatable object file (.o) for x86-64.
+//
+// The file has the following layout:
+//
+//   ELF header
+//   .text        machine code
+//   .rela.text   relocations against the code
+//   .symtab      symbol table
+//   .strtab      symbol names
+//   .shstrtab    section names
+//   section header table
+//
+// plus an empty .note.GNU-stack section, which tells the linker that
+// the object doesn't need an executable stack.
+//
+// https://refspecs.linuxfoundation.org/elf/gabi4+/contents.html
+// https://gitlab.com/x86-psABIs/x86-64-ABI
+
+#include "chibicc.h"
+#include <elf.h>
+
+// Section header indices
+enum {
+  SEC_NULL,
+  SEC_TEXT,
+  SEC_RELA_TEXT,
+  SEC_SYMTAB,
+  SEC_STRTAB,
+  SEC_SHSTRTAB,
+  SEC_NOTE_GNU_STACK,
+  NUM_SECTIONS,
+};
+
+static void pad_to(Buffer *buf, size_t align) {
+  static char zeros[16];
+  buf_append(buf, zeros, (align - buf->len % align) % align);
+}
+
+// Appends a NUL-terminated string to a string table and returns its
+// offset in the table.
+static int add_str(Buffer *tab, char *s) {
+  int off = tab->len;
+  buf_append(tab, s, strlen(s) + 1);
+  return off;
+}
+
+void write_elf(ObjCode *obj, Buffer *out) {
+  Buffer strtab = {};
+  Buffer shstrtab = {};
+  Buffer symtab = {};
+  Buffer rela = {};
+
+  add_str(&strtab, "");
+  add_str(&shstrtab, "");
+
+  // Symbol 0 is the undefined symbol and symbol 1 is the .text section.
+  // Local symbols must precede global ones.
+  Elf64_Sym null_sym = {};
+  buf_append(&symtab, (char *)&null_sym, sizeof(null_sym));
+
+  Elf64_Sym text_sym = {
+    .st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION),
+    .st_shndx = SEC_TEXT,
+  };
+  buf_append(&symtab, (char *)&text_sym, sizeof(text_sym));
+  int first_global = 2;
+
+  for (int i = 0; i < obj->nsyms; i++) {
+    ObjSym *s = &obj->syms[i];
+    Elf64_Sym sym = {
+      .st_name = add_str(&strtab, s->name),
+      .st_info = ELF64_ST_INFO(STB_GLOBAL, s->defined ? STT_FUNC : STT_NOTYPE),
+      .st_shndx = s->defined ? SEC_TEXT : SHN_UNDEF,
+      .st_value = s->offset,
+      .st_size = s->size,
+    };
+    buf_append(&symtab, (char *)&sym, sizeof(sym));
+  }
+
+  // R_X86_64_PLT32 (L + A - P) is what assemblers use for calls: it
+  // works whether the callee ends up in the same executable or in a
+  // shared library.
+  for (int i = 0; i < obj->nrelocs; i++) {
+    ObjReloc *r = &obj->relocs[i];
+    Elf64_Rela rel = {
+      .r_offset = r->offset,
+      .r_info = ELF64_R_INFO(first_global + r->sym, R_X86_64_PLT32),
+      .r_addend = r->addend,
+    };
+    buf_append(&rela, (char *)&rel, sizeof(rel));
+  }
+
+  Elf64_Shdr shdr[NUM_SECTIONS] = {};
+
+  // Lay out the section contents after the ELF header.
+  Buffer *buf = out;
+  size_t start = buf->len;
+  Elf64_Ehdr ehdr = {};
+  buf_append(buf, (char *)&ehdr, sizeof(ehdr));
+
+#define SECTION(idx, name, type, flags, contents, align, entsize)       \
+  do {                                                                  \
+    pad_to(buf, align);                                                 \
+    shdr[idx] = (Elf64_Shdr){                                           \
+      .sh_name = add_str(&shstrtab, name),                              \
+      .sh_type = type,                                                  \
+      .sh_flags = flags,                                                \
+      .sh_offset = buf->len - start,                                    \
+      .sh_size = (contents)->len,                                       \
+      .sh_addralign = align,                                            \
+      .sh_entsize = entsize,                                            \
+    };                                                                  \
+    buf_append(buf, (contents)->data, (contents)->len);                 \
+  } while (0)
+
+  Buffer empty = {};
+  SECTION(SEC_TEXT, ".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, &obj->code, 16, 0);
+  SECTION(SEC_RELA_TEXT, ".rela.text", SHT_RELA, SHF_INFO_LINK, &rela, 8, sizeof(Elf64_Rela));
+  SECTION(SEC_SYMTAB, ".symtab", SHT_SYMTAB, 0, &symtab, 8, sizeof(Elf64_Sym));
+  SECTION(SEC_STRTAB, ".strtab", SHT_STRTAB, 0, &strtab, 1, 0);
+  SECTION(SEC_NOTE_GNU_STACK, ".note.GNU-stack", SHT_PROGBITS, 0, &empty, 1, 0);
+
+  // .shstrtab must name itself before its contents are copied.
+  int shstrtab_name = add_str(&shstrtab, ".shstrtab");
+  SECTION(SEC_SHSTRTAB, "", SHT_STRTAB, 0, &shstrtab, 1, 0);
+  shdr[SEC_SHSTRTAB].sh_name = shstrtab_name;
+#undef SECTION
+
+  // sh_link and sh_info have section-type specific meanings.
+  shdr[SEC_RELA_TEXT].sh_link = SEC_SYMTAB; // Symbol table used by the relocations
+  shdr[SEC_RELA_TEXT].sh_info = SEC_TEXT;   // Section the relocations apply to
+  shdr[SEC_SYMTAB].sh_link = SEC_STRTAB;    // String table of the symbol names
+  shdr[SEC_SYMTAB].sh_info = first_global;  // One greater than the last local symbol
+
+  pad_to(buf, 8);
+  size_t shoff = buf->len - start;
+  buf_append(buf, (char *)shdr, sizeof(shdr));
+
+  ehdr = (Elf64_Ehdr){
+    .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT,
+                ELFOSABI_SYSV},
+    .e_type = ET_REL,
+    .e_machine = EM_X86_64,
+    .e_version = EV_CURRENT,
+    .e_shoff = shoff,
+    .e_ehsize = sizeof(Elf64_Ehdr),
+    .e_shentsize = sizeof(Elf64_Shdr),
+    .e_shnum = NUM_SECTIONS,
+    .e_shstrndx = SEC_SHSTRTAB,
+  };
+  memcpy(buf->data + start, &ehdr, sizeof(ehdr));
+
+  buf_free(&strtab);
+  buf_free(&shstrtab);
+  buf_free(&symtab);
+  buf_free(&rela);
+}
@@ -0,0 +1,229 @@
+// This file contains the assembly emitter.
+//
+// Code generation appends text to an in-memory buffer instead of
+// calling printf for each instruction. Instructions are built from
+// literal strings plus a few specialized formatters for numbers,
+// immediates, memory operands and labels, so no format string is
+// parsed at run time. The buffer is handed to the output file in large
+// chunks with write(2).
+
+#include "chibicc.h"
+
+// Buffer that emit() and friends append to. Each thread has its own.
+static _Thread_local Buffer *out;
+
+// Output file descriptor, or -1 if output is only counted. Like the
+// rest of the output state, it belongs to the thread that opened it.
+static _Thread_local int out_fd = STDOUT_FILENO;
+static _Thread_local char *out_path = "-";
+
+// If set, the output is appended here instead of written to a file.
+static _Thread_local Buffer *out_buf;
+
+// Number of bytes written (or counted) so far.
+static _Thread_local size_t out_size;
+
+// If true, the output is an object file. The assembly text is then
+// collected here and encoded when the output is closed.
+static _Thread_local bool out_object;
+static _Thread_local Buffer out_text;
+
+static void reserve(Buffer *buf, size_t n) {
+  if (buf->len + n <= buf->cap)
+    return;
+
+  size_t cap = buf->cap ? buf->cap : 4096;
+  while (cap < buf->len + n)
+    cap *= 2;
+
+  buf->data = realloc(buf->data, cap);
+  if (!buf->data)
+    error("out of memory");
+  buf->cap = cap;
+}
+
+void buf_append(Buffer *buf, char *s, size_t len) {
+  reserve(buf, len);
+  memcpy(buf->data + buf->len, s, len);
+  buf->len += len;
+}
+
+void buf_free(Buffer *buf) {
+  free(buf->data);
+  *buf = (Buffer){};
+}
+
+// Makes subsequent emit calls append to `buf`.
+void emit_to(Buffer *buf) {
+  out = buf;
+}
+
+// Appends literal text, e.g. emit("  push %rax\n").
+void emit(char *s) {
+  buf_append(out, s, strlen(s));
+}
+
+// Appends a decimal integer.
+void emit_num(long val) {
+  char tmp[24];
+  char *p = tmp + sizeof(tmp);
+  unsigned long u = val < 0 ? -(unsigned long)val : val;
+
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (val < 0)
+    *--p = '-';
+
+  buf_append(out, p, tmp + sizeof(tmp) - p);
+}
+
+// Appends an immediate operand, e.g. "$42".
+void emit_imm(long val) {
+  buf_append(out, "$", 1);
+  emit_num(val);
+}
+
+// Appends a memory operand, e.g. "-8(%rbp)".
+void emit_mem(int offset, char *reg) {
+  emit_num(offset);
+  buf_append(out, "(", 1);
+  emit(reg);
+  buf_append(out, ")", 1);
+}
+
+// Appends a numbered label, e.g. emit_label(".L.else.", 3) appends
+// ".L.else.3".
+void emit_label(char *prefix, int n) {
+  emit(prefix);
+  emit_num(n);
+}
+
+// Opens the output file. "-" means stdout. If `count_only` is true,
+// nothing is written at all and only the size of the output is
+// recorded, which is useful for benchmarking the compiler itself. If
+// `object` is true, the output is an ELF object file assembled by the
+// built-in assembler instead of assembly text.
+void open_output(char *path, bool count_only, bool object) {
+  out_path = path;
+  out_size = 0;
+  out_object = object;
+  out_text.len = 0;
+  out_buf = NULL;
+
+  if (count_only) {
+    out_fd = -1;
+    return;
+  }
+
+  if (!strcmp(path, "-")) {
+    out_fd = STDOUT_FILENO;
+    return;
+  }
+
+  // O_TRUNC: If the file already exists and is a regular file and the access mode allows writing
+  // it will be truncated to length 0.
+  out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out_fd == -1)
+    error("cannot open output file: %s: %s", path, strerror(errno));
+}
+
+// Like open_output(), but the output is appended to `buf`.
+void open_output_buffer(Buffer *buf, bool object) {
+  open_output("-", true, object);
+  out_buf = buf;
+}
+
+static void write_bytes(Buffer *buf) {
+  out_size += buf->len;
+
+  if (out_buf) {
+    buf_append(out_buf, buf->data, buf->len);
+    buf->len = 0;
+    return;
+  }
+
+  for (char *p = buf->data; out_fd != -1 && p < buf->data + buf->len;) {
+    // ssize_t write(int fd, const void *buf, size_t count);
+    // write() writes up to count bytes from the buffer starting at buf to the file referred to by
+    // the file descriptor fd. The number of bytes written may be less than count.
+    ssize_t n = write(out_fd, p, buf->data + buf->len - p);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      error("%s: write failed: %s", out_path, strerror(errno));
+    }
+    p += n;
+  }
+  buf->len = 0;
+}
+
+// Returns the number of instructions in a piece of assembly text.
+// Instructions are the indented lines other than directives.
+static long count_instructions(Buffer *buf) {
+  long n = 0;
+  char *end = buf->data + buf->len;
+  for (char *p = buf->data; p < end;) {
+    if (end - p > 2 && p[0] == ' ' && p[1] == ' ' && p[2] != '.')
+      n++;
+    char *nl = memchr(p, '\n', end - p);
+    p = nl ? nl + 1 : end;
+  }
+  return n;
+}
+
+// Writes the contents of `buf` to the output file and empties it.
+void write_output(Buffer *buf) {
+  if (time_report)
+    counters.instructions += count_instructions(buf);
+
+  if (out_object) {
+    buf_append(&out_text, buf->data, buf->len);
+    buf->len = 0;
+    return;
+  }
+  write_bytes(buf);
+}
+
+// Encodes the assembly collected in object mode into `obj`.
+void assemble_output(ObjCode *obj) {
+  timer_start(T_ASSEMBLE);
+  assemble(out_text.data, out_text.len, obj);
+  buf_free(&out_text);
+  timer_stop(T_ASSEMBLE);
+}
+
+// Closes the output file and returns the number of bytes written or
+// counted.
+size_t close_output(void) {
+  if (out_object) {
+    ObjCode obj = {};
+    assemble_output(&obj);
+
+    Buffer elf = {};
+    write_elf(&obj, &elf);
+    write_bytes(&elf);
+    buf_free(&elf);
+    obj_free(&obj);
+  }
+
+  if (out_fd != -1 && out_fd != STDOUT_FILENO && close(out_fd) == -1)
+    error("%s: close failed: %s", out_path, strerror(errno));
+  out_fd = STDOUT_FILENO;
+  out_buf = NULL;
+  return out_size;
+}
+
+// Abandons the output after a compile error. A partly written output
+// file is removed, so that a failed unit leaves nothing behind that
+// looks like a result.
+void discard_output(void) {
+  if (out_fd != -1 && out_fd != STDOUT_FILENO) {
+    close(out_fd);
+    unlink(out_path);
+  }
+  out_fd = STDOUT_FILENO;
+  out_buf = NULL;
+  out_text.len = 0;
+}
@@ -0,0 +1,714 @@
+// This file contains a built-in x86-64 assembler for the subset of
+// instructions and directives that codegen.c emits.
+//
+// It takes the assembly text produced by the emitter (so the text and
+// the machine code can never disagree) and encodes it directly into
+// machine code, without running an external assembler. The result is
+// an ObjCode: the bytes of the .text section, the global symbols it
+// defines or references and the relocations against the latter. It is
+// written out as an ELF object file by elf.c.
+//
+// Jumps and calls to labels defined in the same unit are resolved here.
+// All jumps use 32-bit displacements, so no relaxation is needed.
+//
+// https://www.intel.com/content/www/us/en/developer/articles/technical/intel-sdm.html
+// Volume 2, Chapter 2: Instruction Format
+
+#include "chibicc.h"
+
+//
+// Operands
+//
+
+typedef enum {
+  OP_REG, // %rax
+  OP_IMM, // $42
+  OP_MEM, // -8(%rbp), (%rax,%rdi,8)
+  OP_SYM, // foo, .L.end.1
+} OperandKind;
+
+typedef struct {
+  OperandKind kind;
+  int reg;   // Register number if OP_REG
+  int size;  // Register size in bytes if OP_REG
+  long imm;  // Value if OP_IMM
+  int base;  // Base register if OP_MEM, or -1
+  int index; // Index register if OP_MEM, or -1
+  int scale; // 1, 2, 4 or 8
+  long disp; // Displacement if OP_MEM
+  char *sym; // Name if OP_SYM
+  int len;   // Length of the name
+} Operand;
+
+static char *regs64[] = {
+  "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+  "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+static char *regs32[] = {
+  "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+  "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
+};
+
+static char *regs8[] = {
+  "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+  "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+};
+
+// Condition codes, in the order of their encodings.
+static char *cond_codes[] = {
+  "o", "no", "b", "ae", "e", "ne", "be", "a",
+  "s", "ns", "p", "np", "l", "ge", "le", "g",
+};
+
+// Current line, for error messages
+static _Thread_local char *line_start;
+static _Thread_local int line_len;
+
+noreturn static void asm_error(char *msg) {
+  error("internal assembler: %s: %.*s", msg, line_len, line_start);
+}
+
+static bool word_eq(char *s, int len, char *word) {
+  return strlen(word) == len && !memcmp(s, word, len);
+}
+
+static int find_word(char **table, int n, char *s, int len) {
+  for (int i = 0; i < n; i++)
+    if (word_eq(s, len, table[i]))
+      return i;
+  return -1;
+}
+
+// Parses a register name after '%' and returns its number.
+static int parse_reg(char **rest, char *p, int *size) {
+  char *start = p;
+  while (isalnum(*p))
+    p++;
+  int len = p - start;
+  *rest = p;
+
+  int r;
+  if ((r = find_word(regs64, 16, start, len)) >= 0) {
+    *size = 8;
+    return r;
+  }
+  if ((r = find_word(regs32, 16, start, len)) >= 0) {
+    *size = 4;
+    return r;
+  }
+  if ((r = find_word(regs8, 16, start, len)) >= 0) {
+    *size = 1;
+    return r;
+  }
+  asm_error("unknown register");
+}
+
+static char *skip_blank(char *p) {
+  while (*p == ' ' || *p == '\t')
+    p++;
+  return p;
+}
+
+static Operand parse_operand(char **rest, char *p) {
+  Operand op = {.base = -1, .index = -1, .scale = 1};
+  p = skip_blank(p);
+
+  if (*p == '%') {
+    op.kind = OP_REG;
+    op.reg = parse_reg(&p, p + 1, &op.size);
+    *rest = p;
+    return op;
+  }
+
+  if (*p == '$') {
+    op.kind = OP_IMM;
+    op.imm = strtol(p + 1, &p, 10);
+    *rest = p;
+    return op;
+  }
+
+  if (*p == '-' || isdigit(*p) || *p == '(') {
+    op.kind = OP_MEM;
+    if (*p != '(')
+      op.disp = strtol(p, &p, 10);
+    if (*p++ != '(')
+      asm_error("bad memory operand");
+
+    int size;
+    if (*p == '%')
+      op.base = parse_reg(&p, p + 1, &size);
+    if (*p == ',') {
+      p = skip_blank(p + 1);
+      if (*p != '%')
+        asm_error("bad index register");
+      op.index = parse_reg(&p, p + 1, &size);
+      if (*p == ',')
+        op.scale = strtol(p + 1, &p, 10);
+    }
+    if (*p++ != ')')
+      asm_error("bad memory operand");
+    *rest = p;
+    return op;
+  }
+
+  if (isalpha(*p) || *p == '_' || *p == '.') {
+    op.kind = OP_SYM;
+    op.sym = p;
+    while (isalnum(*p) || *p == '_' || *p == '.')
+      p++;
+    op.len = p - op.sym;
+    *rest = p;
+    return op;
+  }
+
+  asm_error("bad operand");
+}
+
+//
+// Encoder
+//
+
+// A reference to a label or symbol that is resolved after the whole
+// input has been read.
+typedef struct {
+  int offset; // Position of the rel32 field
+  char *name;
+  int len;
+} Fixup;
+
+typedef struct {
+  ObjCode *obj;
+  Buffer *code;
+  HashMap labels; // Label name -> offset + 1
+  HashMap syms;   // Global symbol name -> index in obj->syms + 1
+  Fixup *fixups;
+  int nfixups;
+  int fixup_cap;
+} Asm;
+
+static void byte(Asm *as, int b) {
+  char c = b;
+  buf_append(as->code, &c, 1);
+}
+
+static void imm32(Asm *as, long v) {
+  uint32_t u = v;
+  char b[4] = {u, u >> 8, u >> 16, u >> 24};
+  buf_append(as->code, b, 4);
+}
+
+static void imm64(Asm *as, long v) {
+  imm32(as, v);
+  imm32(as, v >> 32);
+}
+
+static bool is_imm8(long v) {
+  return v == (int8_t)v;
+}
+
+static bool is_imm32(long v) {
+  return v == (int32_t)v;
+}
+
+// Emits a REX prefix if needed. `w` selects 64-bit operand size; `r`,
+// `x` and `b` are the register numbers that go to the ModRM.reg,
+// SIB.index and ModRM.rm/SIB.base fields (or -1). `byte_reg` is set if
+// an 8-bit register is involved, in which case %spl-%dil need a REX
+// prefix to be distinguished from %ah-%bh.
+static void rex(Asm *as, bool w, int r, int x, int b, bool byte_reg) {
+  int v = 0x40;
+  if (w)
+    v |= 8;
+  if (r >= 8)
+    v |= 4;
+  if (x >= 8)
+    v |= 2;
+  if (b >= 8)
+    v |= 1;
+
+  bool need = v != 0x40 || (byte_reg && ((4 <= r && r < 8) || (4 <= b && b < 8)));
+  if (need)
+    byte(as, v);
+}
+
+// ModRM byte for a register-direct operand.
+static void modrm_reg(Asm *as, int reg, int rm) {
+  byte(as, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// ModRM (and SIB and displacement) for a memory operand.
+static void modrm_mem(Asm *as, int reg, Operand *m) {
+  int scale_bits = m->scale == 8 ? 3 : m->scale == 4 ? 2 : m->scale == 2 ? 1 : 0;
+
+  // No base register: [index*scale + disp32]
+  if (m->base == -1) {
+    byte(as, (reg & 7) << 3 | 4);
+    byte(as, scale_bits << 6 | ((m->index == -1 ? 4 : m->index) & 7) << 3 | 5);
+    imm32(as, m->disp);
+    return;
+  }
+
+  // %rbp and %r13 as a base always need a displacement, because
+  // mod=00 with rm=101 means RIP-relative addressing.
+  int mod;
+  if (m->disp == 0 && (m->base & 7) != 5)
+    mod = 0;
+  else if (is_imm8(m->disp))
+    mod = 1;
+  else
+    mod = 2;
+
+  // %rsp and %r12 as a base need a SIB byte, because rm=100 means
+  // "SIB follows".
+  if (m->index == -1 && (m->base & 7) != 4) {
+    byte(as, mod << 6 | (reg & 7) << 3 | (m->base & 7));
+  } else {
+    if (m->index == 4)
+      asm_error("%rsp cannot be an index register");
+    byte(as, mod << 6 | (reg & 7) << 3 | 4);
+    byte(as, scale_bits << 6 | ((m->index == -1 ? 4 : m->index) & 7) << 3 | (m->base & 7));
+  }
+
+  if (mod == 1)
+    byte(as, m->disp);
+  else if (mod == 2)
+    imm32(as, m->disp);
+}
+
+// Emits `opcode` with a ModRM operand `rm` (register or memory) and
+// `reg` in the ModRM.reg field, which is either a register number or
+// an opcode extension.
+static void op_rm(Asm *as, bool w, char *opcode, int oplen, int reg, Operand *rm) {
+  bool byte_reg = rm->kind == OP_REG && rm->size == 1;
+  if (rm->kind == OP_REG)
+    rex(as, w, reg, -1, rm->reg, byte_reg);
+  else
+    rex(as, w, reg, rm->index, rm->base, false);
+
+  buf_append(as->code, opcode, oplen);
+
+  if (rm->kind == OP_REG)
+    modrm_reg(as, reg, rm->reg);
+  else
+    modrm_mem(as, reg, rm);
+}
+
+// Records a rel32 reference to `sym` at the current position and
+// emits a placeholder.
+static void rel32(Asm *as, Operand *sym) {
+  if (as->nfixups == as->fixup_cap) {
+    as->fixup_cap = as->fixup_cap ? as->fixup_cap * 2 : 64;
+    as->fixups = realloc(as->fixups, as->fixup_cap * sizeof(Fixup));
+  }
+  as->fixups[as->nfixups++] = (Fixup){as->code->len, sym->sym, sym->len};
+  imm32(as, 0);
+}
+
+static void expect(bool cond) {
+  if (!cond)
+    asm_error("unsupported operands");
+}
+
+// Returns the index of a global symbol, adding it if it is new.
+static int add_sym(Asm *as, char *name, int len) {
+  intptr_t idx = (intptr_t)hashmap_get2(&as->syms, name, len);
+  if (idx)
+    return idx - 1;
+
+  ObjCode *obj = as->obj;
+  if (obj->nsyms == obj->sym_cap) {
+    obj->sym_cap = obj->sym_cap ? obj->sym_cap * 2 : 16;
+    obj->syms = realloc(obj->syms, obj->sym_cap * sizeof(ObjSym));
+  }
+  obj->syms[obj->nsyms] = (ObjSym){.name = strndup(name, len)};
+  hashmap_put2(&as->syms, name, len, (void *)(intptr_t)(obj->nsyms + 1));
+  return obj->nsyms++;
+}
+
+static void add_reloc(ObjCode *obj, int offset, int sym, int addend) {
+  if (obj->nrelocs == obj->reloc_cap) {
+    obj->reloc_cap = obj->reloc_cap ? obj->reloc_cap * 2 : 16;
+    obj->relocs = realloc(obj->relocs, obj->reloc_cap * sizeof(ObjReloc));
+  }
+  obj->relocs[obj->nrelocs++] = (ObjReloc){offset, sym, addend};
+}
+
+// Group 1 arithmetic instructions share their encodings; the number is
+// both the ModRM.reg extension for the immediate forms and bits 3-5 of
+// the opcode for the register forms.
+static int alu_op(char *mn) {
+  static char *ops[] = {"add", "or", "adc", "sbb", "and", "sub", "xor", "cmp"};
+  for (int i = 0; i < 8; i++)
+    if (!strcmp(mn, ops[i]))
+      return i;
+  return -1;
+}
+
+// Group 3 unary instructions (opcode F7 /n)
+static int unary_op(char *mn) {
+  static char *ops[] = {"test", NULL, "not", "neg", "mul", "imul", "div", "idiv"};
+  for (int i = 2; i < 8; i++)
+    if (!strcmp(mn, ops[i]))
+      return i;
+  return -1;
+}
+
+// Group 2 shift instructions (opcode C1 /n and D3 /n)
+static int shift_op(char *mn) {
+  if (!strcmp(mn, "shl") || !strcmp(mn, "sal"))
+    return 4;
+  if (!strcmp(mn, "shr"))
+    return 5;
+  if (!strcmp(mn, "sar"))
+    return 7;
+  return -1;
+}
+
+static int cond_code(char *s) {
+  if (!strcmp(s, "z"))
+    return 4;
+  if (!strcmp(s, "nz"))
+    return 5;
+  for (int i = 0; i < 16; i++)
+    if (!strcmp(s, cond_codes[i]))
+      return i;
+  return -1;
+}
+
+static void encode(Asm *as, char *mn, Operand *ops, int nops) {
+  Operand *src = &ops[0];
+  Operand *dst = &ops[nops - 1];
+  int n;
+
+  if (!strcmp(mn, "ret")) {
+    expect(nops == 0);
+    byte(as, 0xc3);
+    return;
+  }
+
+  if (!strcmp(mn, "cqo")) {
+    expect(nops == 0);
+    byte(as, 0x48);
+    byte(as, 0x99);
+    return;
+  }
+
+  if (!strcmp(mn, "push") || !strcmp(mn, "pop")) {
+    expect(nops == 1 && src->kind == OP_REG && src->size == 8);
+    rex(as, false, -1, -1, src->reg, false);
+    byte(as, (mn[1] == 'u' ? 0x50 : 0x58) + (src->reg & 7));
+    return;
+  }
+
+  if (!strcmp(mn, "mov")) {
+    expect(nops == 2);
+
+    if (src->kind == OP_IMM && dst->kind == OP_REG) {
+      expect(dst->size == 8);
+      if (is_imm32(src->imm)) {
+        // REX.W + C7 /0 id: MOV r/m64, imm32 (sign-extended)
+        op_rm(as, true, "\xc7", 1, 0, dst);
+        imm32(as, src->imm);
+      } else {
+        // REX.W + B8+ rd io: MOV r64, imm64
+        rex(as, true, -1, -1, dst->reg, false);
+        byte(as, 0xb8 + (dst->reg & 7));
+        imm64(as, src->imm);
+      }
+      return;
+    }
+
+    if (src->kind == OP_IMM && dst->kind == OP_MEM) {
+      expect(is_imm32(src->imm));
+      op_rm(as, true, "\xc7", 1, 0, dst);
+      imm32(as, src->imm);
+      return;
+    }
+
+    // REX.W + 89 /r: MOV r/m64, r64
+    if (src->kind == OP_REG && (dst->kind == OP_REG || dst->kind == OP_MEM)) {
+      expect(src->size == 8 && (dst->kind == OP_MEM || dst->size == 8));
+      op_rm(as, true, "\x89", 1, src->reg, dst);
+      return;
+    }
+
+    // REX.W + 8B /r: MOV r64, r/m64
+    if (src->kind == OP_MEM && dst->kind == OP_REG) {
+      expect(dst->size == 8);
+      op_rm(as, true, "\x8b", 1, dst->reg, src);
+      return;
+    }
+    expect(false);
+  }
+
+  if (!strcmp(mn, "movzx") || !strcmp(mn, "movzb") || !strcmp(mn, "movzbq")) {
+    // REX.W + 0F B6 /r: MOVZX r64, r/m8
+    expect(nops == 2 && dst->kind == OP_REG && dst->size == 8);
+    expect(src->kind == OP_MEM || src->size == 1);
+    op_rm(as, true, "\x0f\xb6", 2, dst->reg, src);
+    return;
+  }
+
+  if (!strcmp(mn, "lea")) {
+    // REX.W + 8D /r: LEA r64, m
+    expect(nops == 2 && src->kind == OP_MEM && dst->kind == OP_REG);
+    op_rm(as, true, "\x8d", 1, dst->reg, src);
+    return;
+  }
+
+  if ((n = alu_op(mn)) >= 0) {
+    expect(nops == 2 && dst->kind != OP_IMM);
+
+    if (src->kind == OP_IMM) {
+      // REX.W + 83 /n ib or REX.W + 81 /n id
+      expect(is_imm32(src->imm));
+      if (is_imm8(src->imm)) {
+        op_rm(as, true, "\x83", 1, n, dst);
+        byte(as, src->imm);
+      } else {
+        op_rm(as, true, "\x81", 1, n, dst);
+        imm32(as, src->imm);
+      }
+      return;
+    }
+
+    // REX.W + 01 /r etc: OP r/m64, r64
+    if (src->kind == OP_REG) {
+      char opcode = n * 8 + 1;
+      op_rm(as, true, &opcode, 1, src->reg, dst);
+      return;
+    }
+
+    // REX.W + 03 /r etc: OP r64, r/m64
+    expect(src->kind == OP_MEM && dst->kind == OP_REG);
+    char opcode = n * 8 + 3;
+    op_rm(as, true, &opcode, 1, dst->reg, src);
+    return;
+  }
+
+  if (!strcmp(mn, "test")) {
+    // REX.W + 85 /r: TEST r/m64, r64
+    expect(nops == 2 && src->kind == OP_REG);
+    op_rm(as, true, "\x85", 1, src->reg, dst);
+    return;
+  }
+
+  if (!strcmp(mn, "imul") && nops >= 2) {
+    if (nops == 3) {
+      // REX.W + 6B /r ib or REX.W + 69 /r id: IMUL r64, r/m64, imm
+      Operand *rm = &ops[1];
+      expect(src->kind == OP_IMM && is_imm32(src->imm) && dst->kind == OP_REG);
+      if (is_imm8(src->imm)) {
+        op_rm(as, true, "\x6b", 1, dst->reg, rm);
+        byte(as, src->imm);
+      } else {
+        op_rm(as, true, "\x69", 1, dst->reg, rm);
+        imm32(as, src->imm);
+      }
+      return;
+    }
+
+    // REX.W + 0F AF /r: IMUL r64, r/m64
+    expect(dst->kind == OP_REG && src->kind != OP_IMM);
+    op_rm(as, true, "\x0f\xaf", 2, dst->reg, src);
+    return;
+  }
+
+  if ((n = unary_op(mn)) >= 0) {
+    // REX.W + F7 /n
+    expect(nops == 1 && src->kind != OP_IMM && src->kind != OP_SYM);
+    op_rm(as, true, "\xf7", 1, n, src);
+    return;
+  }
+
+  if ((n = shift_op(mn)) >= 0) {
+    expect(nops == 2 && dst->kind == OP_REG);
+    if (src->kind == OP_IMM) {
+      // REX.W + C1 /n ib
+      op_rm(as, true, "\xc1", 1, n, dst);
+      byte(as, src->imm);
+      return;
+    }
+    // REX.W + D3 /n: shift by %cl
+    expect(src->kind == OP_REG && src->reg == 1 && src->size == 1);
+    op_rm(as, true, "\xd3", 1, n, dst);
+    return;
+  }
+
+  if (!strncmp(mn, "set", 3) && (n = cond_code(mn + 3)) >= 0) {
+    // 0F 90+cc /0: SETcc r/m8
+    expect(nops == 1 && src->kind == OP_REG && src->size == 1);
+    char opcode[] = {0x0f, 0x90 + n};
+    op_rm(as, false, opcode, 2, 0, src);
+    return;
+  }
+
+  if (!strcmp(mn, "jmp")) {
+    // E9 cd: JMP rel32
+    expect(nops == 1 && src->kind == OP_SYM);
+    byte(as, 0xe9);
+    rel32(as, src);
+    return;
+  }
+
+  if (mn[0] == 'j' && (n = cond_code(mn + 1)) >= 0) {
+    // 0F 80+cc cd: Jcc rel32
+    expect(nops == 1 && src->kind == OP_SYM);
+    byte(as, 0x0f);
+    byte(as, 0x80 + n);
+    rel32(as, src);
+    return;
+  }
+
+  if (!strcmp(mn, "call")) {
+    // E8 cd: CALL rel32
+    expect(nops == 1 && src->kind == OP_SYM);
+    byte(as, 0xe8);
+    rel32(as, src);
+    return;
+  }
+
+  asm_error("unknown instruction");
+}
+
+static void define_label(Asm *as, char *name, int len) {
+  if (hashmap_get2(&as->labels, name, len))
+    asm_error("symbol already defined");
+  hashmap_put2(&as->labels, name, len, (void *)(intptr_t)(as->code->len + 1));
+}
+
+static void assemble_line(Asm *as, char *p, char *end) {
+  line_start = p;
+  line_len = end - p;
+
+  p = skip_blank(p);
+  if (p == end)
+    return;
+
+  // Directive
+  if (*p == '.' && end[-1] != ':') {
+    char *start = p;
+    while (isalnum(*p) || *p == '.' || *p == '_')
+      p++;
+
+    if (word_eq(start, p - start, ".globl") || word_eq(start, p - start, ".global")) {
+      Operand sym = parse_operand(&p, p);
+      if (sym.kind != OP_SYM)
+        asm_error("bad symbol name");
+      add_sym(as, sym.sym, sym.len);
+      return;
+    }
+    if (word_eq(start, p - start, ".text"))
+      return;
+    asm_error("unknown directive");
+  }
+
+  // Label
+  if (end[-1] == ':') {
+    define_label(as, p, end - 1 - p);
+    return;
+  }
+
+  // Instruction
+  char mn[16];
+  char *start = p;
+  while (isalnum(*p))
+    p++;
+  if (p - start >= sizeof(mn))
+    asm_error("unknown instruction");
+  memcpy(mn, start, p - start);
+  mn[p - start] = '\0';
+
+  // An instruction with no register operand, such as "movq $1,
+  // -8(%rbp)", needs a suffix to give its operand size. Everything we
+  // encode is 64 bits wide, so the 'q' suffix is just dropped.
+  int len = p - start;
+  if (len > 1 && mn[len - 1] == 'q' && strcmp(mn, "movzbq"))
+    mn[len - 1] = '\0';
+
+  Operand ops[3];
+  int nops = 0;
+  p = skip_blank(p);
+  while (p < end) {
+    if (nops == 3)
+      asm_error("too many operands");
+    ops[nops++] = parse_operand(&p, p);
+    p = skip_blank(p);
+    if (p < end && *p++ != ',')
+      asm_error("expected ','");
+  }
+
+  encode(as, mn, ops, nops);
+}
+
+// Encodes `len` bytes of assembly text into `obj`.
+void assemble(char *text, size_t len, ObjCode *obj) {
+  Asm as = {.obj = obj, .code = &obj->code};
+
+  for (char *p = text; p < text + len;) {
+    char *end = memchr(p, '\n', text + len - p);
+    if (!end)
+      end = text + len;
+    assemble_line(&as, p, end);
+    p = end + 1;
+  }
+
+  // Symbols declared with .globl, in the order they appear, are
+  // defined if there is a label with the same name. Codegen emits
+  // functions in order, so a function extends up to the next one.
+  for (int i = 0; i < obj->nsyms; i++) {
+    ObjSym *sym = &obj->syms[i];
+    intptr_t off = (intptr_t)hashmap_get2(&as.labels, sym->name, strlen(sym->name));
+    if (off) {
+      sym->defined = true;
+      sym->offset = off - 1;
+    }
+  }
+
+  ObjSym *prev = NULL;
+  for (int i = 0; i < obj->nsyms; i++) {
+    if (!obj->syms[i].defined)
+      continue;
+    if (prev)
+      prev->size = obj->syms[i].offset - prev->offset;
+    prev = &obj->syms[i];
+  }
+  if (prev)
+    prev->size = obj->code.len - prev->offset;
+
+  // Resolve references. A rel32 is relative to the end of the
+  // instruction, which is where the 4-byte field ends in all of the
+  // instructions we emit.
+  for (int i = 0; i < as.nfixups; i++) {
+    Fixup *fx = &as.fixups[i];
+    intptr_t off = (intptr_t)hashmap_get2(&as.labels, fx->name, fx->len);
+
+    if (off) {
+      int32_t rel = (off - 1) - (fx->offset + 4);
+      memcpy(obj->code.data + fx->offset, &rel, 4);
+      continue;
+    }
+
+    if (fx->name[0] == '.')
+      error("internal assembler: undefined label: %.*s", fx->len, fx->name);
+
+    // An external symbol. The linker fills it in as S + A - P, where P
+    // is the address of the field, hence the addend of -4.
+    int sym = add_sym(&as, fx->name, fx->len);
+    add_reloc(obj, fx->offset, sym, -4);
+  }
+
+  hashmap_clear(&as.labels);
+  hashmap_clear(&as.syms);
+  free(as.fixups);
+}
+
+void obj_free(ObjCode *obj) {
+  buf_free(&obj->code);
+  for (int i = 0; i < obj->nsyms; i++)
+    free(obj->syms[i].name);
+  free(obj->syms);
+  free(obj->relocs);
+  *obj = (ObjCode){};
+}
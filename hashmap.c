@@ -0,0 +1,129 @@
+// This is an implementation of the open-addressing hash table with
+// linear probing, keyed by strings. On top of it we build a string
+// interning pool, so that all occurrences of the same identifier
+// share one pointer and can be compared with `==`.
+
+#include "chibicc.h"
+
+// Initial hash bucket size
+#define INIT_SIZE 16
+
+// Rehash if the usage exceeds 70%.
+#define HIGH_WATERMARK 70
+
+// FNV hash
+static uint64_t fnv_hash(char *s, int len) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (int i = 0; i < len; i++) {
+    hash *= 0x100000001b3;
+    hash ^= (unsigned char)s[i];
+  }
+  return hash;
+}
+
+// Make room for new entries in a given hashmap.
+static void rehash(HashMap *map) {
+  int cap = map->capacity;
+  while ((map->used * 100) / cap >= HIGH_WATERMARK / 2)
+    cap = cap * 2;
+
+  // Create a new hashmap and copy all key-values.
+  HashMap map2 = {};
+  map2.buckets = calloc(cap, sizeof(HashEntry));
+  map2.capacity = cap;
+
+  for (int i = 0; i < map->capacity; i++) {
+    HashEntry *ent = &map->buckets[i];
+    if (ent->key)
+      hashmap_put2(&map2, ent->key, ent->keylen, ent->val);
+  }
+
+  free(map->buckets);
+  *map = map2;
+}
+
+static bool match(HashEntry *ent, char *key, int keylen) {
+  return ent->keylen == keylen && !memcmp(ent->key, key, keylen);
+}
+
+static HashEntry *get_entry(HashMap *map, char *key, int keylen) {
+  if (!map->buckets)
+    return NULL;
+
+  uint64_t hash = fnv_hash(key, keylen);
+
+  for (int i = 0; i < map->capacity; i++) {
+    HashEntry *ent = &map->buckets[(hash + i) % map->capacity];
+    if (!ent->key)
+      return NULL;
+    if (match(ent, key, keylen))
+      return ent;
+  }
+  unreachable();
+}
+
+static HashEntry *get_or_insert_entry(HashMap *map, char *key, int keylen) {
+  if (!map->buckets) {
+    map->buckets = calloc(INIT_SIZE, sizeof(HashEntry));
+    map->capacity = INIT_SIZE;
+  } else if ((map->used * 100) / map->capacity >= HIGH_WATERMARK) {
+    rehash(map);
+  }
+
+  uint64_t hash = fnv_hash(key, keylen);
+
+  for (int i = 0; i < map->capacity; i++) {
+    HashEntry *ent = &map->buckets[(hash + i) % map->capacity];
+
+    if (!ent->key) {
+      ent->key = key;
+      ent->keylen = keylen;
+      map->used++;
+      return ent;
+    }
+
+    if (match(ent, key, keylen))
+      return ent;
+  }
+  unreachable();
+}
+
+void *hashmap_get2(HashMap *map, char *key, int keylen) {
+  HashEntry *ent = get_entry(map, key, keylen);
+  return ent ? ent->val : NULL;
+}
+
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val) {
+  HashEntry *ent = get_or_insert_entry(map, key, keylen);
+  ent->val = val;
+}
+
+// Frees the buckets of a given hashmap. Keys and values are owned by
+// the caller.
+void hashmap_clear(HashMap *map) {
+  free(map->buckets);
+  *map = (HashMap){};
+}
+
+// All interned strings of the current thread's compilation.
+static _Thread_local HashMap strings;
+
+// Returns the canonical NUL-terminated copy of the first `len` bytes of
+// `s`. Interning the same character sequence twice returns the same
+// pointer.
+char *intern(char *s, int len) {
+  HashEntry *ent = get_or_insert_entry(&strings, s, len);
+  if (!ent->val) {
+    char *str = arena_alloc(&parse_arena, MEM_STRING, len + 1);
+    memcpy(str, s, len);
+    // Make the entry refer to our copy rather than to the input buffer.
+    ent->key = ent->val = str;
+  }
+  return ent->val;
+}
+
+// Forgets all interned strings. Their storage belongs to the parser's
+// arena and is released together with it.
+void intern_reset(void) {
+  hashmap_clear(&strings);
+}
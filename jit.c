@@ -0,0 +1,121 @@
+// This file runs the output of the built-in assembler in the current
+// process, without writing an object file or invoking a linker.
+//
+// The code is copied into a fresh anonymous mapping. Calls between
+// functions of the unit were already resolved by the assembler, so only
+// the relocations against undefined symbols are left. Those symbols
+// are looked up with dlsym(3) in the global symbol table of the
+// process. Their addresses may be anywhere in the 64-bit address space,
+// out of reach of a call's rel32, so each one gets a small stub right
+// after the code which jumps to the absolute address:
+//
+//   movabs $addr, %rax
+//   jmp *%rax
+//
+// %rax is free to clobber at a call: it is a caller-saved register
+// which holds no argument.
+
+#include "chibicc.h"
+#include <dlfcn.h>
+#include <pthread.h>
+
+// Size of one stub, rounded up from 12 bytes.
+#define STUB_SIZE 16
+
+static void *self;
+
+static void open_self(void) {
+  // void *dlopen(const char *filename, int flags);
+  // If filename is NULL, then the returned handle is for the main program. When given to
+  // dlsym(), this handle causes a search for a symbol in the main program, followed by all shared
+  // objects loaded at program startup, and then all shared objects loaded by dlopen() with the
+  // flag RTLD_GLOBAL.
+  self = dlopen(NULL, RTLD_LAZY);
+}
+
+static void *lookup(char *name) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, open_self);
+
+  // void *dlsym(void *restrict handle, const char *restrict symbol);
+  // The function dlsym() takes a "handle" of a dynamic loaded shared object returned by dlopen()
+  // along with a null-terminated symbol name, and returns the address where that symbol is
+  // loaded into memory.
+  return self ? dlsym(self, name) : NULL;
+}
+
+// Loads `obj` into memory, calls its main() and returns the value main
+// returned.
+int jit_run(ObjCode *obj) {
+  // Look up external symbols first, so that an error doesn't leave a
+  // mapping behind.
+  void **addrs = calloc(obj->nsyms, sizeof(void *));
+  for (int i = 0; i < obj->nsyms; i++) {
+    if (obj->syms[i].defined)
+      continue;
+    addrs[i] = lookup(obj->syms[i].name);
+    if (!addrs[i]) {
+      free(addrs);
+      error("undefined symbol: %s", obj->syms[i].name);
+    }
+  }
+
+  int (*main_fn)(void) = NULL;
+  size_t code_size = (obj->code.len + STUB_SIZE - 1) / STUB_SIZE * STUB_SIZE;
+  size_t size = code_size + obj->nsyms * STUB_SIZE;
+
+  // void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+  // The mapping is writable for now and made executable below, so it
+  // is never writable and executable at the same time.
+  char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    error("mmap failed: %s", strerror(errno));
+
+  memcpy(mem, obj->code.data, obj->code.len);
+
+  // Build a stub for every symbol that is referenced but not defined.
+  for (int i = 0; i < obj->nsyms; i++) {
+    ObjSym *sym = &obj->syms[i];
+    if (sym->defined) {
+      if (!strcmp(sym->name, "main"))
+        main_fn = (int (*)(void))(mem + sym->offset);
+      continue;
+    }
+
+    uint64_t addr = (uintptr_t)addrs[i];
+    char *stub = mem + code_size + i * STUB_SIZE;
+    stub[0] = 0x48; // REX.W
+    stub[1] = 0xb8; // movabs $imm64, %rax
+    memcpy(stub + 2, &addr, 8);
+    stub[10] = 0xff; // jmp *%rax
+    stub[11] = 0xe0;
+  }
+
+  free(addrs);
+
+  if (!main_fn) {
+    munmap(mem, size);
+    error("main is not defined");
+  }
+
+  // Apply relocations the way the linker would for R_X86_64_PLT32,
+  // i.e. L + A - P where L is the address of the stub.
+  for (int i = 0; i < obj->nrelocs; i++) {
+    ObjReloc *r = &obj->relocs[i];
+    char *stub = mem + code_size + r->sym * STUB_SIZE;
+    int32_t rel = stub + r->addend - (mem + r->offset);
+    memcpy(mem + r->offset, &rel, 4);
+  }
+
+  // int mprotect(void *addr, size_t len, int prot);
+  // mprotect() changes the access protections for the calling process's memory pages containing
+  // any part of the address range in the interval [addr, addr+len-1].
+  if (mprotect(mem, size, PROT_READ | PROT_EXEC)) {
+    munmap(mem, size);
+    error("mprotect failed: %s", strerror(errno));
+  }
+
+  int ret = main_fn();
+  munmap(mem, size);
+  return ret;
+}
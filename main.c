@@ -1,14 +1,366 @@
 #include "chibicc.h"
 
+// Output files given with -o. The n-th one is the output of the n-th
+// input file.
+static char **opt_o;
+static int num_opt_o;
+
+// If true, assembly is only counted, not written
+static bool opt_count_bytes;
+
+// If true, emit an object file instead of assembly
+static bool opt_c;
+
+// If true, run the program in this process instead of emitting it
+static bool opt_run;
+
+// If true, the input is a manifest of programs to run and check
+static bool opt_batch;
+
+// If true, print the -ftime-report report as JSON
+static bool opt_time_report_json;
+
+// If true, print memory usage to stderr
+static bool opt_mem_report;
+
+// Number of threads to use
+static int opt_jobs;
+
+// If set, serve compile requests on this socket
+static char *opt_serve;
+
+// If set, compile on the server listening on this socket
+static char *opt_connect;
+
+// Input files, in the order given
+static char **input_paths;
+static int num_inputs;
+
+static void usage(int status) {
+  fprintf(stderr, "chibicc [ -c | --run | --batch ] [ -o <path> ]... [ -j <threads> ] [ --count-bytes ] [ -ftime-report[=json] ] [ -fmem-report ] [ --cache <dir> [ --cache-size <MiB> ] ] [ --connect <socket> ] <file>...\n"
+                  "chibicc --serve <socket> [ -j <threads> ] [ --cache <dir> [ --cache-size <MiB> ] ]\n");
+  exit(status);
+}
+
+static void push(char ***arr, int *len, char *s) {
+  *arr = realloc(*arr, sizeof(char *) * (*len + 1));
+  (*arr)[(*len)++] = s;
+}
+
+static void parse_args(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--help"))
+      usage(0);
+
+    if (!strcmp(argv[i], "-o")) {
+      if (!argv[++i])
+        usage(1);
+      push(&opt_o, &num_opt_o, argv[i]);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-o", 2)) {
+      push(&opt_o, &num_opt_o, argv[i] + 2);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-c")) {
+      opt_c = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--run")) {
+      opt_run = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--batch")) {
+      opt_batch = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-S")) {
+      opt_c = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-j")) {
+      if (!argv[++i])
+        usage(1);
+      opt_jobs = atoi(argv[i]);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-j", 2)) {
+      opt_jobs = atoi(argv[i] + 2);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-ftime-report")) {
+      time_report = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-ftime-report=json")) {
+      time_report = true;
+      opt_time_report_json = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fmem-report")) {
+      opt_mem_report = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--cache")) {
+      if (!argv[++i])
+        usage(1);
+      cache_dir = argv[i];
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--cache-size")) {
+      if (!argv[++i])
+        usage(1);
+      cache_max_size = strtoul(argv[i], NULL, 10) << 20;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--serve")) {
+      if (!argv[++i])
+        usage(1);
+      opt_serve = argv[i];
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--connect")) {
+      if (!argv[++i])
+        usage(1);
+      opt_connect = argv[i];
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--count-bytes")) {
+      opt_count_bytes = true;
+      continue;
+    }
+
+    // "-" alone means stdin.
+    if (argv[i][0] == '-' && argv[i][1] != '\0')
+      error("unknown argument: %s", argv[i]);
+
+    push(&input_paths, &num_inputs, argv[i]);
+  }
+
+  if (!num_inputs && !opt_serve)
+    error("no input files");
+  if (num_opt_o > num_inputs && !opt_serve)
+    error("more -o options than input files");
+  if (num_inputs > 1 && (opt_run || opt_batch || opt_mem_report))
+    error("--run, --batch and -fmem-report take a single input file");
+
+  if (opt_jobs <= 0)
+    opt_jobs = num_cpus();
+}
+
+// With several input files, each file is a translation unit of its
+// own, compiled from start to end on one thread like a batch unit.
+// Files are handed out to opt_jobs threads with parallel_for(), so a
+// single invocation keeps all CPUs busy. Only one unit per thread is
+// in memory at a time: its input is unmapped and its arenas are reset
+// before the thread takes the next file.
+//
+// An error only fails the file it occurs in. The other files are still
+// compiled, and the exit status is 1 if any of them failed.
+typedef struct {
+  char *input_path;
+  char *output_path;
+  char *input;
+  bool compiled;
+  size_t size;
+  Counters counters;
+} Unit;
+
+// Returns the output path for an input file that has no -o: the file
+// name without its directory and with the extension replaced by ".s",
+// or ".o" with -c, in the current directory, as cc does.
+static char *default_output(char *input_path) {
+  if (!strcmp(input_path, "-"))
+    return "-";
+
+  char *base = strrchr(input_path, '/');
+  base = base ? base + 1 : input_path;
+  char *dot = strrchr(base, '.');
+  int len = dot ? dot - base : strlen(base);
+
+  char *path = malloc(len + 3);
+  snprintf(path, len + 3, "%.*s.%c", len, base, opt_c ? 'o' : 's');
+  return path;
+}
+
+static void compile_unit(Unit *u) {
+  timer_start(T_READ);
+  u->input = read_file(u->input_path);
+  timer_stop(T_READ);
+
+  timer_start(T_TOKENIZE);
+  Token *tok = tokenize_string(u->input_path, u->input);
+  timer_stop(T_TOKENIZE);
+
+  timer_start(T_PARSE);
+  Function *prog = parse(tok);
+  timer_stop(T_PARSE);
+
+  open_output(u->output_path, opt_count_bytes, opt_c);
+  timer_start(T_CODEGEN);
+  codegen(prog, 1);
+  timer_stop(T_CODEGEN);
+
+  timer_start(T_OUTPUT);
+  u->size = close_output();
+  timer_stop(T_OUTPUT);
+  u->compiled = true;
+}
+
+static void compile_job(void *arg, int i) {
+  Unit *u = (Unit *)arg + i;
+  counters = (Counters){};
+
+  jmp_buf env;
+  if (setjmp(env) == 0) {
+    error_jmp = &env;
+    compile_unit(u);
+  }
+  error_jmp = NULL;
+
+  if (!u->compiled)
+    discard_output();
+  if (u->input)
+    free_file(u->input);
+  reset_unit();
+  u->counters = counters;
+}
+
+static void add_counters(Counters *c) {
+  counters.tokens += c->tokens;
+  counters.nodes += c->nodes;
+  counters.functions += c->functions;
+  counters.instructions += c->instructions;
+  counters.constants_folded += c->constants_folded;
+  counters.exprs_simplified += c->exprs_simplified;
+  counters.branches_folded += c->branches_folded;
+  counters.cache_hits += c->cache_hits;
+  counters.cache_misses += c->cache_misses;
+  counters.cache_evictions += c->cache_evictions;
+}
+
+// Compiles every input file into its own output file.
+static int compile_files(void) {
+  Unit *units = calloc(num_inputs, sizeof(Unit));
+  for (int i = 0; i < num_inputs; i++) {
+    units[i].input_path = input_paths[i];
+    units[i].output_path = (i < num_opt_o) ? opt_o[i] : default_output(input_paths[i]);
+  }
+
+  parallel_for(num_inputs, opt_jobs, compile_job, units);
+
+  // The calling thread compiles units too, and its counters still hold
+  // the last one's, which is already in `units`.
+  counters = (Counters){};
+  int status = 0;
+  size_t size = 0;
+  for (int i = 0; i < num_inputs; i++) {
+    if (!units[i].compiled)
+      status = 1;
+    size += units[i].size;
+    add_counters(&units[i].counters);
+  }
+  free(units);
+
+  counters.output_bytes = size;
+  if (opt_count_bytes)
+    printf("%zu\n", size);
+  if (time_report)
+    print_time_report(opt_time_report_json);
+  return status;
+}
+
 int main(int argc, char **argv) {
-  if (argc != 2)
-    error("%s: invalid number of arguments", argv[0]);
+  parse_args(argc, argv);
+
+  if (opt_serve)
+    return run_server(opt_serve, opt_jobs);
+
+  if (num_inputs > 1)
+    return compile_files();
+
+  char *input_path = input_paths[0];
+  char *output_path = num_opt_o ? opt_o[0] : "-";
 
-  Token *tok = tokenize(argv[1]);
+  if (opt_batch)
+    return run_batch(input_path, opt_jobs);
+
+  // Let the server compile, if there is one. The reports and --run are
+  // about this process, so they still compile here.
+  if (opt_connect && !opt_run && !time_report && !opt_mem_report) {
+    int status = run_client(opt_connect, input_path, output_path, opt_c, opt_count_bytes);
+    if (status != -1)
+      return status;
+  }
+
+  // "-" reads the program from stdin.
+  timer_start(T_READ);
+  char *input = read_file(input_path);
+  timer_stop(T_READ);
+
+  timer_start(T_TOKENIZE);
+  Token *tok = tokenize_string(input_path, input);
+  timer_stop(T_TOKENIZE);
+
+  timer_start(T_PARSE);
   Function *prog = parse(tok);
+  timer_stop(T_PARSE);
+
+  // Compile to memory and run main(). Its return value becomes our
+  // exit status, as if the program had been run on its own.
+  if (opt_run) {
+    open_output("-", true, true);
+    timer_start(T_CODEGEN);
+    codegen(prog, opt_jobs);
+    timer_stop(T_CODEGEN);
+
+    timer_start(T_OUTPUT);
+    ObjCode obj = {};
+    assemble_output(&obj);
+    timer_stop(T_OUTPUT);
+
+    timer_start(T_RUN);
+    int ret = jit_run(&obj);
+    timer_stop(T_RUN);
+
+    if (time_report)
+      print_time_report(opt_time_report_json);
+    if (opt_mem_report)
+      print_mem_report(prog);
+    return ret;
+  }
 
   // Traverse the AST to emit assembly.
-  codegen(prog);
+  open_output(output_path, opt_count_bytes, opt_c);
+  timer_start(T_CODEGEN);
+  codegen(prog, opt_jobs);
+  timer_stop(T_CODEGEN);
+
+  timer_start(T_OUTPUT);
+  size_t size = close_output();
+  timer_stop(T_OUTPUT);
+  counters.output_bytes = size;
 
+  if (opt_count_bytes)
+    printf("%zu\n", size);
+  if (time_report)
+    print_time_report(opt_time_report_json);
+  if (opt_mem_report)
+    print_mem_report(prog);
   return 0;
 }
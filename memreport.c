@@ -0,0 +1,171 @@
+// This file implements -fmem-report, which reports how much memory a
+// translation unit took: allocations and bytes by kind of object, what
+// the arenas reserved for them, the peak resident set size of the
+// process, and how densely each kind of AST node fills its bytes.
+//
+// Allocations are counted by arena_alloc() and alloc_node() all the
+// time; it is just two increments. Node fill is measured by walking
+// the AST once when the report is printed.
+
+#include "chibicc.h"
+#include <sys/resource.h>
+
+static char *mem_kind_names[NUM_MEM_KINDS] = {
+  [MEM_TOKEN] = "Token",
+  [MEM_NODE] = "Node",
+  [MEM_TYPE] = "Type",
+  [MEM_OBJ] = "Obj",
+  [MEM_FUNCTION] = "Function",
+  [MEM_STRING] = "interned strings",
+};
+
+static char *node_kind_names[] = {
+  [ND_ADD] = "ND_ADD",
+  [ND_SUB] = "ND_SUB",
+  [ND_MUL] = "ND_MUL",
+  [ND_DIV] = "ND_DIV",
+  [ND_NEG] = "ND_NEG",
+  [ND_EQ] = "ND_EQ",
+  [ND_NE] = "ND_NE",
+  [ND_LT] = "ND_LT",
+  [ND_LE] = "ND_LE",
+  [ND_ASSIGN] = "ND_ASSIGN",
+  [ND_ADDR] = "ND_ADDR",
+  [ND_DEREF] = "ND_DEREF",
+  [ND_RETURN] = "ND_RETURN",
+  [ND_IF] = "ND_IF",
+  [ND_FOR] = "ND_FOR",
+  [ND_BLOCK] = "ND_BLOCK",
+  [ND_FUNCALL] = "ND_FUNCALL",
+  [ND_EXPR_STMT] = "ND_EXPR_STMT",
+  [ND_VAR] = "ND_VAR",
+  [ND_NUM] = "ND_NUM",
+};
+
+#define NUM_NODE_KINDS (sizeof(node_kind_names) / sizeof(*node_kind_names))
+
+// Nodes and the bytes of them that hold a value, by kind
+typedef struct {
+  long count[NUM_NODE_KINDS];
+  long used[NUM_NODE_KINDS];
+} NodeFill;
+
+// Returns the size of a field if it is set. `kind` and a number's `val`
+// always hold a value, even if it is 0.
+#define FIELD(node, f) ((node)->f ? sizeof((node)->f) : 0)
+
+// Returns how many bytes of `node` hold a value: the fields common to
+// all nodes, plus those of its kind's member of the union.
+static long used_bytes(Node *node) {
+  long n = sizeof(node->kind) + FIELD(node, next) + FIELD(node, ty) + FIELD(node, tok);
+
+  switch (node->kind) {
+  case ND_IF:
+    return n + FIELD(node, cond) + FIELD(node, then) + FIELD(node, els);
+  case ND_FOR:
+    return n + FIELD(node, init) + FIELD(node, cond) + FIELD(node, inc) + FIELD(node, then);
+  case ND_BLOCK:
+    return n + FIELD(node, body);
+  case ND_FUNCALL:
+    return n + FIELD(node, funcname) + FIELD(node, args);
+  case ND_VAR:
+    return n + FIELD(node, var);
+  case ND_NUM:
+    return n + sizeof(node->val);
+  default:
+    return n + FIELD(node, lhs) + FIELD(node, rhs);
+  }
+}
+
+// Measures the fill of the nodes of a tree.
+static void count_node(NodeFill *fill, Node *node) {
+  if (!node)
+    return;
+  fill->count[node->kind]++;
+  fill->used[node->kind] += used_bytes(node);
+
+  switch (node->kind) {
+  case ND_IF:
+    count_node(fill, node_cond(node));
+    count_node(fill, node_then(node));
+    count_node(fill, node_els(node));
+    return;
+  case ND_FOR:
+    count_node(fill, node_init(node));
+    count_node(fill, node_cond(node));
+    count_node(fill, node_inc(node));
+    count_node(fill, node_then(node));
+    return;
+  case ND_BLOCK:
+    for (Node *n = node_body(node); n; n = node_next(n))
+      count_node(fill, n);
+    return;
+  case ND_FUNCALL:
+    for (Node *n = node_args(node); n; n = node_next(n))
+      count_node(fill, n);
+    return;
+  case ND_VAR:
+  case ND_NUM:
+    return;
+  default:
+    count_node(fill, node_lhs(node));
+    count_node(fill, node_rhs(node));
+  }
+}
+
+// Returns the peak resident set size of the process in bytes.
+static long peak_rss(void) {
+  // int getrusage(int who, struct rusage *usage);
+  // ru_maxrss: This is the maximum resident set size used (in kilobytes).
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru))
+    return 0;
+  return ru.ru_maxrss * 1024L;
+}
+
+// Prints the report for `prog` to stderr.
+void print_mem_report(Function *prog) {
+  long count = 0;
+  size_t bytes = 0;
+
+  fprintf(stderr, "%-20s %12s %14s %10s\n", "kind", "count", "bytes", "size");
+  for (int i = 0; i < NUM_MEM_KINDS; i++) {
+    MemStat *s = &mem_stats[i];
+    fprintf(stderr, "%-20s %12ld %14zu %10.1f\n", mem_kind_names[i], s->count, s->bytes,
+            s->count ? (double)s->bytes / s->count : 0);
+    count += s->count;
+    bytes += s->bytes;
+  }
+  fprintf(stderr, "%-20s %12ld %14zu\n", "total", count, bytes);
+
+  fprintf(stderr, "\n%-20s %14s %14s\n", "arena", "peak", "reserved");
+  fprintf(stderr, "%-20s %14zu %14zu\n", "token array", tokens.len * sizeof(Token),
+          tokens.cap * sizeof(Token));
+  fprintf(stderr, "%-20s %14zu %14zu\n", "parse", arena_peak(&parse_arena),
+          parse_arena.reserved);
+  fprintf(stderr, "%-20s %14zu %14zu\n", "type", arena_peak(&type_arena), type_arena.reserved);
+  fprintf(stderr, "%-20s %14zu %14s\n", "node pool", nodes_used(), "-");
+  fprintf(stderr, "\n%-20s %14ld\n", "peak RSS", peak_rss());
+
+  // Node fill: how many of the bytes of the nodes reachable from the
+  // functions hold a value, by kind and on average over all nodes.
+  NodeFill fill = {};
+  for (Function *fn = prog; fn; fn = fn->next)
+    count_node(&fill, fn->body);
+
+  long nodes = 0, used = 0;
+  for (int i = 0; i < NUM_NODE_KINDS; i++) {
+    nodes += fill.count[i];
+    used += fill.used[i];
+  }
+
+  fprintf(stderr, "\nNode: %zu bytes, %.1f used on average (%.1f%%)\n", sizeof(Node),
+          nodes ? (double)used / nodes : 0,
+          nodes ? used * 100.0 / (nodes * sizeof(Node)) : 0);
+  fprintf(stderr, "  %-18s %12s %10s %7s\n", "kind", "count", "used", "fill");
+  for (int i = 0; i < NUM_NODE_KINDS; i++)
+    if (fill.count[i])
+      fprintf(stderr, "  %-18s %12ld %10.1f %6.1f%%\n", node_kind_names[i], fill.count[i],
+              (double)fill.used[i] / fill.count[i],
+              fill.used[i] * 100.0 / (fill.count[i] * sizeof(Node)));
+}
@@ -0,0 +1,422 @@
+// This file implements the optimizer, which simplifies the AST of a
+// function right after it has been parsed.
+//
+// The parser builds nodes exactly as written, so code generation pays
+// at run time for arithmetic whose result is known at compile time.
+// Pointer arithmetic is the main source of it: `x[1]` becomes
+// *(x + 1 * 8), because new_add() scales the index by the element size
+// with an ND_MUL node.
+//
+// The optimizer walks each tree once, bottom up, and rewrites nodes in
+// place:
+//
+//  - An operator whose operands are all numbers becomes a number.
+//  - Identities are removed: x+0, x*1, x/1, -(-x), x-x and x*0.
+//  - Constant terms of a sum are moved to its outermost node, so that
+//    p + (i + 1) * 8 becomes (p + i * 8) + 8. The code generator folds
+//    a constant added to an address into the displacement of the load
+//    or store.
+//  - An "if" or loop whose condition is a number loses the code that
+//    can't run.
+//
+// Values are int in our language, and the generated code computes in
+// 64 bits. ND_NUM holds 32 bits, so a result is folded only if it
+// fits. Rewriting a sum is safe because 64-bit addition and
+// multiplication wrap around, so they are associative and
+// distributive. C leaves the order in which operands are evaluated
+// unspecified, so the operands of a sum may be regrouped.
+//
+// Nodes are never allocated here. A node is replaced by copying
+// another one over it, which keeps the `next` link that puts it in a
+// statement list or an argument list.
+
+#include "chibicc.h"
+
+static bool fits_int(long val) {
+  return val == (int)val;
+}
+
+static void replace(Node *node, Node *with) {
+  NodeId next = node->next;
+  *node = *with;
+  node->next = next;
+}
+
+static void make_num(Node *node, long val) {
+  node->kind = ND_NUM;
+  node->val = val;
+  node->ty = ty_int;
+}
+
+static bool is_num(Node *node, long val) {
+  return node->kind == ND_NUM && node->val == val;
+}
+
+// Returns true if evaluating `node` has no side effects.
+static bool is_pure(Node *node) {
+  switch (node->kind) {
+  case ND_NUM:
+  case ND_VAR:
+    return true;
+  case ND_NEG:
+  case ND_DEREF:
+  case ND_ADDR:
+    return is_pure(node_lhs(node));
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    return is_pure(node_lhs(node)) && is_pure(node_rhs(node));
+  default:
+    // Calls and assignments have side effects, and a division may
+    // trap.
+    return false;
+  }
+}
+
+// Returns true if `a` and `b` are the same pure expression.
+static bool same_expr(Node *a, Node *b) {
+  if (a->kind != b->kind)
+    return false;
+
+  switch (a->kind) {
+  case ND_NUM:
+    return a->val == b->val;
+  case ND_VAR:
+    return a->var == b->var;
+  case ND_NEG:
+  case ND_DEREF:
+  case ND_ADDR:
+    return same_expr(node_lhs(a), node_lhs(b));
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    return same_expr(node_lhs(a), node_lhs(b)) && same_expr(node_rhs(a), node_rhs(b));
+  default:
+    return false;
+  }
+}
+
+// Computes `x op y` into `val`. Returns false if it can't be done at
+// compile time.
+static bool eval(NodeKind kind, long x, long y, long *val) {
+  switch (kind) {
+  case ND_ADD:
+    *val = x + y;
+    return true;
+  case ND_SUB:
+    *val = x - y;
+    return true;
+  case ND_MUL:
+    *val = x * y;
+    return true;
+  case ND_DIV:
+    if (y == 0)
+      return false;
+    *val = x / y;
+    return true;
+  case ND_EQ:
+    *val = x == y;
+    return true;
+  case ND_NE:
+    *val = x != y;
+    return true;
+  case ND_LT:
+    *val = x < y;
+    return true;
+  case ND_LE:
+    *val = x <= y;
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void simplify_neg(Node *node) {
+  Node *lhs = node_lhs(node);
+
+  if (lhs->kind == ND_NUM && fits_int(-(long)lhs->val)) {
+    make_num(node, -(long)lhs->val);
+    counters.constants_folded++;
+    return;
+  }
+
+  if (lhs->kind == ND_NEG) {
+    replace(node, node_lhs(lhs));
+    counters.exprs_simplified++;
+  }
+}
+
+static void simplify_binary(Node *node);
+
+// Moves a constant term of a sum out of its operands. The sum is
+// `node`, and constants are on the right of an ND_ADD by now. The
+// pointer of a pointer sum is on the left, so the regrouped inner sum
+// has the type of the outer one.
+static bool reassociate(Node *node) {
+  Node *lhs = node_lhs(node);
+  Node *rhs = node_rhs(node);
+
+  // (x + c1) + c2 => x + (c1 + c2)
+  if (lhs->kind == ND_ADD && node_rhs(lhs)->kind == ND_NUM && rhs->kind == ND_NUM) {
+    long val = (long)node_rhs(lhs)->val + rhs->val;
+    if (!fits_int(val))
+      return false;
+    node->lhs = lhs->lhs;
+    rhs->val = val;
+    return true;
+  }
+
+  // (x + c) + y => (x + y) + c
+  if (lhs->kind == ND_ADD && node_rhs(lhs)->kind == ND_NUM && rhs->kind != ND_NUM) {
+    NodeId c = lhs->rhs;
+    lhs->rhs = node->rhs;
+    lhs->ty = node->ty;
+    node->rhs = c;
+    simplify_binary(lhs);
+    return true;
+  }
+
+  // y + (x + c) => (y + x) + c
+  if (rhs->kind == ND_ADD && node_rhs(rhs)->kind == ND_NUM && lhs->kind != ND_NUM) {
+    NodeId c = rhs->rhs;
+    rhs->rhs = rhs->lhs;
+    rhs->lhs = node->lhs;
+    rhs->ty = node->ty;
+    node->lhs = node->rhs;
+    node->rhs = c;
+    simplify_binary(rhs);
+    return true;
+  }
+
+  return false;
+}
+
+static void simplify_binary(Node *node) {
+  Node *lhs = node_lhs(node);
+  Node *rhs = node_rhs(node);
+
+  if (lhs->kind == ND_NUM && rhs->kind == ND_NUM) {
+    long val;
+    if (eval(node->kind, lhs->val, rhs->val, &val) && fits_int(val)) {
+      make_num(node, val);
+      counters.constants_folded++;
+    }
+    return;
+  }
+
+  // Put a constant operand on the right, where it can become an
+  // immediate operand, and turn subtracting a constant into adding its
+  // negation, so that the rules below only need to look at ND_ADD.
+  if (lhs->kind == ND_NUM &&
+      (node->kind == ND_ADD || node->kind == ND_MUL || node->kind == ND_EQ ||
+       node->kind == ND_NE)) {
+    NodeId tmp = node->lhs;
+    node->lhs = node->rhs;
+    node->rhs = tmp;
+    lhs = node_lhs(node);
+    rhs = node_rhs(node);
+  }
+  if (node->kind == ND_SUB && rhs->kind == ND_NUM && fits_int(-(long)rhs->val)) {
+    node->kind = ND_ADD;
+    rhs->val = -rhs->val;
+  }
+
+  switch (node->kind) {
+  case ND_ADD:
+    // The regrouped sum may simplify further.
+    if (reassociate(node)) {
+      counters.exprs_simplified++;
+      simplify_binary(node);
+      return;
+    }
+
+    // x + 0 => x, unless the sum converts an array to a pointer
+    if (is_num(rhs, 0) && lhs->ty == node->ty) {
+      replace(node, lhs);
+      counters.exprs_simplified++;
+    }
+    return;
+  case ND_SUB:
+    // x - x => 0
+    if (is_pure(lhs) && same_expr(lhs, rhs)) {
+      make_num(node, 0);
+      counters.exprs_simplified++;
+    }
+    return;
+  case ND_MUL:
+    // x * 1 => x
+    if (is_num(rhs, 1)) {
+      replace(node, lhs);
+      counters.exprs_simplified++;
+      return;
+    }
+
+    // x * 0 => 0
+    if (is_num(rhs, 0) && is_pure(lhs)) {
+      make_num(node, 0);
+      counters.exprs_simplified++;
+      return;
+    }
+
+    if (rhs->kind != ND_NUM)
+      return;
+
+    // (x * c1) * c2 => x * (c1 * c2)
+    if (lhs->kind == ND_MUL && node_rhs(lhs)->kind == ND_NUM) {
+      long val = (long)node_rhs(lhs)->val * rhs->val;
+      if (fits_int(val)) {
+        node->lhs = lhs->lhs;
+        rhs->val = val;
+        counters.exprs_simplified++;
+      }
+      return;
+    }
+
+    // (x + c1) * c2 => x * c2 + c1 * c2, which lets the sum that an
+    // array index is part of absorb c1 * c2.
+    if (lhs->kind == ND_ADD && node_rhs(lhs)->kind == ND_NUM) {
+      Node *c1 = node_rhs(lhs);
+      long val = (long)c1->val * rhs->val;
+      if (fits_int(val)) {
+        lhs->kind = ND_MUL;
+        lhs->rhs = node->rhs;
+        c1->val = val;
+        node->kind = ND_ADD;
+        node->rhs = node_id(c1);
+        counters.exprs_simplified++;
+        simplify_binary(lhs);
+      }
+    }
+    return;
+  case ND_DIV:
+    // x / 1 => x
+    if (is_num(rhs, 1)) {
+      replace(node, lhs);
+      counters.exprs_simplified++;
+    }
+    return;
+  }
+}
+
+static void optimize_expr(Node *node);
+
+// Simplifies an operand of "=" or unary "&". It must stay an lvalue,
+// or remain the non-lvalue that codegen reports, so only the address
+// inside a dereference is touched.
+static void optimize_lvalue(Node *node) {
+  if (node->kind == ND_DEREF)
+    optimize_expr(node_lhs(node));
+}
+
+static void optimize_expr(Node *node) {
+  switch (node->kind) {
+  case ND_NUM:
+  case ND_VAR:
+    return;
+  case ND_FUNCALL:
+    for (Node *arg = node_args(node); arg; arg = node_next(arg))
+      optimize_expr(arg);
+    return;
+  case ND_ASSIGN:
+    optimize_lvalue(node_lhs(node));
+    optimize_expr(node_rhs(node));
+    return;
+  case ND_ADDR:
+    optimize_lvalue(node_lhs(node));
+    return;
+  case ND_DEREF:
+    optimize_expr(node_lhs(node));
+    return;
+  case ND_NEG:
+    optimize_expr(node_lhs(node));
+    simplify_neg(node);
+    return;
+  default:
+    optimize_expr(node_lhs(node));
+    optimize_expr(node_rhs(node));
+    simplify_binary(node);
+  }
+}
+
+// Turns a statement into an empty block.
+static void make_empty(Node *node) {
+  node->kind = ND_BLOCK;
+  node->body = 0;
+}
+
+static void optimize_stmt(Node *node) {
+  switch (node->kind) {
+  case ND_IF: {
+    Node *cond = node_cond(node);
+    optimize_expr(cond);
+
+    if (cond->kind == ND_NUM) {
+      Node *taken = cond->val ? node_then(node) : node_els(node);
+      if (taken) {
+        optimize_stmt(taken);
+        replace(node, taken);
+      } else {
+        make_empty(node);
+      }
+      counters.branches_folded++;
+      return;
+    }
+
+    optimize_stmt(node_then(node));
+    if (node_els(node))
+      optimize_stmt(node_els(node));
+    return;
+  }
+  case ND_FOR: {
+    if (node_init(node))
+      optimize_stmt(node_init(node));
+
+    Node *cond = node_cond(node);
+    if (cond) {
+      optimize_expr(cond);
+
+      // A loop that never runs leaves only its initialization behind,
+      // and one that runs until it returns needs no test.
+      if (cond->kind == ND_NUM) {
+        counters.branches_folded++;
+        if (!cond->val) {
+          if (node_init(node))
+            replace(node, node_init(node));
+          else
+            make_empty(node);
+          return;
+        }
+        node->cond = 0;
+      }
+    }
+
+    if (node_inc(node))
+      optimize_expr(node_inc(node));
+    optimize_stmt(node_then(node));
+    return;
+  }
+  case ND_BLOCK:
+    for (Node *n = node_body(node); n; n = node_next(n))
+      optimize_stmt(n);
+    return;
+  case ND_RETURN:
+  case ND_EXPR_STMT:
+    optimize_expr(node_lhs(node));
+    return;
+  }
+}
+
+// Simplifies the body of a function.
+void optimize(Function *fn) {
+  timer_start(T_OPTIMIZE);
+  optimize_stmt(fn->body);
+  timer_stop(T_OPTIMIZE);
+}
@@ -0,0 +1,73 @@
+// This file contains a minimal worker pool for running independent
+// jobs on several threads.
+//
+// parallel_for() runs fn(arg, 0) ... fn(arg, n-1) on up to `nthreads`
+// threads, including the calling one, and returns when all of them
+// have finished. Jobs are handed out one at a time from a shared
+// counter, so a few long jobs don't leave the other threads idle.
+// Callers that need ordered results store them by index.
+
+#include "chibicc.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct {
+  void (*fn)(void *arg, int i);
+  void *arg;
+  int n;
+  atomic_int next;
+} Work;
+
+static void *worker(void *p) {
+  Work *work = p;
+  for (;;) {
+    int i = atomic_fetch_add(&work->next, 1);
+    if (i >= work->n)
+      return NULL;
+    work->fn(work->arg, i);
+  }
+}
+
+// Returns the number of CPUs available to this process.
+int num_cpus(void) {
+  // _SC_NPROCESSORS_ONLN: The number of processors currently online (available).
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+void parallel_for(int n, int nthreads, void (*fn)(void *arg, int i), void *arg) {
+  if (nthreads > n)
+    nthreads = n;
+
+  Work work = {fn, arg, n};
+  atomic_init(&work.next, 0);
+
+  // Run on the calling thread alone if there is nothing to share.
+  if (nthreads <= 1) {
+    worker(&work);
+    return;
+  }
+
+  pthread_t *threads = calloc(nthreads - 1, sizeof(pthread_t));
+  int nstarted = 0;
+
+  // int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+  //                    void *(*start_routine)(void *), void *arg);
+  // The pthread_create() function starts a new thread in the calling process. The new thread
+  // starts execution by invoking start_routine(); arg is passed as the sole argument of
+  // start_routine().
+  //
+  // If a thread can't be created, the threads we have (at least the
+  // calling one) simply take over its share of the work.
+  while (nstarted < nthreads - 1 &&
+         pthread_create(&threads[nstarted], NULL, worker, &work) == 0)
+    nstarted++;
+
+  worker(&work);
+
+  // int pthread_join(pthread_t thread, void **retval);
+  // The pthread_join() function waits for the thread specified by thread to terminate.
+  for (int i = 0; i < nstarted; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+}
@@ -10,7 +10,8 @@
 // multiple return values, the remaining tokens are returned to the
 // caller via a pointer argument.
 //
-// Input tokens are represented by a linked list. Unlike many recursive
+// Input tokens are stored in one contiguous array of 16-byte records,
+// and the token after `tok` is `tok + 1`. Unlike many recursive
 // descent parsers, we don't have the notion of the "input token stream".
 // Most parsing functions don't change the global state of the parser.
 // So it is very easy to lookahead arbitrary number of tokens in this
@@ -20,10 +21,10 @@
 
 // All local variable instances created during parsing are
 // accumulated to this list.
-Obj *locals;
+static _Thread_local Obj *locals;
 
 static Type *declspec(Token **rest, Token *tok);
-static Type *declarator(Token **rest, Token *tok, Type *ty);
+static Type *declarator(Token **rest, Token *tok, Type *ty, Token **name, Obj **params);
 static Node *declaration(Token **rest, Token *tok);
 static Node *compound_stmt(Token **rest, Token *tok);
 static Node *stmt(Token **rest, Token *tok);
@@ -38,18 +39,205 @@ static Node *postfix(Token **rest, Token *tok);
 static Node *unary(Token **rest, Token *tok);
 static Node *primary(Token **rest, Token *tok);
 
+// Variables in scope are kept in an open-addressing hash table keyed
+// by interned names, so resolving an identifier is a hash of a pointer
+// and a few pointer comparisons no matter how many locals a function
+// has.
+//
+// A slot, once assigned to a name, keeps that name for the rest of the
+// compilation; a name that is not in scope has a NULL `var`. Declaring
+// a variable records the binding it shadows in `scope_log`, and leaving
+// a scope restores those bindings in reverse order. This way we never
+// delete from the table, which open addressing is bad at.
+typedef struct {
+  char *name;
+  Obj *var;
+} VarSlot;
+
+typedef struct {
+  char *name;
+  Obj *shadowed;
+} ScopeLog;
+
+static _Thread_local VarSlot *var_slots;
+static _Thread_local int var_capacity;
+static _Thread_local int var_used;
+
+static _Thread_local ScopeLog *scope_log;
+static _Thread_local int scope_log_len;
+static _Thread_local int scope_log_cap;
+
+static uint64_t hash_ptr(void *p) {
+  return ((uintptr_t)p >> 3) * 0x9e3779b97f4a7c15;
+}
+
+// Returns the slot of `name` in the table, which is either the one
+// holding it or the empty one where it would go.
+static VarSlot *find_slot(char *name) {
+  for (uint64_t i = hash_ptr(name);; i++) {
+    VarSlot *slot = &var_slots[i & (var_capacity - 1)];
+    if (slot->name == name || !slot->name)
+      return slot;
+  }
+}
+
+// Returns the slot of an interned name, creating it if needed.
+static VarSlot *var_slot(char *name) {
+  if (var_used * 2 >= var_capacity) {
+    VarSlot *old = var_slots;
+    int old_cap = var_capacity;
+
+    // The names are all distinct, so each one goes into an empty slot.
+    var_capacity = old_cap ? old_cap * 2 : 64;
+    var_slots = calloc(var_capacity, sizeof(VarSlot));
+    for (int i = 0; i < old_cap; i++)
+      if (old[i].name)
+        *find_slot(old[i].name) = old[i];
+    free(old);
+  }
+
+  VarSlot *slot = find_slot(name);
+  if (!slot->name) {
+    slot->name = name;
+    var_used++;
+  }
+  return slot;
+}
+
+// Makes `var` visible under its name until the current scope ends.
+static void declare_var(Obj *var) {
+  VarSlot *slot = var_slot(var->name);
+
+  if (scope_log_len == scope_log_cap) {
+    scope_log_cap = scope_log_cap ? scope_log_cap * 2 : 64;
+    scope_log = realloc(scope_log, scope_log_cap * sizeof(ScopeLog));
+  }
+  scope_log[scope_log_len++] = (ScopeLog){var->name, slot->var};
+  slot->var = var;
+}
+
+// A scope is identified by the length of the log when it was entered.
+static int enter_scope(void) {
+  return scope_log_len;
+}
+
+static void leave_scope(int scope) {
+  while (scope_log_len > scope) {
+    ScopeLog *log = &scope_log[--scope_log_len];
+    var_slot(log->name)->var = log->shadowed;
+  }
+}
+
+// Forgets all names and scopes. The table holds interned names, so it
+// must be emptied whenever the intern pool is. A compilation that was
+// abandoned after an error may also have left scopes open.
+void parse_reset(void) {
+  free(var_slots);
+  free(scope_log);
+  var_slots = NULL;
+  scope_log = NULL;
+  var_capacity = var_used = 0;
+  scope_log_len = scope_log_cap = 0;
+  locals = NULL;
+}
+
 // Find a local variable by name.
 static Obj *find_var(Token *tok) {
-  for (Obj *var = locals; var; var = var->next)
-    if (strlen(var->name) == tok->len && !strncmp(tok->loc, var->name, tok->len))
-      return var;
-  return NULL;
+  return var_slot(intern(token_loc(tok), tok->len))->var;
+}
+
+// Maximum number of nodes in a translation unit
+#define MAX_NODES (1 << 25)
+
+#define SLAB_NODES (1 << NODE_SLAB_SHIFT)
+#define SLAB_BYTES (SLAB_NODES * sizeof(Node))
+#define MAX_SLABS (MAX_NODES / SLAB_NODES)
+
+// All nodes of the current translation unit, indexed by NodeId
+static _Thread_local Node *slab_table[MAX_SLABS];
+_Thread_local Node **node_slabs;
+static _Thread_local int num_slabs;     // Slabs mapped so far
+static _Thread_local uint32_t num_nodes; // Next id to hand out
+
+// Maps a slab aligned to NODE_SLAB_ALIGN. We map more than we need and
+// give back the parts before and after the aligned range, so only
+// SLAB_BYTES stay mapped (and, with strict overcommit, charged).
+static Node *map_slab(void) {
+  size_t size = SLAB_BYTES + NODE_SLAB_ALIGN;
+  char *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    error("cannot allocate nodes: %s", strerror(errno));
+
+  char *slab = (char *)(((uintptr_t)p + NODE_SLAB_ALIGN - 1) & ~(NODE_SLAB_ALIGN - 1));
+  if (slab > p)
+    munmap(p, slab - p);
+  munmap(slab + SLAB_BYTES, p + size - (slab + SLAB_BYTES));
+  return (Node *)slab;
+}
+
+// Returns a new zero-initialized node.
+//
+// Slabs are mapped as the pool grows and never move, so a NodeId can
+// be turned into a pointer with a table lookup and an addition. Only
+// the pages that nodes are actually written to are backed by memory.
+Node *alloc_node(void) {
+  node_slabs = slab_table;
+
+  // The first slot of a slab holds its index. For slab 0, it also
+  // makes NodeId 0 mean "no node".
+  if ((num_nodes & (SLAB_NODES - 1)) == 0) {
+    int idx = num_nodes >> NODE_SLAB_SHIFT;
+    if (idx == MAX_SLABS)
+      error("too many nodes");
+    if (idx == num_slabs)
+      slab_table[num_slabs++] = map_slab();
+    *(NodeId *)slab_table[idx] = idx;
+    num_nodes++;
+  }
+
+  mem_stats[MEM_NODE].count++;
+  mem_stats[MEM_NODE].bytes += sizeof(Node);
+  return get_node(num_nodes++);
+}
+
+// Frees all nodes. The first slab is kept for the next translation
+// unit; the others are given back to the system.
+void reset_nodes(void) {
+  if (!num_slabs)
+    return;
+
+  for (int i = 1; i < num_slabs; i++)
+    munmap(slab_table[i], SLAB_BYTES);
+
+  // int madvise(void *addr, size_t length, int advice);
+  // MADV_DONTNEED: After a successful MADV_DONTNEED operation, the semantics of memory access in
+  // the specified region are changed: subsequent accesses of pages in the range will succeed, but
+  // will result in either repopulating the memory contents from the up-to-date contents of the
+  // underlying mapped file (for shared file mappings, shared anonymous mappings, and shmem-based
+  // techniques such as System V shared memory segments) or zero-fill-on-demand pages for
+  // anonymous private mappings.
+  madvise(slab_table[0], SLAB_BYTES, MADV_DONTNEED);
+  num_slabs = 1;
+  num_nodes = 0;
+}
+
+// Returns the number of bytes taken by the nodes allocated so far.
+size_t nodes_used(void) {
+  uint32_t slabs = (num_nodes + SLAB_NODES - 1) >> NODE_SLAB_SHIFT;
+  return (num_nodes - slabs) * sizeof(Node);
+}
+
+// Links `node` after `cur` in a list and returns it.
+static Node *append(Node *cur, Node *node) {
+  cur->next = node_id(node);
+  return node;
 }
 
 static Node *new_node(NodeKind kind, Token *tok) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = kind;
   node->tok = tok;
+  counters.nodes++;
   return node;
 }
 
@@ -59,8 +247,9 @@ static Node *new_node(NodeKind kind, Token *tok) {
 // lhs    rhs
 static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
   Node *node = new_node(kind, tok);
-  node->lhs = lhs;
-  node->rhs = rhs;
+  node->lhs = node_id(lhs);
+  node->rhs = node_id(rhs);
+  add_type(node);
   return node;
 }
 
@@ -70,28 +259,43 @@ static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
 // lhs
 static Node *new_unary(NodeKind kind, Node *expr, Token *tok) {
   Node *node = new_node(kind, tok);
-  node->lhs = expr;
+  node->lhs = node_id(expr);
+  add_type(node);
   return node;
 }
 
 static Node *new_num(int val, Token *tok) {
   Node *node = new_node(ND_NUM, tok);
   node->val = val;
+  add_type(node);
   return node;
 }
 
 static Node *new_var_node(Obj *var, Token *tok) {
   Node *node = new_node(ND_VAR, tok);
   node->var = var;
+  add_type(node);
   return node;
 }
 
-static Obj *new_lvar(char *name, Type *ty) {
-  Obj *var = calloc(1, sizeof(Obj));
+static Obj *new_var(char *name, Type *ty) {
+  Obj *var = arena_alloc(&parse_arena, MEM_OBJ, sizeof(Obj));
   var->name = name;
   var->ty = ty;
+  return var;
+}
+
+// Adds `var` to the locals of the current function and brings it into
+// scope.
+static void add_lvar(Obj *var) {
   var->next = locals;
   locals = var;
+  declare_var(var);
+}
+
+static Obj *new_lvar(char *name, Type *ty) {
+  Obj *var = new_var(name, ty);
+  add_lvar(var);
   return var;
 }
 
@@ -106,7 +310,10 @@ static char *get_ident(Token *tok) {
   //
   // The strndup() function is similar, but copies at most n bytes. If s is longer than n, only n
   // bytes are copied, and a terminating null byte ('\0') is added.
-  return strndup(tok->loc, tok->len);
+  //
+  // Instead of duplicating the name for every occurrence, we intern it so that identical names
+  // share one copy and can be compared by pointer.
+  return intern(token_loc(tok), tok->len);
 }
 
 static int get_number(Token *tok) {
@@ -148,41 +355,54 @@ static int get_number(Token *tok) {
 
 // declspec = "int"
 static Type *declspec(Token **rest, Token *tok) {
-  *rest = skip(tok, "int");
+  *rest = skip(tok, KW_INT);
   return ty_int;
 }
 
 // func-params = (param ("," param)*)? ")"
 // param       = declspec declarator
-static Type *func_params(Token **rest, Token *tok, Type *ty) {
-  Type head = {};
-  Type *cur = &head;
-
-  while (!equal(tok, ")")) {
+//
+// The parameters are returned in `params` as variables that are not in
+// scope yet. The function type only records their types, since it is
+// shared by all functions with the same signature.
+static Type *func_params(Token **rest, Token *tok, Type *ty, Obj **params) {
+  Obj head = {};
+  Obj *cur = &head;
+  int nparams = 0;
+
+  while (tok->id != P_RPAREN) {
     if (cur != &head)
-      tok = skip(tok, ",");
+      tok = skip(tok, P_COMMA);
     Type *basety = declspec(&tok, tok);
-    Type *ty = declarator(&tok, tok, basety);
-    cur = cur->next = copy_type(ty);
+    Token *name;
+    Type *ty = declarator(&tok, tok, basety, &name, NULL);
+    cur = cur->next = new_var(get_ident(name), ty);
+    nparams++;
   }
 
-  ty = func_type(ty);
-  ty->params = head.next;
-  *rest = tok->next;
-  return ty;
+  // A variable length array must not be empty.
+  Type *param_types[nparams + 1];
+  int i = 0;
+  for (Obj *var = head.next; var; var = var->next)
+    param_types[i++] = var->ty;
+
+  if (params)
+    *params = head.next;
+  *rest = tok + 1;
+  return func_type(ty, param_types, nparams);
 }
 
 // type-suffix = "(" func-params
 //             | "[" num "]" type-suffix
 //             | ε
-static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
-  if (equal(tok, "("))
-    return func_params(rest, tok->next, ty);
-
-  if (equal(tok, "[")) {
-    int sz = get_number(tok->next);
-    tok = skip(tok->next->next, "]");
-    ty = type_suffix(rest, tok, ty);
+static Type *type_suffix(Token **rest, Token *tok, Type *ty, Obj **params) {
+  if (tok->id == P_LPAREN)
+    return func_params(rest, tok + 1, ty, params);
+
+  if (tok->id == P_LBRACKET) {
+    int sz = get_number(tok + 1);
+    tok = skip(tok + 2, P_RBRACKET);
+    ty = type_suffix(rest, tok, ty, params);
     return array_of(ty, sz);
   }
 
@@ -191,15 +411,18 @@ static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
 }
 
 // declarator = "*"* ident type-suffix
-static Type *declarator(Token **rest, Token *tok, Type *ty) {
-  while (consume(&tok, tok, "*"))
+//
+// Returns the declared type and stores the identifier to `name`. If
+// the declarator declares a function and `params` is not NULL, its
+// parameters are stored to `params`.
+static Type *declarator(Token **rest, Token *tok, Type *ty, Token **name, Obj **params) {
+  while (consume(&tok, tok, P_STAR))
     ty = pointer_to(ty);
 
   if (tok->kind != TK_IDENT)
     error_tok(tok, "expected a variable name");
-  ty = type_suffix(rest, tok->next, ty);
-  ty->name = tok;
-  return ty;
+  *name = tok;
+  return type_suffix(rest, tok + 1, ty, params);
 }
 
 // declaration = declspec (declarator ("=" expr)? ("," declarator ("=" expr)?)*)? ";"
@@ -211,25 +434,26 @@ static Node *declaration(Token **rest, Token *tok) {
   Node *cur = &head;
   int i = 0;
 
-  while (!equal(tok, ";")) {
+  while (tok->id != P_SEMI) {
     if (i++ > 0)
-      tok = skip(tok, ",");
+      tok = skip(tok, P_COMMA);
 
-    Type *ty = declarator(&tok, tok, basety);
-    Obj *var = new_lvar(get_ident(ty->name), ty);
+    Token *name;
+    Type *ty = declarator(&tok, tok, basety, &name, NULL);
+    Obj *var = new_lvar(get_ident(name), ty);
 
-    if (!equal(tok, "="))
+    if (tok->id != P_ASSIGN)
       continue;
 
-    Node *lhs = new_var_node(var, ty->name);
-    Node *rhs = assign(&tok, tok->next);
+    Node *lhs = new_var_node(var, name);
+    Node *rhs = assign(&tok, tok + 1);
     Node *node = new_binary(ND_ASSIGN, lhs, rhs, tok);
-    cur = cur->next = new_unary(ND_EXPR_STMT, node, tok);
+    cur = append(cur, new_unary(ND_EXPR_STMT, node, tok));
   }
 
   Node *node = new_node(ND_BLOCK, tok);
   node->body = head.next;
-  *rest = tok->next;
+  *rest = tok + 1;
   return node;
 }
 
@@ -240,54 +464,54 @@ static Node *declaration(Token **rest, Token *tok) {
 //      | "{" compound-stmt
 //      | expr-stmt
 static Node *stmt(Token **rest, Token *tok) {
-  if (equal(tok, "return")) {
+  if (tok->id == KW_RETURN) {
     Node *node = new_node(ND_RETURN, tok);
-    node->lhs = expr(&tok, tok->next);
-    *rest = skip(tok, ";");
+    node->lhs = node_id(expr(&tok, tok + 1));
+    *rest = skip(tok, P_SEMI);
     return node;
   }
 
-  if (equal(tok, "if")) {
+  if (tok->id == KW_IF) {
     Node *node = new_node(ND_IF, tok);
-    tok = skip(tok->next, "(");
-    node->cond = expr(&tok, tok);
-    tok = skip(tok, ")");
-    node->then = stmt(&tok, tok);
-    if (equal(tok, "else"))
-      node->els = stmt(&tok, tok->next);
+    tok = skip(tok + 1, P_LPAREN);
+    node->cond = node_id(expr(&tok, tok));
+    tok = skip(tok, P_RPAREN);
+    node->then = node_id(stmt(&tok, tok));
+    if (tok->id == KW_ELSE)
+      node->els = node_id(stmt(&tok, tok + 1));
     *rest = tok;
     return node;
   }
 
-  if (equal(tok, "for")) {
+  if (tok->id == KW_FOR) {
     Node *node = new_node(ND_FOR, tok);
-    tok = skip(tok->next, "(");
+    tok = skip(tok + 1, P_LPAREN);
 
-    node->init = expr_stmt(&tok, tok);
+    node->init = node_id(expr_stmt(&tok, tok));
 
-    if (!equal(tok, ";"))
-      node->cond = expr(&tok, tok);
-    tok = skip(tok, ";");
+    if (tok->id != P_SEMI)
+      node->cond = node_id(expr(&tok, tok));
+    tok = skip(tok, P_SEMI);
 
-    if (!equal(tok, ")"))
-      node->inc = expr(&tok, tok);
-    tok = skip(tok, ")");
+    if (tok->id != P_RPAREN)
+      node->inc = node_id(expr(&tok, tok));
+    tok = skip(tok, P_RPAREN);
 
-    node->then = stmt(rest, tok);
+    node->then = node_id(stmt(rest, tok));
     return node;
   }
 
-  if (equal(tok, "while")) {
+  if (tok->id == KW_WHILE) {
     Node *node = new_node(ND_FOR, tok);
-    tok = skip(tok->next, "(");
-    node->cond = expr(&tok, tok);
-    tok = skip(tok, ")");
-    node->then = stmt(rest, tok);
+    tok = skip(tok + 1, P_LPAREN);
+    node->cond = node_id(expr(&tok, tok));
+    tok = skip(tok, P_RPAREN);
+    node->then = node_id(stmt(rest, tok));
     return node;
   }
 
-  if (equal(tok, "{"))
-    return compound_stmt(rest, tok->next);
+  if (tok->id == P_LBRACE)
+    return compound_stmt(rest, tok + 1);
 
   return expr_stmt(rest, tok);
 }
@@ -295,32 +519,33 @@ static Node *stmt(Token **rest, Token *tok) {
 // compound-stmt = (declaration | stmt)* "}"
 static Node *compound_stmt(Token **rest, Token *tok) {
   Node *node = new_node(ND_BLOCK, tok);
+  int scope = enter_scope();
 
   Node head = {};
   Node *cur = &head;
-  while (!equal(tok, "}")) {
-    if (equal(tok, "int"))
-      cur = cur->next = declaration(&tok, tok);
+  while (tok->id != P_RBRACE) {
+    if (tok->id == KW_INT)
+      cur = append(cur, declaration(&tok, tok));
     else
-      cur = cur->next = stmt(&tok, tok);
-    add_type(cur);
+      cur = append(cur, stmt(&tok, tok));
   }
 
+  leave_scope(scope);
   node->body = head.next;
-  *rest = tok->next;
+  *rest = tok + 1;
   return node;
 }
 
 // expr-stmt = expr? ";"
 static Node *expr_stmt(Token **rest, Token *tok) {
-  if (equal(tok, ";")) {
-    *rest = tok->next;
+  if (tok->id == P_SEMI) {
+    *rest = tok + 1;
     return new_node(ND_BLOCK, tok);
   }
 
   Node *node = new_node(ND_EXPR_STMT, tok);
-  node->lhs = expr(&tok, tok);
-  *rest = skip(tok, ";");
+  node->lhs = node_id(expr(&tok, tok));
+  *rest = skip(tok, P_SEMI);
   return node;
 }
 
@@ -336,8 +561,8 @@ static Node *expr(Token **rest, Token *tok) {
 static Node *assign(Token **rest, Token *tok) {
   Node *node = equality(&tok, tok);
 
-  if (equal(tok, "="))
-    return new_binary(ND_ASSIGN, node, assign(rest, tok->next), tok);
+  if (tok->id == P_ASSIGN)
+    return new_binary(ND_ASSIGN, node, assign(rest, tok + 1), tok);
 
   *rest = tok;
   return node;
@@ -350,13 +575,13 @@ static Node *equality(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "==")) {
-      node = new_binary(ND_EQ, node, relational(&tok, tok->next), start);
+    if (tok->id == P_EQ) {
+      node = new_binary(ND_EQ, node, relational(&tok, tok + 1), start);
       continue;
     }
 
-    if (equal(tok, "!=")) {
-      node = new_binary(ND_NE, node, relational(&tok, tok->next), start);
+    if (tok->id == P_NE) {
+      node = new_binary(ND_NE, node, relational(&tok, tok + 1), start);
       continue;
     }
 
@@ -372,23 +597,23 @@ static Node *relational(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "<")) {
-      node = new_binary(ND_LT, node, add(&tok, tok->next), start);
+    if (tok->id == P_LT) {
+      node = new_binary(ND_LT, node, add(&tok, tok + 1), start);
       continue;
     }
 
-    if (equal(tok, "<=")) {
-      node = new_binary(ND_LE, node, add(&tok, tok->next), start);
+    if (tok->id == P_LE) {
+      node = new_binary(ND_LE, node, add(&tok, tok + 1), start);
       continue;
     }
 
-    if (equal(tok, ">")) {
-      node = new_binary(ND_LT, add(&tok, tok->next), node, start);
+    if (tok->id == P_GT) {
+      node = new_binary(ND_LT, add(&tok, tok + 1), node, start);
       continue;
     }
 
-    if (equal(tok, ">=")) {
-      node = new_binary(ND_LE, add(&tok, tok->next), node, start);
+    if (tok->id == P_GE) {
+      node = new_binary(ND_LE, add(&tok, tok + 1), node, start);
       continue;
     }
 
@@ -403,9 +628,6 @@ static Node *relational(Token **rest, Token *tok) {
 // In other words, we need to scale an integer value before adding to a
 // pointer value. This function takes care of the scaling.
 static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
-  add_type(lhs);
-  add_type(rhs);
-
   // num + num
   if (is_integer(lhs->ty) && is_integer(rhs->ty))
     return new_binary(ND_ADD, lhs, rhs, tok);
@@ -427,9 +649,6 @@ static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
 
 // Like `+`, `-` is overloaded for the pointer type.
 static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
-  add_type(lhs);
-  add_type(rhs);
-
   // num - num
   if (is_integer(lhs->ty) && is_integer(rhs->ty))
     return new_binary(ND_SUB, lhs, rhs, tok);
@@ -437,10 +656,7 @@ static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
   // ptr - num
   if (lhs->ty->base && is_integer(rhs->ty)) {
     rhs = new_binary(ND_MUL, rhs, new_num(lhs->ty->base->size, tok), tok);
-    add_type(rhs);
-    Node *node = new_binary(ND_SUB, lhs, rhs, tok);
-    node->ty = lhs->ty;
-    return node;
+    return new_binary(ND_SUB, lhs, rhs, tok);
   }
 
   // ptr - ptr, which returns how many elements are between the two.
@@ -460,13 +676,13 @@ static Node *add(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "+")) {
-      node = new_add(node, mul(&tok, tok->next), start);
+    if (tok->id == P_PLUS) {
+      node = new_add(node, mul(&tok, tok + 1), start);
       continue;
     }
 
-    if (equal(tok, "-")) {
-      node = new_sub(node, mul(&tok, tok->next), start);
+    if (tok->id == P_MINUS) {
+      node = new_sub(node, mul(&tok, tok + 1), start);
       continue;
     }
 
@@ -482,13 +698,13 @@ static Node *mul(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "*")) {
-      node = new_binary(ND_MUL, node, unary(&tok, tok->next), start);
+    if (tok->id == P_STAR) {
+      node = new_binary(ND_MUL, node, unary(&tok, tok + 1), start);
       continue;
     }
 
-    if (equal(tok, "/")) {
-      node = new_binary(ND_DIV, node, unary(&tok, tok->next), start);
+    if (tok->id == P_SLASH) {
+      node = new_binary(ND_DIV, node, unary(&tok, tok + 1), start);
       continue;
     }
 
@@ -500,17 +716,21 @@ static Node *mul(Token **rest, Token *tok) {
 // unary = ("+" | "-" | "*" | "&") unary
 //       | postfix
 static Node *unary(Token **rest, Token *tok) {
-  if (equal(tok, "+"))
-    return unary(rest, tok->next);
+  if (tok->id == P_PLUS)
+    return unary(rest, tok + 1);
 
-  if (equal(tok, "-"))
-    return new_unary(ND_NEG, unary(rest, tok->next), tok);
+  if (tok->id == P_MINUS)
+    return new_unary(ND_NEG, unary(rest, tok + 1), tok);
 
-  if (equal(tok, "&"))
-    return new_unary(ND_ADDR, unary(rest, tok->next), tok);
+  if (tok->id == P_AMP) {
+    Node *node = new_unary(ND_ADDR, unary(rest, tok + 1), tok);
+    if (node_lhs(node)->kind == ND_VAR)
+      node_lhs(node)->var->addr_taken = true;
+    return node;
+  }
 
-  if (equal(tok, "*"))
-    return new_unary(ND_DEREF, unary(rest, tok->next), tok);
+  if (tok->id == P_STAR)
+    return new_unary(ND_DEREF, unary(rest, tok + 1), tok);
 
   return postfix(rest, tok);
 }
@@ -519,11 +739,11 @@ static Node *unary(Token **rest, Token *tok) {
 static Node *postfix(Token **rest, Token *tok) {
   Node *node = primary(&tok, tok);
 
-  while (equal(tok, "[")) {
+  while (tok->id == P_LBRACKET) {
     // x[y] is short for *(x+y)
     Token *start = tok;
-    Node *idx = expr(&tok, tok->next);
-    tok = skip(tok, "]");
+    Node *idx = expr(&tok, tok + 1);
+    tok = skip(tok, P_RBRACKET);
     node = new_unary(ND_DEREF, new_add(node, idx, start), start);
   }
   *rest = tok;
@@ -533,85 +753,101 @@ static Node *postfix(Token **rest, Token *tok) {
 // funcall = ident "(" (assign ("," assign)*)? ")"
 static Node *funcall(Token **rest, Token *tok) {
   Token *start = tok;
-  tok = tok->next->next;
+  tok = tok + 2;
 
   Node head = {};
   Node *cur = &head;
 
-  while (!equal(tok, ")")) {
+  while (tok->id != P_RPAREN) {
     if (cur != &head)
-      tok = skip(tok, ",");
-    cur = cur->next = assign(&tok, tok);
+      tok = skip(tok, P_COMMA);
+    cur = append(cur, assign(&tok, tok));
   }
 
-  *rest = skip(tok, ")");
+  *rest = skip(tok, P_RPAREN);
 
   Node *node = new_node(ND_FUNCALL, start);
-  node->funcname = strndup(start->loc, start->len);
+  node->funcname = intern(token_loc(start), start->len);
   node->args = head.next;
+  add_type(node);
   return node;
 }
 
 // primary = "(" expr ")" | ident func-args? | num
 static Node *primary(Token **rest, Token *tok) {
-  if (equal(tok, "(")) {
-    Node *node = expr(&tok, tok->next);
-    *rest = skip(tok, ")");
+  if (tok->id == P_LPAREN) {
+    Node *node = expr(&tok, tok + 1);
+    *rest = skip(tok, P_RPAREN);
     return node;
   }
 
   if (tok->kind == TK_IDENT) {
     // Function call
-    if (equal(tok->next, "("))
+    if (tok[1].id == P_LPAREN)
       return funcall(rest, tok);
 
     // Variable
     Obj *var = find_var(tok);
     if (!var)
       error_tok(tok, "undefined variable");
-    *rest = tok->next;
+    *rest = tok + 1;
     return new_var_node(var, tok);
   }
 
   if (tok->kind == TK_NUM) {
     Node *node = new_num(tok->val, tok);
-    *rest = tok->next;
+    *rest = tok + 1;
     return node;
   }
 
   error_tok(tok, "expected an expression");
 }
 
-static void create_param_lvars(Type *param) {
+// Makes the parameters locals of the current function. The last one is
+// added first, so that they end up in order at the head of `locals`.
+static void create_param_lvars(Obj *param) {
   if (param) {
     create_param_lvars(param->next);
-    new_lvar(get_ident(param->name), param);
+    add_lvar(param);
   }
 }
 
 static Function *function(Token **rest, Token *tok) {
+  Token *start = tok;
   Type *ty = declspec(&tok, tok);
-  ty = declarator(&tok, tok, ty);
+  Token *name;
+  Obj *params = NULL;
+  ty = declarator(&tok, tok, ty, &name, &params);
 
   locals = NULL;
+  int scope = enter_scope();
 
-  Function *fn = calloc(1, sizeof(Function));
-  fn->name = get_ident(ty->name);
-  create_param_lvars(ty->params);
+  Function *fn = arena_alloc(&parse_arena, MEM_FUNCTION, sizeof(Function));
+  counters.functions++;
+  fn->name = get_ident(name);
+  create_param_lvars(params);
   fn->params = locals;
 
-  tok = skip(tok, "{");
+  tok = skip(tok, P_LBRACE);
   fn->body = compound_stmt(rest, tok);
   fn->locals = locals;
+  fn->tok = start;
+  fn->ntokens = *rest - start;
+  leave_scope(scope);
   return fn;
 }
 
 // program = function-definition*
+//
+// Each function is optimized as soon as it has been parsed, while its
+// nodes are still in the cache.
 Function *parse(Token *tok) {
   Function head = {};
   Function *cur = &head;
 
-  while (tok->kind != TK_EOF)
+  while (tok->kind != TK_EOF) {
     cur = cur->next = function(&tok, tok);
+    optimize(cur);
+  }
   return head.next;
 }
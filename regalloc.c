@@ -0,0 +1,351 @@
+// This file implements the register allocator, which decides for each
+// virtual register of a function whether it lives in a machine register
+// or in a stack slot.
+//
+// It is a linear-scan allocator, as described by Poletto and Sarkar in
+// "Linear Scan Register Allocation" (TOPLAS, 1999). Every virtual
+// register gets a live interval, which runs from the first to the last
+// position at which its value may be needed. Intervals are visited in
+// order of their start. Each one takes a free register if there is
+// one. If there isn't, the interval that ends last is spilled to the
+// stack; that is either the current one or one of those holding a
+// register it could use.
+//
+// Intervals are computed from liveness. Expressions in our language
+// contain no control flow, so the temporaries of an expression are
+// used in the basic block that defines them, and only variables can be
+// live across blocks. Live-in and live-out sets are therefore computed
+// for variables only.
+//
+// The usual iterative dataflow analysis takes one round per level of
+// loop nesting, which is quadratic for deeply nested loops. Our loops
+// are structured, though: a loop is the code between its header label
+// and the jump back to it, and it is left only through its header.
+// For such code, one backward pass that ignores the back edges gets
+// the live-in set of every loop header right, and a variable that is
+// live into a header is live throughout the loop (Brandner et al.,
+// "Computing Liveness Sets for SSA-Form Programs", 2011, make the same
+// observation for reducible control flow).
+//
+// A call clobbers the caller-saved registers. An interval that spans a
+// call can only get a callee-saved register, which the function then
+// saves in its prologue. Other intervals get a caller-saved register
+// if one is free, since those cost nothing to use.
+//
+// %rax and %rdx are never handed out, since division, return values
+// and calls need them. Neither is %r11, which the code generator uses
+// as a scratch register.
+
+#include "chibicc.h"
+#include <limits.h>
+
+// %rdi     used to pass 1st argument to functions
+// %rsi     used to pass 2nd argument to functions
+// %rdx     used to pass 3rd argument to functions; 2nd return register
+// %rcx     used to pass 4th integer argument to functions
+// %r8      used to pass 5th argument to functions
+// %r9      used to pass 6th argument to functions
+Reg arg_regs[6] = {REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9};
+
+// Registers to hand out, in order of preference
+static Reg caller_saved[] = {REG_RCX, REG_RSI, REG_RDI, REG_R8, REG_R9, REG_R10};
+static Reg callee_saved[] = {REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15};
+
+#define NUM_CALLER_SAVED (sizeof(caller_saved) / sizeof(*caller_saved))
+#define NUM_CALLEE_SAVED (sizeof(callee_saved) / sizeof(*callee_saved))
+
+typedef struct {
+  int start, end; // First and last instruction
+  int succ[2];    // Successor blocks, or -1
+} Block;
+
+typedef struct {
+  int start;
+  int vreg;
+} Interval;
+
+// Instruction i is at position 2i+2. Position 0 is the entry of the
+// function, where the parameters arrive. The odd position after the
+// last instruction of a block is where its live-out values must still
+// be intact.
+static int pos(int i) {
+  return 2 * i + 2;
+}
+
+// Returns the virtual registers `ir` reads. `buf` has room for two.
+static int get_uses(IrFunc *fn, Ir *ir, int *buf, int **uses) {
+  if (ir->op == IR_CALL) {
+    *uses = fn->args + ir->args;
+    return ir->nargs;
+  }
+
+  int n = 0;
+  if (ir->a)
+    buf[n++] = ir->a;
+  if (ir->b)
+    buf[n++] = ir->b;
+  *uses = buf;
+  return n;
+}
+
+static bool ends_block(IrOp op) {
+  return op == IR_JMP || op == IR_BR || op == IR_RET;
+}
+
+// Splits the code into basic blocks and links them to their successors.
+static Block *find_blocks(IrFunc *fn, int *nblocks) {
+  Block *blocks = malloc(sizeof(Block) * (fn->ncode + 1));
+  int *label_block = malloc(sizeof(int) * (fn->nlabels + 1));
+  int n = 0;
+
+  for (int i = 0; i < fn->ncode; i++) {
+    Ir *ir = &fn->code[i];
+    if (i == 0 || ir->op == IR_LABEL || ends_block(fn->code[i - 1].op))
+      blocks[n++] = (Block){.start = i, .succ = {-1, -1}};
+    if (ir->op == IR_LABEL)
+      label_block[ir->label] = n - 1;
+    blocks[n - 1].end = i;
+  }
+
+  for (int b = 0; b < n; b++) {
+    Ir *last = &fn->code[blocks[b].end];
+    if (last->op == IR_JMP) {
+      blocks[b].succ[0] = label_block[last->label];
+    } else if (last->op != IR_RET) {
+      if (b + 1 < n)
+        blocks[b].succ[0] = b + 1;
+      if (last->op == IR_BR)
+        blocks[b].succ[1] = label_block[last->label];
+    }
+  }
+
+  free(label_block);
+  *nblocks = n;
+  return blocks;
+}
+
+static void set_bit(uint64_t *set, int i) {
+  set[i / 64] |= 1ULL << (i % 64);
+}
+
+// Makes [start[v], end[v]] cover position `p`.
+static void extend(int *start, int *end, int v, int p) {
+  if (p < start[v])
+    start[v] = p;
+  if (end[v] < p)
+    end[v] = p;
+}
+
+// Makes the intervals of the variables cover the blocks they are live
+// in and out of.
+static void extend_by_liveness(IrFunc *fn, Block *blocks, int nblocks, int *start, int *end) {
+  int nvars = fn->nvars;
+  int words = nvars / 64 + 1;
+  uint64_t *sets = calloc((size_t)nblocks * words * 2, sizeof(uint64_t));
+
+  // A block's successors come after it, except for the header of a
+  // loop it closes. Visiting the blocks backwards, out is the union of
+  // in of the later successors, and in = uses before any write | (out
+  // minus writes).
+  for (int b = nblocks - 1; b >= 0; b--) {
+    uint64_t *in = sets + ((size_t)b * 2) * words;
+    uint64_t *out = in + words;
+
+    for (int k = 0; k < 2; k++) {
+      int s = blocks[b].succ[k];
+      if (s > b)
+        for (int w = 0; w < words; w++)
+          out[w] |= sets[(size_t)s * 2 * words + w];
+    }
+
+    memcpy(in, out, words * sizeof(uint64_t));
+    for (int i = blocks[b].end; i >= blocks[b].start; i--) {
+      Ir *ir = &fn->code[i];
+      if (ir->dst && ir->dst <= nvars)
+        in[ir->dst / 64] &= ~(1ULL << (ir->dst % 64));
+
+      int buf[2], *uses;
+      int n = get_uses(fn, ir, buf, &uses);
+      for (int j = 0; j < n; j++)
+        if (uses[j] <= nvars)
+          set_bit(in, uses[j]);
+    }
+  }
+
+  for (int b = 0; b < nblocks; b++) {
+    uint64_t *in = sets + ((size_t)b * 2) * words;
+    uint64_t *out = in + words;
+
+    for (int w = 0; w < words; w++) {
+      for (uint64_t x = in[w]; x; x &= x - 1)
+        extend(start, end, w * 64 + __builtin_ctzll(x), pos(blocks[b].start));
+      for (uint64_t x = out[w]; x; x &= x - 1)
+        extend(start, end, w * 64 + __builtin_ctzll(x), pos(blocks[b].end) + 1);
+    }
+
+    // The block jumps back to the header of its loop. What is live
+    // into the header is live in the whole loop.
+    for (int k = 0; k < 2; k++) {
+      int h = blocks[b].succ[k];
+      if (h == -1 || h > b)
+        continue;
+      uint64_t *hin = sets + ((size_t)h * 2) * words;
+      for (int w = 0; w < words; w++) {
+        for (uint64_t x = hin[w]; x; x &= x - 1) {
+          int v = w * 64 + __builtin_ctzll(x);
+          extend(start, end, v, pos(blocks[h].start));
+          extend(start, end, v, pos(blocks[b].end) + 1);
+        }
+      }
+    }
+  }
+
+  free(sets);
+}
+
+static int cmp_interval(const void *x, const void *y) {
+  const Interval *a = x;
+  const Interval *b = y;
+  if (a->start != b->start)
+    return a->start < b->start ? -1 : 1;
+  return a->vreg - b->vreg;
+}
+
+// Returns a free register for an interval, or -1. `hint` is the
+// register the interval would like, or 0. Only some argument registers
+// are ever handed out, so the hint may not be usable.
+static int pick_reg(int *owner, Reg hint, bool spans_call) {
+  if (!spans_call) {
+    for (int i = 0; i < NUM_CALLER_SAVED; i++)
+      if (caller_saved[i] == hint && !owner[hint])
+        return hint;
+    for (int i = 0; i < NUM_CALLER_SAVED; i++)
+      if (!owner[caller_saved[i]])
+        return caller_saved[i];
+  }
+  for (int i = 0; i < NUM_CALLEE_SAVED; i++)
+    if (!owner[callee_saved[i]])
+      return callee_saved[i];
+  return -1;
+}
+
+static Loc new_spill_slot(IrFunc *fn) {
+  fn->frame_size += 8;
+  return (Loc){LOC_STACK, .val = -fn->frame_size};
+}
+
+// Assigns a location to every virtual register of `fn`. Spill slots
+// are allocated below the `frame_size` bytes the function already
+// uses.
+void regalloc(IrFunc *fn, int frame_size) {
+  int nvregs = fn->nvregs;
+  int *start = malloc(sizeof(int) * (nvregs + 1));
+  int *end = malloc(sizeof(int) * (nvregs + 1));
+  bool *used = calloc(nvregs + 1, sizeof(bool));
+  Reg *hint = calloc(nvregs + 1, sizeof(Reg));
+
+  for (int v = 0; v <= nvregs; v++) {
+    start[v] = INT_MAX;
+    end[v] = -1;
+  }
+
+  int nblocks;
+  Block *blocks = find_blocks(fn, &nblocks);
+  extend_by_liveness(fn, blocks, nblocks, start, end);
+  free(blocks);
+
+  // calls[p] is the number of calls at or before position p.
+  int npos = pos(fn->ncode) + 1;
+  int *calls = calloc(npos, sizeof(int));
+
+  for (int i = 0; i < fn->ncode; i++) {
+    Ir *ir = &fn->code[i];
+    int buf[2], *uses;
+    int n = get_uses(fn, ir, buf, &uses);
+    for (int j = 0; j < n; j++) {
+      extend(start, end, uses[j], pos(i));
+      used[uses[j]] = true;
+    }
+    if (ir->dst)
+      extend(start, end, ir->dst, pos(i));
+
+    // A temporary computed for an argument would like to be computed
+    // right into its argument register.
+    if (ir->op == IR_CALL) {
+      calls[pos(i)] = 1;
+      for (int j = 0; j < n; j++)
+        if (uses[j] > fn->nvars && !hint[uses[j]])
+          hint[uses[j]] = arg_regs[j];
+    }
+  }
+  for (int p = 1; p < npos; p++)
+    calls[p] += calls[p - 1];
+
+  // Parameters arrive in their argument registers at the entry.
+  for (int i = 0; i < 6; i++) {
+    int v = fn->param_vregs[i];
+    if (v && used[v]) {
+      extend(start, end, v, 0);
+      hint[v] = arg_regs[i];
+    }
+  }
+
+  // Linear scan
+  Interval *intervals = malloc(sizeof(Interval) * (nvregs + 1));
+  int n = 0;
+  for (int v = 1; v <= nvregs; v++)
+    if (used[v])
+      intervals[n++] = (Interval){start[v], v};
+  qsort(intervals, n, sizeof(Interval), cmp_interval);
+
+  fn->locs = calloc(nvregs + 1, sizeof(Loc));
+  fn->frame_size = frame_size;
+  fn->used_regs = 0;
+  int owner[16] = {};
+
+  for (int i = 0; i < n; i++) {
+    int v = intervals[i].vreg;
+
+    // Free the registers of the intervals that have ended. A value
+    // read by an instruction may share its register with the value the
+    // instruction writes.
+    for (int r = 0; r < 16; r++)
+      if (owner[r] && end[owner[r]] <= start[v])
+        owner[r] = 0;
+
+    bool spans_call = end[v] - 1 > start[v] && calls[end[v] - 1] - calls[start[v]] > 0;
+    int r = pick_reg(owner, hint[v], spans_call);
+
+    if (r == -1) {
+      // Spill whichever ends last: this interval or one of those
+      // holding a register it could use.
+      int victim = 0;
+      for (int j = 0; j < NUM_CALLEE_SAVED + NUM_CALLER_SAVED; j++) {
+        Reg cand = j < NUM_CALLEE_SAVED ? callee_saved[j] : caller_saved[j - NUM_CALLEE_SAVED];
+        if (j >= NUM_CALLEE_SAVED && spans_call)
+          break;
+        if (!victim || end[owner[cand]] > end[victim]) {
+          victim = owner[cand];
+          r = cand;
+        }
+      }
+
+      if (end[victim] <= end[v]) {
+        fn->locs[v] = new_spill_slot(fn);
+        continue;
+      }
+      fn->locs[victim] = new_spill_slot(fn);
+    }
+
+    owner[r] = v;
+    fn->locs[v] = (Loc){LOC_REG, r};
+    fn->used_regs |= 1u << r;
+  }
+
+  free(intervals);
+  free(calls);
+  free(hint);
+  free(used);
+  free(end);
+  free(start);
+}
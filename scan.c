@@ -0,0 +1,207 @@
+// This file contains the character scanning kernels used by the
+// tokenizer: skipping a run of whitespace and finding the end of an
+// identifier or a number.
+//
+// Each kernel exists in a scalar version and, on x86-64, in SSE2 and
+// AVX2 versions that classify 16 or 32 bytes at once. init_scanner()
+// picks the widest version the CPU supports.
+//
+// The vector versions only use aligned loads. An aligned 16- or
+// 32-byte block never straddles a page boundary, so reading the whole
+// block that contains the terminating NUL is always safe, even if the
+// input is not padded.
+
+#include "chibicc.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+// Character classes. We don't use <ctype.h> here because its functions
+// depend on the current locale and are not inlined.
+unsigned char char_class[256];
+
+static void init_char_class(void) {
+  for (int c = 0; c < 256; c++) {
+    unsigned char cls = 0;
+    if (c == ' ' || ('\t' <= c && c <= '\r'))
+      cls |= CC_SPACE;
+    if ('0' <= c && c <= '9')
+      cls |= CC_DIGIT | CC_IDENT2;
+    if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_')
+      cls |= CC_IDENT1 | CC_IDENT2;
+    char_class[c] = cls;
+  }
+}
+
+//
+// Scalar kernels
+//
+
+static char *skip_space_scalar(char *p) {
+  while (char_class[(unsigned char)*p] & CC_SPACE)
+    p++;
+  return p;
+}
+
+static char *skip_ident_scalar(char *p) {
+  while (char_class[(unsigned char)*p] & CC_IDENT2)
+    p++;
+  return p;
+}
+
+static char *skip_digits_scalar(char *p) {
+  while (char_class[(unsigned char)*p] & CC_DIGIT)
+    p++;
+  return p;
+}
+
+Scanner scan_scalar = {
+  "scalar", skip_space_scalar, skip_ident_scalar, skip_digits_scalar,
+};
+
+#ifdef __x86_64__
+
+//
+// SSE2 kernels
+//
+// SSE2 has only signed byte comparisons. That is fine for us because
+// every byte we are looking for is ASCII, and bytes >= 0x80 compare as
+// negative numbers and thus never fall into a class.
+//
+
+// Returns a vector with 0xff in each byte lane that is in [lo, hi].
+static __m128i in_range16(__m128i v, char lo, char hi) {
+  return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                       _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+static __m128i is_space16(__m128i v) {
+  return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), in_range16(v, '\t', '\r'));
+}
+
+static __m128i is_digit16(__m128i v) {
+  return in_range16(v, '0', '9');
+}
+
+static __m128i is_ident16(__m128i v) {
+  // Setting bit 5 maps 'A'-'Z' to 'a'-'z' and doesn't move any other
+  // byte into that range.
+  __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  __m128i alpha = in_range16(lower, 'a', 'z');
+  __m128i under = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+  return _mm_or_si128(_mm_or_si128(alpha, under), is_digit16(v));
+}
+
+// Defines a kernel that returns a pointer to the first byte at or
+// after p that is not in the class computed by `pred`.
+#define DEFINE_SKIP16(name, pred)                                      \
+  static char *name(char *p) {                                         \
+    unsigned off = (uintptr_t)p & 15;                                  \
+    __m128i *b = (__m128i *)(p - off);                                 \
+    /* Ignore the bytes in the first block that precede p. */          \
+    unsigned mask = ~_mm_movemask_epi8(pred(_mm_load_si128(b))) &      \
+                    (0xffffu << off);                                  \
+    while (!(mask & 0xffff))                                           \
+      mask = ~_mm_movemask_epi8(pred(_mm_load_si128(++b)));            \
+    return (char *)b + __builtin_ctz(mask);                            \
+  }
+
+DEFINE_SKIP16(skip_space_sse2, is_space16)
+DEFINE_SKIP16(skip_ident_sse2, is_ident16)
+DEFINE_SKIP16(skip_digits_sse2, is_digit16)
+
+Scanner scan_sse2 = {
+  "sse2", skip_space_sse2, skip_ident_sse2, skip_digits_sse2,
+};
+
+//
+// AVX2 kernels
+//
+// These are compiled for AVX2 regardless of the -march of the build and
+// are only called if the CPU reports AVX2 support.
+//
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static __m256i in_range32(__m256i v, char lo, char hi) {
+  return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                          _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+
+AVX2 static __m256i is_space32(__m256i v) {
+  return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                         in_range32(v, '\t', '\r'));
+}
+
+AVX2 static __m256i is_digit32(__m256i v) {
+  return in_range32(v, '0', '9');
+}
+
+AVX2 static __m256i is_ident32(__m256i v) {
+  __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+  __m256i alpha = in_range32(lower, 'a', 'z');
+  __m256i under = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'));
+  return _mm256_or_si256(_mm256_or_si256(alpha, under), is_digit32(v));
+}
+
+#define DEFINE_SKIP32(name, pred)                                      \
+  AVX2 static char *name(char *p) {                                    \
+    unsigned off = (uintptr_t)p & 31;                                  \
+    __m256i *b = (__m256i *)(p - off);                                 \
+    unsigned mask = ~_mm256_movemask_epi8(pred(_mm256_load_si256(b))) & \
+                    (0xffffffffu << off);                              \
+    while (!mask)                                                      \
+      mask = ~_mm256_movemask_epi8(pred(_mm256_load_si256(++b)));      \
+    return (char *)b + __builtin_ctz(mask);                            \
+  }
+
+DEFINE_SKIP32(skip_space_avx2, is_space32)
+DEFINE_SKIP32(skip_ident_avx2, is_ident32)
+DEFINE_SKIP32(skip_digits_avx2, is_digit32)
+
+Scanner scan_avx2 = {
+  "avx2", skip_space_avx2, skip_ident_avx2, skip_digits_avx2,
+};
+
+#endif // __x86_64__
+
+// The kernels used by the tokenizer.
+Scanner *scanner = &scan_scalar;
+
+// Fills the character class table and selects the fastest kernels
+// the CPU supports. Setting CHIBICC_SCAN to "scalar", "sse2" or "avx2"
+// overrides the choice, which is handy for testing and benchmarking.
+void init_scanner(void) {
+  init_char_class();
+
+#ifdef __x86_64__
+  // SSE2 is part of the x86-64 baseline.
+  scanner = &scan_sse2;
+
+  // void __builtin_cpu_init (void);
+  // This function runs the CPU detection code to check the type of CPU and the features
+  // supported. This built-in function needs to be invoked along with the built-in functions to
+  // check CPU type and features, __builtin_cpu_is and __builtin_cpu_supports, only when used in a
+  // function that is executed before any constructors are called.
+  //
+  // int __builtin_cpu_supports (const char *feature);
+  // This function returns a positive integer if the run-time CPU supports feature and returns 0
+  // otherwise.
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    scanner = &scan_avx2;
+#endif
+
+  char *name = getenv("CHIBICC_SCAN");
+  if (!name)
+    return;
+  if (!strcmp(name, "scalar"))
+    scanner = &scan_scalar;
+#ifdef __x86_64__
+  else if (!strcmp(name, "sse2"))
+    scanner = &scan_sse2;
+  else if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2"))
+    scanner = &scan_avx2;
+#endif
+}
@@ -0,0 +1,266 @@
+// This file implements the compile server (--serve <socket>) and its
+// client (--connect <socket>).
+//
+// A build that runs the compiler once per file pays for starting a
+// process every time, and every process starts cold. The server is a
+// long-lived process that listens on a Unix domain socket and compiles
+// one program per connection. It runs a fixed number of worker threads
+// which take turns accepting connections. Each request is compiled from
+// start to end on one worker, with the same per-thread state as batch
+// mode, and the worker resets that state before it takes the next one.
+// Tables that are built once, such as the tokenizer's, stay warm.
+//
+// The client is the ordinary command line with --connect added. It
+// reads the input itself, so relative paths and stdin work as usual,
+// sends it to the server and writes what comes back to the output
+// file. If no server is listening, it compiles in its own process, so
+// adding --connect never breaks a build. Options that are about the
+// client process itself (--run, --batch and the reports) also make it
+// compile locally.
+//
+// Both directions use the same framing: integers in the byte order of
+// the machine, since both ends run on it, and byte strings preceded by
+// their length.
+//
+//   request: uint32 flags, uint32 name length, name,
+//            uint64 input length, input
+//   reply:   int32 exit status, uint64 message length, messages,
+//            uint64 output length, output
+//
+// The name is used in error messages; messages are what the compiler
+// would have printed to stderr.
+
+#include "chibicc.h"
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Request flags
+#define REQ_OBJECT 1 // Reply with an ELF object file instead of assembly
+
+// Longest string either side accepts. The length comes from the other
+// end of the connection, so it must be checked before it is used to
+// size a buffer.
+#define MAX_STRING_LEN ((uint64_t)1 << 30)
+
+static bool read_all(int fd, void *buf, size_t len) {
+  for (char *p = buf; len > 0;) {
+    ssize_t n = read(fd, p, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool write_all(int fd, void *buf, size_t len) {
+  for (char *p = buf; len > 0;) {
+    ssize_t n = write(fd, p, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool write_string(int fd, char *s, uint64_t len) {
+  return write_all(fd, &len, sizeof(len)) && write_all(fd, s, len);
+}
+
+// Reads a length-prefixed string followed by INPUT_PADDING zero bytes,
+// so that the result can be tokenized as it is. Returns NULL if the
+// connection ends first or the string is longer than MAX_STRING_LEN.
+static char *read_string(int fd, uint64_t *len) {
+  if (!read_all(fd, len, sizeof(*len)) || *len > MAX_STRING_LEN)
+    return NULL;
+
+  char *s = calloc(1, *len + 1 + INPUT_PADDING);
+  if (!s)
+    return NULL;
+  if (!read_all(fd, s, *len)) {
+    free(s);
+    return NULL;
+  }
+  return s;
+}
+
+static void fill_addr(struct sockaddr_un *addr, char *path) {
+  // struct sockaddr_un {
+  //     sa_family_t     sun_family;     /* AF_UNIX */
+  //     char            sun_path[108];  /* Pathname */
+  // };
+  *addr = (struct sockaddr_un){.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr->sun_path))
+    error("%s: socket path too long", path);
+  strcpy(addr->sun_path, path);
+}
+
+// Compiles `input` into `out`. Returns the exit status the compiler
+// would have had.
+static int compile(char *name, char *input, bool object, Buffer *out) {
+  counters = (Counters){};
+
+  jmp_buf env;
+  int status = 1;
+  if (setjmp(env) == 0) {
+    error_jmp = &env;
+    Token *tok = tokenize_string(name, input);
+    Function *prog = parse(tok);
+    open_output_buffer(out, object);
+    codegen(prog, 1);
+    close_output();
+    status = 0;
+  }
+  error_jmp = NULL;
+
+  reset_unit();
+  return status;
+}
+
+// Serves one connection.
+static void handle(int fd) {
+  uint32_t flags;
+  if (!read_all(fd, &flags, sizeof(flags)))
+    return;
+
+  uint32_t namelen;
+  if (!read_all(fd, &namelen, sizeof(namelen)) || namelen > PATH_MAX)
+    return;
+  char name[PATH_MAX + 1] = {};
+  if (!read_all(fd, name, namelen))
+    return;
+
+  uint64_t len;
+  char *input = read_string(fd, &len);
+  if (!input)
+    return;
+
+  // FILE *open_memstream(char **ptr, size_t *sizeloc);
+  // The open_memstream() function opens a stream for writing to a memory buffer. The function
+  // dynamically allocates the buffer, and the buffer automatically grows as needed.
+  char *msg = NULL;
+  size_t msglen = 0;
+  error_file = open_memstream(&msg, &msglen);
+
+  Buffer out = {};
+  int32_t status = compile(name, input, flags & REQ_OBJECT, &out);
+
+  if (error_file)
+    fclose(error_file);
+  error_file = NULL;
+
+  // A client that went away gets no reply; there is no one to tell.
+  if (write_all(fd, &status, sizeof(status)) && write_string(fd, msg ? msg : "", msglen))
+    write_string(fd, out.data ? out.data : "", out.len);
+
+  free(msg);
+  free(input);
+  buf_free(&out);
+}
+
+static void serve(void *arg, int i) {
+  int sock = *(int *)arg;
+
+  for (;;) {
+    // int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+    // It extracts the first connection request on the queue of pending connections for the
+    // listening socket, sockfd, creates a new connected socket, and returns a new file descriptor
+    // referring to that socket.
+    int fd = accept(sock, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      error("accept failed: %s", strerror(errno));
+    }
+    handle(fd);
+    close(fd);
+  }
+}
+
+// Listens on the socket `path` and serves requests on `nthreads`
+// threads until the process is killed. A stale socket file left by a
+// previous server is replaced.
+int run_server(char *path, int nthreads) {
+  // A client that disconnects early must not kill the server when it
+  // writes the reply.
+  //
+  // SIGPIPE: Broken pipe: write to pipe with no readers.
+  signal(SIGPIPE, SIG_IGN);
+
+  struct sockaddr_un addr;
+  fill_addr(&addr, path);
+
+  // int socket(int domain, int type, int protocol);
+  // AF_UNIX: Local communication
+  // SOCK_STREAM: Provides sequenced, reliable, two-way, connection-based byte streams.
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1)
+    error("socket failed: %s", strerror(errno));
+
+  unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    error("%s: bind failed: %s", path, strerror(errno));
+
+  // int listen(int sockfd, int backlog);
+  // SOMAXCONN: If the backlog argument is greater than the value in
+  // /proc/sys/net/core/somaxconn, then it is silently truncated to that value.
+  if (listen(sock, SOMAXCONN) == -1)
+    error("%s: listen failed: %s", path, strerror(errno));
+
+  parallel_for(nthreads, nthreads, serve, &sock);
+  return 0;
+}
+
+// Compiles `input_path` on the server listening at `path` and writes
+// the result to `output_path`. Returns the exit status, or -1 without
+// having read the input if there is no server.
+int run_client(char *path, char *input_path, char *output_path, bool object, bool count_bytes) {
+  struct sockaddr_un addr;
+  fill_addr(&addr, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  char *input = read_file(input_path);
+  uint32_t flags = object ? REQ_OBJECT : 0;
+  uint32_t namelen = strlen(input_path);
+  if (!write_all(fd, &flags, sizeof(flags)) || !write_all(fd, &namelen, sizeof(namelen)) ||
+      !write_all(fd, input_path, namelen) || !write_string(fd, input, strlen(input)))
+    error("%s: cannot send request: %s", path, strerror(errno));
+
+  int32_t status;
+  uint64_t msglen, len;
+  char *msg, *out;
+  if (!read_all(fd, &status, sizeof(status)) || !(msg = read_string(fd, &msglen)) ||
+      !(out = read_string(fd, &len)))
+    error("%s: connection to server lost", path);
+  close(fd);
+
+  fwrite(msg, 1, msglen, stderr);
+  free(msg);
+
+  if (status == 0) {
+    open_output(output_path, count_bytes, false);
+    Buffer buf = {out, len, len};
+    write_output(&buf);
+    size_t size = close_output();
+    if (count_bytes)
+      printf("%zu\n", size);
+  }
+  free(out);
+  return status;
+}
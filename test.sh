@@ -82,11 +82,27 @@ int add6(int a, int b, int c, int d, int e, int f) {
 }
 EOF
 
+# The same functions as a shared library, for tests that run the
+# program inside the compiler with --run. LD_PRELOAD puts them into the
+# global symbol table of the compiler process, where dlsym finds them.
+cat <<EOF | gcc -xc -shared -fPIC -o tmp2.so -
+int ret3() { return 3; }
+int ret5() { return 5; }
+int add(int x, int y) { return x+y; }
+int sub(int x, int y) { return x-y; }
+
+int add6(int a, int b, int c, int d, int e, int f) {
+  return a+b+c+d+e+f;
+}
+EOF
+
+rm -f tmp.manifest
+
 assert() {
   expected="$1"
   input="$2"
 
-  ./chibicc "$input" > tmp.s || exit
+  echo "$input" | ./chibicc -o tmp.s - || exit
 
   # -static
   #   On systems that support dynamic linking, this overrides -pie and prevents linking with the
@@ -110,6 +126,30 @@ assert() {
     echo "$input => $expected expected, but got $actual"
     exit 1
   fi
+
+  # Do it again with the built-in assembler. The object file must link
+  # and behave exactly like the one assembled from tmp.s.
+  echo "$input" | ./chibicc -c -o tmp.o - || exit
+  gcc -static -o tmp tmp.o tmp2.o
+  ./tmp
+  actual="$?"
+
+  if [ "$actual" != "$expected" ]; then
+    echo "$input => $expected expected, but got $actual (-c)"
+    exit 1
+  fi
+
+  # Collect the test for the batch run below.
+  echo "$expected $input" >> tmp.manifest
+
+  # And once more without leaving the compiler.
+  echo "$input" | LD_PRELOAD=./tmp2.so ./chibicc --run -
+  actual="$?"
+
+  if [ "$actual" != "$expected" ]; then
+    echo "$input => $expected expected, but got $actual (--run)"
+    exit 1
+  fi
 }
 
 assert 0 'int main() { return 0; }'
@@ -223,4 +263,133 @@ assert 3 'int main() { int x[2][3]; int *y=x; y[3]=3; return x[1][0]; }'
 assert 4 'int main() { int x[2][3]; int *y=x; y[4]=4; return x[1][1]; }'
 assert 5 'int main() { int x[2][3]; int *y=x; y[5]=5; return x[1][2]; }'
 
+assert 2 'int main() { int x=2; { int x=3; } return x; }'
+assert 2 'int main() { int x=2; { int x=3; } { int y=4; return x; }}'
+assert 3 'int main() { int x=2; { x=3; } return x; }'
+
+assert 7 'int main() { return 2*3+4/4; }'
+assert 10 'int main() { return - -10; }'
+assert 3 'int main() { int x=3; return x*1+0-x+x/1+x-x; }'
+assert 0 'int main() { int x=3; return x*0; }'
+assert 6 'int main() { int x[4]; int i=1; x[i+2]=6; return *(x+3); }'
+assert 2 'int main() { int x[4]; int *p=x+1; p[1]=2; return x[2]; }'
+assert 3 'int main() { int x[4]; int *p=x; return (p+3)-(p+0); }'
+assert 5 'int main() { if (1-1) return 4; return 5; }'
+assert 4 'int main() { int i=0; while (0) i=i+1; for (;1;) return 4; }'
+
+assert 30 'int main() { int x=10; return x*3; }'
+assert 240 'int main() { int x=10; return x*24; }'
+assert 14 'int main() { int x=100; return x/7; }'
+assert 5 'int main() { int x=-35; return -(x/7); }'
+assert 3 'int main() { int x=-7; return -(x/2); }'
+assert 3 'int main() { int x=-7; return x/-2; }'
+assert 3 'int main() { int x[5][3]; return (x+4)-(x+1); }'
+assert 3 'int main() { int x[5][3]; return -((x+1)-(x+4)); }'
+
+# More than 11 values live at once, so some of them are spilled to the stack.
+assert 91 'int main() { int x=ret3(); int a=x+1; int b=x+2; int c=x+3; int d=x+4; int e=x+5; int f=x+6; int g=x+7; int h=x+8; int i=x+9; int j=x+10; int k=x+11; int l=x+12; int m=x+13; return a+b+c+d+e+f+g+h+i+j+k+l+m-x*13; }'
+# Values kept in callee-saved registers across calls.
+assert 43 'int main() { int a=ret3(); int b=ret5(); return add(a, b)+a*10+b; }'
+assert 35 'int f(int x) { return ret5()+x*10; } int main() { return f(3); }'
+# Arguments passed in a permuted order, which makes the moves into the argument registers cycle.
+assert 21 'int f(int a, int b) { return a*10+b; } int g(int a, int b) { return f(b, a); } int main() { return g(1, 2); }'
+assert 116 'int f(int a, int b, int c) { return a*36+b*6+c; } int g(int a, int b, int c) { return f(c, a, b); } int main() { return g(1, 2, 3); }'
+# A third parameter arrives in %rdx, which division overwrites.
+assert 13 'int f(int a, int b, int c) { return a/b+c; } int main() { return f(20, 3, 7); }'
+assert 21 'int f(int a, int b, int c) { return a/7*c; } int main() { return f(50, 0, 3); }'
+# Multiplication by a constant with a spilled operand: imul $1000, -16(%rbp), %reg.
+assert 126 'int main() { int x=ret3(); int a=x+1; int b=x+2; int c=x+3; int d=x+4; int e=x+5; int f=x+6; int g=x+7; int h=x+8; int i=x+9; int j=x+10; int k=x+11; int l=x+12; int m=x+13; int s=m+l+k+j+i+h+g+f+e+d+c+b; return s+a*1000-x*1000-1000; }'
+
+# Compile a program through the cache twice, the second time with a function added in front of
+# the others. The added function moves the label numbers of the others, so the second compilation
+# also checks that cached functions are relabeled. Either way, the output must be identical to a
+# compilation without the cache.
+f='int f(int x) { if (x) return 1; return 2; }'
+g='int g(int x) { int i; for (i=0; i<x; i=i+1) x=x-1; return x; }'
+h='int h(int x) { while (x) x=x-1; if (x) return 3; return 4; }'
+rm -rf tmp.cache
+for prog in "$f $g" "$h $f $g"; do
+  echo "$prog" | ./chibicc -o tmp.s - || exit
+  echo "$prog" | ./chibicc --cache tmp.cache -o tmp2.s - || exit
+  cmp tmp.s tmp2.s || { echo "cache: $prog"; exit 1; }
+done
+rm -rf tmp.cache
+echo "cache OK"
+
+# Functions are compiled on several threads, which must give the same output as compiling them
+# one by one.
+echo "$h $f $g" | ./chibicc -j1 -o tmp.s - || exit
+echo "$h $f $g" | ./chibicc -j3 -o tmp2.s - || exit
+cmp tmp.s tmp2.s || { echo "threads: -j3"; exit 1; }
+# An error found while generating code on a worker thread must be reported like any other.
+e='int f() { return 1; } int g() { return 2; } int main() { 1=2; return 0; }'
+echo "$e" | ./chibicc -j3 -o tmp.s - 2>tmp.err
+status=$?
+[ $status = 1 ] && grep -q 'not an lvalue' tmp.err || { echo "threads: error, status $status"; exit 1; }
+echo "threads OK"
+
+# Compile the same program on a compile server, which must give the same output as compiling it
+# here, and without a server, in which case the client compiles it itself. The client falls back
+# silently, so the server keeps a cache that only it can have filled, to show that it did the work.
+rm -rf tmp.sock tmp.cache
+./chibicc --serve tmp.sock -j1 --cache tmp.cache &
+server=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do [ -S tmp.sock ] && break; sleep 0.1; done
+[ -S tmp.sock ] || { echo "server: did not start"; exit 1; }
+for flag in -S -c; do
+  echo "$f $g" | ./chibicc $flag -o tmp.s - || exit
+  echo "$f $g" | ./chibicc $flag --connect tmp.sock -o tmp2.s - || exit
+  cmp tmp.s tmp2.s || { echo "server: $flag"; exit 1; }
+done
+[ -n "$(ls tmp.cache 2>/dev/null)" ] || { echo "server: requests not served"; exit 1; }
+# Errors are relayed with the exit status.
+echo "$e" | ./chibicc --connect tmp.sock -o tmp2.s - 2>tmp.err
+status=$?
+[ $status = 1 ] && grep -q 'not an lvalue' tmp.err || { echo "server: error, status $status"; exit 1; }
+kill -0 $server || { echo "server: died"; exit 1; }
+kill $server
+wait $server 2>/dev/null
+rm -rf tmp.sock tmp.cache
+echo "$f $g" | ./chibicc -c --connect tmp.sock -o tmp2.s - || exit
+cmp tmp.s tmp2.s || { echo "server: no fallback"; exit 1; }
+echo "server OK"
+
+# Compile several files in one invocation. Each output must be the same as compiling its file
+# alone, a file without -o gets its output named after it, and a file that fails to compile
+# doesn't stop the others. The files live in a directory of their own, since every *.c here is
+# a source file of the compiler.
+rm -rf tmp.dir
+mkdir tmp.dir
+echo "$f" > tmp.dir/f.c
+echo "$g" > tmp.dir/g.c
+echo "$h" > tmp.dir/h.c
+echo "int x() { return 1 }" > tmp.dir/err.c
+(cd tmp.dir && ../chibicc -j2 -o f.s -o g.s f.c g.c h.c) || exit
+for c in f g h; do
+  ./chibicc -o tmp.s tmp.dir/$c.c || exit
+  cmp tmp.s tmp.dir/$c.s || { echo "multiple files: $c.c"; exit 1; }
+done
+rm tmp.dir/f.s
+./chibicc -j2 -o tmp.dir/err.s -o tmp.dir/f.s tmp.dir/err.c tmp.dir/f.c 2>/dev/null &&
+  { echo "multiple files: no error"; exit 1; }
+[ -f tmp.dir/err.s ] && { echo "multiple files: output of a failed file"; exit 1; }
+./chibicc -o tmp.s tmp.dir/f.c && cmp tmp.s tmp.dir/f.s || { echo "multiple files: after an error"; exit 1; }
+# -ftime-report counts each file once: the counters of a multi-file compilation are the sums of
+# those of its files.
+counters() {
+  ./chibicc -ftime-report=json "$@" 2>&1 >/dev/null |
+    awk -F'[:,]' '/"(tokens|nodes|functions)"/ { printf "%d ", $2 }'
+}
+read t1 n1 fn1 <<< "$(counters -o tmp.s tmp.dir/f.c)"
+read t2 n2 fn2 <<< "$(counters -o tmp.s tmp.dir/g.c)"
+read t n fn <<< "$(counters -j1 -o tmp.s -o tmp2.s tmp.dir/f.c tmp.dir/g.c)"
+[ "$t $n $fn" = "$((t1+t2)) $((n1+n2)) $((fn1+fn2))" ] ||
+  { echo "multiple files: counters $t $n $fn"; exit 1; }
+rm -rf tmp.dir
+echo "multiple files OK"
+
+# Run all of the tests again in a single process.
+LD_PRELOAD=./tmp2.so ./chibicc --batch tmp.manifest > tmp.batch || { cat tmp.batch; exit 1; }
+tail -n 1 tmp.batch
+
 echo OK
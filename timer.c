@@ -0,0 +1,149 @@
+// This file implements -ftime-report, which reports how much time the
+// compiler spent in each of its phases along with a few counters.
+//
+// A phase is measured with timer_start() and timer_stop() around it.
+// Both do nothing unless the report has been requested, so the calls
+// can stay in the code for good. A phase may be entered many times
+// (assign_lvar_offsets runs once per function) and from several
+// threads at once (functions are compiled in parallel), so the times
+// are summed over all calls and threads.
+
+#include "chibicc.h"
+#include <stdatomic.h>
+#include <time.h>
+
+bool time_report;
+
+_Thread_local Counters counters;
+
+typedef struct {
+  char *name;
+  int level; // Indentation in the report; sub-phases are at level 1
+
+  // Phases running on worker threads are charged the CPU time of the
+  // calling thread. The others get the CPU time of the whole process,
+  // which includes the workers they are waiting for.
+  bool per_thread;
+} TimerInfo;
+
+static TimerInfo timer_info[NUM_TIMERS] = {
+  [T_READ] = {"read", 0},
+  [T_TOKENIZE] = {"tokenize", 0},
+  [T_PARSE] = {"parse", 0},
+  [T_OPTIMIZE] = {"optimize", 1, true},
+  [T_CODEGEN] = {"codegen", 0},
+  [T_LVAR_OFFSETS] = {"assign_lvar_offsets", 1, true},
+  [T_REGALLOC] = {"regalloc", 1, true},
+  [T_OUTPUT] = {"output", 0},
+  [T_ASSEMBLE] = {"assemble", 1, true},
+  [T_RUN] = {"run", 0},
+};
+
+// Accumulated nanoseconds and number of calls
+static atomic_llong wall_ns[NUM_TIMERS];
+static atomic_llong cpu_ns[NUM_TIMERS];
+static atomic_long calls[NUM_TIMERS];
+
+// Start times of the phases the current thread is in
+static _Thread_local long long wall_start[NUM_TIMERS];
+static _Thread_local long long cpu_start[NUM_TIMERS];
+
+static long long clock_ns(clockid_t clk) {
+  // int clock_gettime(clockid_t clockid, struct timespec *tp);
+  // CLOCK_MONOTONIC: A nonsettable system-wide clock that represents monotonic time since some
+  // unspecified point in the past.
+  // CLOCK_PROCESS_CPUTIME_ID: This is a clock that measures CPU time consumed by this process
+  // (i.e., CPU time consumed by all threads in the process).
+  // CLOCK_THREAD_CPUTIME_ID: This is a clock that measures CPU time consumed by this thread.
+  struct timespec ts;
+  clock_gettime(clk, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static clockid_t cpu_clock(TimerId id) {
+  return timer_info[id].per_thread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID;
+}
+
+void timer_start(TimerId id) {
+  if (!time_report)
+    return;
+  wall_start[id] = clock_ns(CLOCK_MONOTONIC);
+  cpu_start[id] = clock_ns(cpu_clock(id));
+}
+
+void timer_stop(TimerId id) {
+  if (!time_report)
+    return;
+  atomic_fetch_add(&cpu_ns[id], clock_ns(cpu_clock(id)) - cpu_start[id]);
+  atomic_fetch_add(&wall_ns[id], clock_ns(CLOCK_MONOTONIC) - wall_start[id]);
+  atomic_fetch_add(&calls[id], 1);
+}
+
+static void print_table(void) {
+  long long total = 0;
+  for (int i = 0; i < NUM_TIMERS; i++)
+    if (timer_info[i].level == 0)
+      total += wall_ns[i];
+
+  fprintf(stderr, "%-24s %12s %12s %8s %10s\n", "phase", "wall (ms)", "cpu (ms)", "wall %",
+          "calls");
+  for (int i = 0; i < NUM_TIMERS; i++) {
+    if (!calls[i])
+      continue;
+    fprintf(stderr, "%*s%-*s %12.3f %12.3f %7.1f%% %10ld\n", timer_info[i].level * 2, "",
+            24 - timer_info[i].level * 2, timer_info[i].name, wall_ns[i] / 1e6, cpu_ns[i] / 1e6,
+            total ? wall_ns[i] * 100.0 / total : 0, (long)calls[i]);
+  }
+  fprintf(stderr, "%-24s %12.3f\n", "total", total / 1e6);
+
+  fprintf(stderr, "\n");
+  fprintf(stderr, "%-24s %12ld\n", "tokens", counters.tokens);
+  fprintf(stderr, "%-24s %12ld\n", "nodes", counters.nodes);
+  fprintf(stderr, "%-24s %12ld\n", "functions", counters.functions);
+  fprintf(stderr, "%-24s %12ld\n", "instructions", counters.instructions);
+  fprintf(stderr, "%-24s %12ld\n", "output bytes", counters.output_bytes);
+  fprintf(stderr, "%-24s %12ld\n", "constants folded", counters.constants_folded);
+  fprintf(stderr, "%-24s %12ld\n", "exprs simplified", counters.exprs_simplified);
+  fprintf(stderr, "%-24s %12ld\n", "branches folded", counters.branches_folded);
+  if (cache_dir) {
+    fprintf(stderr, "%-24s %12ld\n", "cache hits", counters.cache_hits);
+    fprintf(stderr, "%-24s %12ld\n", "cache misses", counters.cache_misses);
+    fprintf(stderr, "%-24s %12ld\n", "cache evictions", counters.cache_evictions);
+  }
+}
+
+static void print_json(void) {
+  fprintf(stderr, "{\n  \"phases\": [\n");
+  bool first = true;
+  for (int i = 0; i < NUM_TIMERS; i++) {
+    if (!calls[i])
+      continue;
+    fprintf(stderr,
+            "%s    {\"name\": \"%s\", \"level\": %d, \"wall_ms\": %.3f, \"cpu_ms\": %.3f, "
+            "\"calls\": %ld}",
+            first ? "" : ",\n", timer_info[i].name, timer_info[i].level, wall_ns[i] / 1e6,
+            cpu_ns[i] / 1e6, (long)calls[i]);
+    first = false;
+  }
+  fprintf(stderr, "\n  ],\n  \"counters\": {\n");
+  fprintf(stderr, "    \"tokens\": %ld,\n", counters.tokens);
+  fprintf(stderr, "    \"nodes\": %ld,\n", counters.nodes);
+  fprintf(stderr, "    \"functions\": %ld,\n", counters.functions);
+  fprintf(stderr, "    \"instructions\": %ld,\n", counters.instructions);
+  fprintf(stderr, "    \"output_bytes\": %ld,\n", counters.output_bytes);
+  fprintf(stderr, "    \"constants_folded\": %ld,\n", counters.constants_folded);
+  fprintf(stderr, "    \"exprs_simplified\": %ld,\n", counters.exprs_simplified);
+  fprintf(stderr, "    \"branches_folded\": %ld,\n", counters.branches_folded);
+  fprintf(stderr, "    \"cache_hits\": %ld,\n", counters.cache_hits);
+  fprintf(stderr, "    \"cache_misses\": %ld,\n", counters.cache_misses);
+  fprintf(stderr, "    \"cache_evictions\": %ld\n", counters.cache_evictions);
+  fprintf(stderr, "  }\n}\n");
+}
+
+// Prints the report to stderr, as a table or as JSON.
+void print_time_report(bool json) {
+  if (json)
+    print_json();
+  else
+    print_table();
+}
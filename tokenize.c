@@ -1,11 +1,56 @@
 #include "chibicc.h"
+#include <pthread.h>
+
+// Input filename
+_Thread_local char *current_filename;
 
 // Input string
-static char *current_input;
+_Thread_local char *current_input;
+
+// Tokens of the input
+_Thread_local TokenArray tokens;
+
+// If set, errors jump here instead of exiting, so that the caller can
+// go on with another compilation.
+_Thread_local jmp_buf *error_jmp;
+
+// If set, error messages go here instead of stderr.
+_Thread_local FILE *error_file;
+
+static char *token_spelling[NUM_TOKEN_IDS];
+
+static FILE *error_out(void) {
+  return error_file ? error_file : stderr;
+}
+
+// Ends the compilation after an error message has been printed.
+noreturn static void fail(void) {
+  // void funlockfile(FILE *filehandle);
+  // The stdio functions are thread-safe. This is achieved by assigning to each FILE object a
+  // lockcount and (if the lockcount is nonzero) an owning thread. flockfile() waits for
+  // *filehandle to be no longer locked by a different thread, then makes the current thread
+  // owner of *filehandle, and increments the lockcount. funlockfile() decrements the lock
+  // count.
+  //
+  // Error messages are printed with several calls, so we hold the
+  // lock on stderr from the first to the last one to keep messages of
+  // concurrent compilations from getting mixed up.
+  funlockfile(error_out());
+
+  // void longjmp(jmp_buf env, int val);
+  // The longjmp() function uses the information saved in env to transfer control back to the
+  // point where setjmp() was called and to restore ("rewind") the stack to its state at the time
+  // of the setjmp() call.
+  if (error_jmp)
+    longjmp(*error_jmp, 1);
+  exit(1);
+}
 
 // Reports an error and exit.
-void error(char *fmt, ...) {
+noreturn void error(char *fmt, ...) {
   va_list ap;
+  FILE *out = error_out();
+  flockfile(out);
 
   // void va_start (va_list ap, paramN);
   // Initialize a variable argument list
@@ -18,8 +63,8 @@ void error(char *fmt, ...) {
   // Writes the C string pointed by format to the stream, replacing any format specifier in the same
   // way as printf does, but using the elements in the variable argument list identified by arg
   // instead of additional function arguments.
-  vfprintf(stderr, fmt, ap);
-  fprintf(stderr, "\n");
+  vfprintf(out, fmt, ap);
+  fprintf(out, "\n");
 
   // void va_end (va_list ap);
   // End using variable argument list
@@ -28,13 +73,38 @@ void error(char *fmt, ...) {
   // This macro should be invoked before the function returns whenever va_start has been invoked
   // from that function.
   va_end(ap);
-  exit(1);
+  fail();
 }
 
-// Reports an error location and exit.
-static void verror_at(char *loc, char *fmt, va_list ap) {
-  int pos = loc - current_input;
-  fprintf(stderr, "%s\n", current_input);
+// Reports an error message in the following format and exit.
+//
+// foo.c:10: x = y + 1;
+//               ^ <error message here>
+noreturn static void verror_at(char *loc, char *fmt, va_list ap) {
+  FILE *out = error_out();
+  flockfile(out);
+
+  // Find a line containing `loc`.
+  char *line = loc;
+  while (current_input < line && line[-1] != '\n')
+    line--;
+
+  char *end = loc;
+  while (*end && *end != '\n')
+    end++;
+
+  // Get a line number.
+  int line_no = 1;
+  for (char *p = current_input; p < line; p++)
+    if (*p == '\n')
+      line_no++;
+
+  // Print out the line. fprintf returns the number of characters written, which is how far the
+  // line text is indented.
+  int indent = fprintf(out, "%s:%d: ", current_filename, line_no);
+  fprintf(out, "%.*s\n", (int)(end - line), line);
+
+  int pos = loc - line + indent;
   // int fprintf ( FILE * stream, const char * format, ... );
   //
   // Write formatted data to stream
@@ -62,43 +132,45 @@ static void verror_at(char *loc, char *fmt, va_list ap) {
   //
   // *: The width is not specified in the format string, but as an additional integer value argument
   // preceding the argument that has to be formatted.
-  fprintf(stderr, "%*s", pos, ""); // print pos spaces.
-  fprintf(stderr, "^ ");
-  vfprintf(stderr, fmt, ap);
-  fprintf(stderr, "\n");
+  fprintf(out, "%*s", pos, ""); // print pos spaces.
+  fprintf(out, "^ ");
+  vfprintf(out, fmt, ap);
+  fprintf(out, "\n");
   va_end(ap);
-  exit(1);
+  fail();
 }
 
-void error_at(char *loc, char *fmt, ...) {
+noreturn void error_at(char *loc, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
   verror_at(loc, fmt, ap);
 }
 
-void error_tok(Token *tok, char *fmt, ...) {
+noreturn void error_tok(Token *tok, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  verror_at(tok->loc, fmt, ap);
+  verror_at(token_loc(tok), fmt, ap);
 }
 
-// Consumes the current token if it matches `op`.
+// Returns true if the current token is spelled `op`. The parser
+// dispatches on Token::id; this string comparison is only a slow path
+// for diagnostics and debugging.
 bool equal(Token *tok, char *op) {
   // strcmp?
-  return memcmp(tok->loc, op, tok->len) == 0 && op[tok->len] == '\0';
+  return memcmp(token_loc(tok), op, tok->len) == 0 && op[tok->len] == '\0';
 }
 
-// Ensure that the current token is `op`.
-Token *skip(Token *tok, char *op) {
-  if (!equal(tok, op))
-    error_tok(tok, "expected '%s'", op);
-  return tok->next;
+// Ensure that the current token is `id`.
+Token *skip(Token *tok, TokenId id) {
+  if (tok->id != id)
+    error_tok(tok, "expected '%s'", token_spelling[id]);
+  return tok + 1;
 }
 
-// The return value indicates whether the tok consumes the str.
-bool consume(Token **rest, Token *tok, char *str) {
-  if (equal(tok, str)) {
-    *rest = tok->next;
+// The return value indicates whether the tok consumes the token `id`.
+bool consume(Token **rest, Token *tok, TokenId id) {
+  if (tok->id == id) {
+    *rest = tok + 1;
     return true;
   }
   *rest = tok;
@@ -114,103 +186,205 @@ static Token *new_token(TokenKind kind, char *start, char *end) {
   // The effective result is the allocation of a zero-initialized memory block of (num*size) bytes.
   // If size is zero, the return value depends on the particular library implementation (it may or
   // may not be a null pointer), but the returned pointer shall not be dereferenced.
-  Token *tok = calloc(1, sizeof(Token));
-  tok->kind = kind;
-  tok->loc = start;
+  //
+  // Tokens are appended to one array instead, which is grown by doubling its size. The array is
+  // kept from one compilation to the next, so after the first one there is usually no heap call
+  // at all.
+  if (tokens.len == tokens.cap) {
+    // void *realloc(void *ptr, size_t size);
+    // The realloc() function changes the size of the memory block pointed to by ptr to size
+    // bytes. The contents will be unchanged in the range from the start of the region up to the
+    // minimum of the old and new sizes.
+    tokens.cap = tokens.cap ? tokens.cap * 2 : 1024;
+    tokens.data = realloc(tokens.data, tokens.cap * sizeof(Token));
+    if (!tokens.data)
+      error("out of memory");
+  }
+
+  Token *tok = &tokens.data[tokens.len++];
+  tok->offset = start - current_input;
   tok->len = end - start;
+  tok->val = 0;
+  tok->kind = kind;
+  tok->id = ID_NONE;
+  mem_stats[MEM_TOKEN].count++;
+  mem_stats[MEM_TOKEN].bytes += sizeof(Token);
+  counters.tokens++;
   return tok;
 }
 
-static bool startswith(char *p, char *q) {
-  // int strncmp ( const char * str1, const char * str2, size_t num );
-  // Compare characters of two strings
-  // Compares up to num characters of the C string str1 to those of the C string str2.
-  // This function starts comparing the first character of each string. If they are equal to each
-  // other, it continues with the following pairs until the characters differ, until a terminating
-  // null-character is reached, or until num characters match in both strings, whichever happens
-  // first.
-  return strncmp(p, q, strlen(q)) == 0;
-}
-
 // Returns true if c is valid as the first character of an identifier.
 static bool is_ident1(char c) {
-  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_';
+  return char_class[(unsigned char)c] & CC_IDENT1;
 }
 
-// Returns true if c is valid as a non-first character of an identifier.
-static bool is_ident2(char c) {
-  return is_ident1(c) || ('0' <= c && c <= '9');
+// Spelling of each punctuator and keyword. Every ASCII punctuation
+// character is a punctuator by itself; multi-character operators are
+// listed on top of them. A longer operator such as "<<=", "->" or "..."
+// is supported by just adding an ID and its spelling here.
+static char *token_spelling[NUM_TOKEN_IDS] = {
+  [P_EQ] = "==", [P_NE] = "!=", [P_LE] = "<=", [P_GE] = ">=",
+  [P_NOT] = "!", [P_DQUOTE] = "\"", [P_HASH] = "#", [P_DOLLAR] = "$",
+  [P_MOD] = "%", [P_AMP] = "&", [P_SQUOTE] = "'", [P_LPAREN] = "(",
+  [P_RPAREN] = ")", [P_STAR] = "*", [P_PLUS] = "+", [P_COMMA] = ",",
+  [P_MINUS] = "-", [P_DOT] = ".", [P_SLASH] = "/", [P_COLON] = ":",
+  [P_SEMI] = ";", [P_LT] = "<", [P_ASSIGN] = "=", [P_GT] = ">",
+  [P_QUESTION] = "?", [P_AT] = "@", [P_LBRACKET] = "[", [P_BACKSLASH] = "\\",
+  [P_RBRACKET] = "]", [P_CARET] = "^", [P_BACKQUOTE] = "`", [P_LBRACE] = "{",
+  [P_OR] = "|", [P_RBRACE] = "}", [P_TILDE] = "~",
+
+  [KW_RETURN] = "return", [KW_IF] = "if", [KW_ELSE] = "else",
+  [KW_FOR] = "for", [KW_WHILE] = "while", [KW_INT] = "int",
+};
+
+// Punctuators are recognized by a DFA built from token_spelling.
+//
+// punct_class maps each of the 256 byte values to a small character
+// class: 0 for bytes that cannot appear in a punctuator, or 1.. for
+// each distinct punctuation character. A state is a prefix of some
+// punctuator; punct_next[state][class] is the state after reading one
+// more character (0 if the prefix cannot be extended), and
+// punct_accept[state] is the ID of the punctuator spelled by the prefix,
+// if any. State 0 is the initial state and never a transition target,
+// so reading a single byte or a two-byte operator costs one or two
+// table lookups.
+#define MAX_PUNCT_CLASSES 33
+#define MAX_PUNCT_STATES 128
+
+static unsigned char punct_class[256];
+static unsigned char punct_next[MAX_PUNCT_STATES][MAX_PUNCT_CLASSES];
+static unsigned char punct_accept[MAX_PUNCT_STATES];
+
+static void init_punct_dfa(void) {
+  int nclasses = 1;
+  int nstates = 1;
+
+  for (int id = 1; id < FIRST_KEYWORD; id++) {
+    int state = 0;
+    for (char *s = token_spelling[id]; *s; s++) {
+      unsigned char c = *s;
+      if (!punct_class[c]) {
+        assert(nclasses < MAX_PUNCT_CLASSES);
+        punct_class[c] = nclasses++;
+      }
+
+      unsigned char *next = &punct_next[state][punct_class[c]];
+      if (!*next) {
+        assert(nstates < MAX_PUNCT_STATES);
+        *next = nstates++;
+      }
+      state = *next;
+    }
+    punct_accept[state] = id;
+  }
 }
 
-// Read a punctuator token from p and returns its length.
-static int read_punct(char *p) {
-  if (startswith(p, "==") || startswith(p, "!=") ||
-      startswith(p, "<=") || startswith(p, ">="))
-    return 2;
+// Read a punctuator token from p and returns its length. The ID of the
+// punctuator is stored to `id`. The longest punctuator that matches
+// wins, so "<=" is read as one token rather than "<" and "=".
+static int read_punct(char *p, TokenId *id) {
+  int state = 0;
+  int len = 0;
 
-  // int ispunct ( int c );
-  // Check if character is a punctuation character
-  // Checks whether c is a punctuation character.
-  return ispunct(*p) ? 1 : 0;
+  // A NUL byte is in class 0, which has no transitions, so the loop
+  // never reads past the end of the input.
+  for (int i = 0;; i++) {
+    state = punct_next[state][punct_class[(unsigned char)p[i]]];
+    if (!state)
+      return len;
+    if (punct_accept[state]) {
+      len = i + 1;
+      *id = punct_accept[state];
+    }
+  }
 }
 
-static bool is_keyword(Token *tok) {
-  static char *kw[] = {"return", "if", "else", "for", "while", "int"};
+// Keywords are recognized with a perfect hash computed from the length
+// and the first and last characters of an identifier, so classifying an
+// identifier costs one table lookup and one string comparison no matter
+// how many keywords there are.
+//
+// The table is laid out by the C compiler itself: each keyword is put
+// at its hash slot with a designated initializer. If a new keyword
+// collides with an existing one, two initializers name the same slot,
+// which the Makefile turns into a build error (-Werror=override-init).
+// Adjust the multiplier or the table size when that happens.
+#define KW_HASH(len, first, last) (((len) * 4 + (first) + (last)) & 63)
 
-  for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-    if (equal(tok, kw[i]))
-      return true;
-  return false;
+static TokenId keywords[64] = {
+  [KW_HASH(6, 'r', 'n')] = KW_RETURN,
+  [KW_HASH(2, 'i', 'f')] = KW_IF,
+  [KW_HASH(4, 'e', 'e')] = KW_ELSE,
+  [KW_HASH(3, 'f', 'r')] = KW_FOR,
+  [KW_HASH(5, 'w', 'e')] = KW_WHILE,
+  [KW_HASH(3, 'i', 't')] = KW_INT,
+};
+
+// Returns the keyword ID of a given identifier, or ID_NONE if it is
+// not a keyword.
+static TokenId keyword_id(char *start, int len) {
+  TokenId id = keywords[KW_HASH(len, start[0], start[len - 1])];
+  char *kw = token_spelling[id];
+  if (id && !strncmp(kw, start, len) && kw[len] == '\0')
+    return id;
+  return ID_NONE;
 }
 
-static void convert_keywords(Token *tok) {
-  for (Token *t = tok; t->kind != TK_EOF; t = t->next)
-    if (is_keyword(t))
-      t->kind = TK_KEYWORD;
+static void init_tokenizer(void) {
+  init_scanner();
+  init_punct_dfa();
 }
 
-// Tokenize a given string and returns new tokens.
+// Tokenize a given string and returns new tokens. The tokens stay
+// valid until the next call.
 Token *tokenize(char *p) {
+  // int pthread_once(pthread_once_t *once_control, void (*init_routine)(void));
+  // The first call to pthread_once() by any thread in a process, with a given once_control, shall
+  // call the init_routine with no arguments. Subsequent calls of pthread_once() with the same
+  // once_control shall not call the init_routine.
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, init_tokenizer);
+
   current_input = p;
-  Token head = {};
-  Token *cur = &head;
+  tokens.len = 0;
+
+  // The token being built. It points into the array, so it is only
+  // used until the next call of new_token(), which may move the array.
+  Token *cur;
 
   while (*p) {
     // Skip whitespace characters.
-    if (isspace(*p)) {
-      p++;
+    if (char_class[(unsigned char)*p] & CC_SPACE) {
+      p = scanner->skip_space(p);
       continue;
     }
 
     // Numeric literal
-    if (isdigit(*p)) {
-      cur = cur->next = new_token(TK_NUM, p, p);
-      char *q = p;
-      // unsigned long int strtoul (const char* str, char** endptr, int base);
-      // Convert string to unsigned long integer
-      // Parses the C-string str, interpreting its content as an integral number of the specified
-      // base, which is returned as an value of type unsigned long int.
-      // This function operates like strtol to interpret the string, but produces numbers of type
-      // unsigned long int (see strtol for details on the interpretation process).
-      cur->val = strtoul(p, &p, 10);
-      cur->len = p - q;
+    if (char_class[(unsigned char)*p] & CC_DIGIT) {
+      char *start = p;
+      p = scanner->skip_digits(p);
+      cur = new_token(TK_NUM, start, p);
+      for (char *q = start; q < p; q++)
+        cur->val = cur->val * 10 + (*q - '0');
       continue;
     }
 
     // Identifier or keyword
     if (is_ident1(*p)) {
       char *start = p;
-      do {
-        p++;
-      } while (is_ident2(*p));
-      cur = cur->next = new_token(TK_IDENT, start, p);
+      p = scanner->skip_ident(p + 1);
+      TokenId id = keyword_id(start, p - start);
+      cur = new_token(id ? TK_KEYWORD : TK_IDENT, start, p);
+      cur->id = id;
       continue;
     }
 
     // Punctuators
-    int punct_len = read_punct(p);
+    TokenId id;
+    int punct_len = read_punct(p, &id);
     if (punct_len) {
-      cur = cur->next = new_token(TK_PUNCT, p, p + punct_len);
+      cur = new_token(TK_PUNCT, p, p + punct_len);
+      cur->id = id;
       p += cur->len;
       continue;
     }
@@ -218,7 +392,149 @@ Token *tokenize(char *p) {
     error_at(p, "invalid token");
   }
 
-  cur = cur->next = new_token(TK_EOF, p, p);
-  convert_keywords(head.next);
-  return head.next;
+  // Offsets are 32 bits.
+  if (p - current_input > UINT32_MAX)
+    error("%s: input too large", current_filename);
+
+  new_token(TK_EOF, p, p);
+  return tokens.data;
+}
+
+// Every buffer returned by read_file() is preceded by a header that
+// tells free_file() how to release it.
+typedef struct {
+  size_t mapped; // Size of the mapping, or 0 if the buffer is on the heap
+  size_t unused; // Keeps the contents 16-byte aligned
+} FileHeader;
+
+// Reads the rest of a stream into a NUL-terminated buffer. This is the
+// fallback for inputs that cannot be mapped, such as stdin or a pipe.
+// Returns NULL with errno set if the stream can't be read.
+static char *read_stream(int fd) {
+  size_t cap = 1 << 16;
+  size_t len = sizeof(FileHeader);
+  char *buf = malloc(cap);
+
+  for (;;) {
+    // Keep room for the zero padding after the last byte.
+    if (cap - len < INPUT_PADDING + 1) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+
+    // ssize_t read(int fd, void *buf, size_t count);
+    // read() attempts to read up to count bytes from file descriptor fd into the buffer starting
+    // at buf. On success, the number of bytes read is returned (zero indicates end of file).
+    ssize_t n = read(fd, buf + len, cap - len - INPUT_PADDING - 1);
+    if (n == 0)
+      break;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      int err = errno;
+      free(buf);
+      errno = err;
+      return NULL;
+    }
+    len += n;
+  }
+
+  memset(buf + len, 0, INPUT_PADDING + 1);
+  *(FileHeader *)buf = (FileHeader){.mapped = 0};
+  return buf + sizeof(FileHeader);
+}
+
+// Maps a regular file read-only. The mapping is followed by at least
+// one page of zeros, so the result can be scanned as a NUL-terminated
+// string (and read a few bytes past the terminator) without copying.
+static char *map_file(int fd, size_t size) {
+  // long sysconf(int name);
+  // _SC_PAGESIZE: Size of a page in bytes.
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t mapped = (size + page - 1) / page * page;
+
+  // void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+  // mmap() creates a new mapping in the virtual address space of the calling process.
+  //
+  // MAP_ANONYMOUS: The mapping is not backed by any file; its contents are initialized to zero.
+  //
+  // First reserve an anonymous zero-filled region two pages larger than the file, then map the
+  // file over its middle with MAP_FIXED. The first page holds the header, the remainder of the
+  // last file page is zero-filled by the kernel and the extra page at the end acts as a guard
+  // holding the terminator.
+  size_t total = page + mapped + page;
+  char *base = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return NULL;
+
+  // MAP_FIXED: Don't interpret addr as a hint: place the mapping at exactly that address.
+  char *buf = base + page;
+  if (mmap(buf, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(base, total);
+    return NULL;
+  }
+  ((FileHeader *)buf)[-1] = (FileHeader){.mapped = total};
+  return buf;
+}
+
+// Returns the contents of a given file. "-" means stdin.
+//
+// Errors are reported after the file is closed and the buffer freed,
+// since error() may return to a caller that goes on compiling.
+char *read_file(char *path) {
+  if (!strcmp(path, "-")) {
+    char *buf = read_stream(STDIN_FILENO);
+    if (!buf)
+      error("cannot read %s: %s", path, strerror(errno));
+    return buf;
+  }
+
+  // int open(const char *pathname, int flags);
+  // The open() system call opens the file specified by pathname.
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    error("cannot open %s: %s", path, strerror(errno));
+
+  // int fstat(int fd, struct stat *statbuf);
+  // These functions return information about a file, in the buffer pointed to by statbuf.
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    int err = errno;
+    close(fd);
+    error("cannot stat %s: %s", path, strerror(err));
+  }
+
+  char *buf = NULL;
+  if (S_ISREG(st.st_mode) && st.st_size > 0)
+    buf = map_file(fd, st.st_size);
+  if (!buf)
+    buf = read_stream(fd);
+
+  // The mapping stays valid after the file descriptor is closed.
+  int err = errno;
+  close(fd);
+  if (!buf)
+    error("cannot read %s: %s", path, strerror(err));
+  return buf;
+}
+
+// Releases a buffer returned by read_file().
+void free_file(char *buf) {
+  FileHeader *hdr = (FileHeader *)buf - 1;
+  if (hdr->mapped)
+    munmap(buf - sysconf(_SC_PAGESIZE), hdr->mapped);
+  else
+    free(hdr);
+}
+
+// Tokenize a string that must be followed by INPUT_PADDING zero bytes.
+// `name` is used in error messages.
+Token *tokenize_string(char *name, char *input) {
+  current_filename = name;
+  return tokenize(input);
+}
+
+// Tokenize the contents of a given file.
+Token *tokenize_file(char *path) {
+  return tokenize_string(path, read_file(path));
 }
@@ -21,65 +21,89 @@ bool is_integer(Type *ty) {
   return ty->kind == TY_INT;
 }
 
-Type *copy_type(Type *ty) {
-  Type *ret = calloc(1, sizeof(Type));
-  *ret = *ty;
-  return ret;
+// Derived types are hash-consed: there is only one Type for each
+// structure, so `int *` is the same object wherever it appears and two
+// types are equal if and only if they are the same pointer.
+//
+// The structure of a type is written out as a key of machine words,
+//
+//   kind, base or return type, array length or number of parameters,
+//   parameter types...
+//
+// and looked up in a hash table of the types made so far. A new type
+// keeps its key at its end, where the table refers to it, and a
+// function type's parameter list is just the tail of its key.
+//
+// Types are shared, so they must not carry anything that belongs to a
+// particular declaration, such as the declared name.
+
+// All derived types of the current thread's compilation
+static _Thread_local HashMap types;
+
+// Returns the type with the structure of `tmpl` and `key`, creating
+// it if it doesn't exist yet.
+static Type *intern_type(Type *tmpl, uintptr_t *key, int nwords) {
+  int keylen = nwords * sizeof(uintptr_t);
+  Type *ty = hashmap_get2(&types, (char *)key, keylen);
+  if (ty)
+    return ty;
+
+  ty = arena_alloc(&type_arena, MEM_TYPE, sizeof(Type) + keylen);
+  *ty = *tmpl;
+  memcpy(ty->key, key, keylen);
+  hashmap_put2(&types, (char *)ty->key, keylen, ty);
+  return ty;
 }
 
 Type *pointer_to(Type *base) {
-  Type *ty = calloc(1, sizeof(Type));
-  ty->kind = TY_PTR;
-  ty->size = 8;
-  ty->base = base;
-  return ty;
+  uintptr_t key[] = {TY_PTR, (uintptr_t)base, 0};
+  return intern_type(&(Type){.kind = TY_PTR, .size = 8, .base = base}, key, 3);
 }
 
-Type *func_type(Type *return_ty) {
-  Type *ty = calloc(1, sizeof(Type));
-  ty->kind = TY_FUNC;
-  ty->return_ty = return_ty;
+Type *func_type(Type *return_ty, Type **params, int nparams) {
+  uintptr_t key[3 + nparams];
+  key[0] = TY_FUNC;
+  key[1] = (uintptr_t)return_ty;
+  key[2] = nparams;
+  memcpy(key + 3, params, nparams * sizeof(Type *));
+
+  Type *ty = intern_type(&(Type){.kind = TY_FUNC, .return_ty = return_ty, .nparams = nparams},
+                         key, 3 + nparams);
+  ty->params = (Type **)(ty->key + 3);
   return ty;
 }
 
 Type *array_of(Type *base, int len) {
-  Type *ty = calloc(1, sizeof(Type));
-  ty->kind = TY_ARRAY;
-  ty->size = base->size * len;
-  ty->base = base;
-  ty->array_len = len;
-  return ty;
+  uintptr_t key[] = {TY_ARRAY, (uintptr_t)base, len};
+  Type tmpl = {.kind = TY_ARRAY, .size = base->size * len, .base = base, .array_len = len};
+  return intern_type(&tmpl, key, 3);
 }
 
-void add_type(Node *node) {
-  if (!node || node->ty)
-    return;
-
-  add_type(node->lhs);
-  add_type(node->rhs);
-  add_type(node->cond);
-  add_type(node->then);
-  add_type(node->els);
-  add_type(node->init);
-  add_type(node->inc);
-
-  for (Node *n = node->body; n; n = n->next)
-    add_type(n);
-  for (Node *n = node->args; n; n = n->next)
-    add_type(n);
+// Forgets all types. Their storage belongs to the type arena and is
+// released together with it.
+void type_reset(void) {
+  hashmap_clear(&types);
+}
 
+// Sets the type of an expression node from the types of its operands.
+//
+// The parser calls this on every node right after building it, when
+// the operands already have their types, so each node is typed exactly
+// once and no separate pass over the tree is needed. Statements have
+// no type.
+void add_type(Node *node) {
   switch (node->kind) {
   case ND_ADD:
   case ND_SUB:
   case ND_MUL:
   case ND_DIV:
   case ND_NEG:
-    node->ty = node->lhs->ty;
+    node->ty = node_lhs(node)->ty;
     return;
   case ND_ASSIGN:
-    if (node->lhs->ty->kind == TY_ARRAY)
-      error_tok(node->lhs->tok, "not an lvalue");
-    node->ty = node->lhs->ty;
+    if (node_lhs(node)->ty->kind == TY_ARRAY)
+      error_tok(node_lhs(node)->tok, "not an lvalue");
+    node->ty = node_lhs(node)->ty;
     return;
   case ND_EQ:
   case ND_NE:
@@ -93,15 +117,15 @@ void add_type(Node *node) {
     node->ty = node->var->ty;
     return;
   case ND_ADDR:
-    if (node->lhs->ty->kind == TY_ARRAY)
-      node->ty = pointer_to(node->lhs->ty->base);
+    if (node_lhs(node)->ty->kind == TY_ARRAY)
+      node->ty = pointer_to(node_lhs(node)->ty->base);
     else
-      node->ty = pointer_to(node->lhs->ty);
+      node->ty = pointer_to(node_lhs(node)->ty);
     return;
   case ND_DEREF:
-    if (!node->lhs->ty->base)
+    if (!node_lhs(node)->ty->base)
       error_tok(node->tok, "invalid pointer dereference");
-    node->ty = node->lhs->ty->base;
+    node->ty = node_lhs(node)->ty->base;
     return;
   }
 }